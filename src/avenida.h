@@ -9,7 +9,6 @@
 #define AVENIDA_AVENIDA_H
 
 #define AVENIDA_VERSION "0.0.0a"
-#define AVNMEDIA_MAX_OPS 1024
 
 #define AVENIDA_PROMPT "avenida> "
 #define AVENIDA_HISTORYFILE "avenida.history"
@@ -5,19 +5,34 @@
  * Christian Koch <cfkoch@sdf.lonestar.org>
  */
 
+#include <limits.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <lua.h>
 #include <lauxlib.h>
 
+#include "cJSON.h"
+#include "cache.h"
 #include "errors.h"
+#include "oplist.h"
+#include "pixelcache.h"
+#include "plan.h"
 #include "raster.h"
+#include "resample.h"
+#include "stream.h"
+#include "tiles.h"
+#include "variants.h"
 
-#define AVNRASTER_ARG1 ((avnraster**)luaL_checkudata(L, 1, "avnraster"))
+#define AVNRASTER_ARG1 (avenida_checkraster(L, 1))
 
+static int avenida_apply(lua_State *);
 static int avenida_border(lua_State *);
 static int avenida_brightness(lua_State *);
+static int avenida_cache(lua_State *);
 static int avenida_charcoal(lua_State *);
+static int avenida_close(lua_State *);
 static int avenida_crop(lua_State *);
 static int avenida_despeckle(lua_State *);
 static int avenida_edge(lua_State *);
@@ -29,6 +44,7 @@ static int avenida_horizontalflip(lua_State *);
 static int avenida_hue(lua_State *);
 static int avenida_implode(lua_State *);
 static int avenida_info(lua_State *);
+static int avenida_info_index(lua_State *);
 static int avenida_levels(lua_State *);
 static int avenida_motionblur(lua_State *);
 static int avenida_negate(lua_State *);
@@ -36,6 +52,10 @@ static int avenida_negategrays(lua_State *);
 static int avenida_normalize(lua_State *);
 static int avenida_oilpaint(lua_State *);
 static int avenida_open(lua_State *);
+static int avenida_openblob(lua_State *);
+static int avenida_pixelcache(lua_State *);
+static int avenida_plan(lua_State *);
+static int avenida_plan_gc(lua_State *);
 static int avenida_radialblur(lua_State *);
 static int avenida_render(lua_State *);
 static int avenida_resize(lua_State *);
@@ -44,18 +64,50 @@ static int avenida_rotate(lua_State *);
 static int avenida_saturation(lua_State *);
 static int avenida_scale(lua_State *);
 static int avenida_sharpen(lua_State *);
+static int avenida_snapshots(lua_State *);
+static int avenida_stream(lua_State *);
 static int avenida_swirl(lua_State *);
+static int avenida_threads(lua_State *);
 static int avenida_tint(lua_State *);
+static int avenida_toblob(lua_State *);
+static int avenida_variants(lua_State *);
 static int avenida_verticalflip(lua_State *);
 static int avenida_wave(lua_State *);
 static int avenida_write(lua_State *);
+static int avenida_write_options(lua_State *, const int, avnwriteopts *);
 
 static int avenida_serialize(lua_State *);
 
+static avnraster **avenida_checkraster(lua_State *, const int);
+static cJSON *avenida_plan_table(lua_State *, const int);
+static void avenida_pressure(lua_State *, const avnraster *);
+
 int luaopen_raster(lua_State *L);
 
 /* */
 
+/*
+ * avenida.apply(plan, avnraster)
+ *
+ * Records every op in the plan on the raster, as one call.
+ */
+static int
+avenida_apply(lua_State *L)
+{
+	avnoplist *plan;
+	avnraster **avn;
+
+	plan = (avnoplist*)luaL_checkudata(L, 1, "avnplan");
+	avn = avenida_checkraster(L, 2);
+
+	if (!avnraster_add_plan(*avn, plan))
+		return DEFAULT_ERROR;
+
+	lua_settop(L, 0);
+	return 0;
+}
+
+
 /*
  * avenida.border(avnraster, width, height, color)
  */
@@ -105,6 +157,62 @@ avenida_brightness(lua_State *L)
 }
 
 
+/*
+ * table = avenida.cache([false | {dir = path, size = bytes}])
+ *
+ * Turns the render cache on with the given options (both optional), or off
+ * with false. Either way, returns the cache's current settings and how
+ * many hits and misses it has had.
+ */
+static int
+avenida_cache(lua_State *L)
+{
+	struct avncachestats stats;
+	const char *dir = NULL;
+	lua_Integer size = 0;
+
+	if (lua_isboolean(L, 1) && !lua_toboolean(L, 1)) {
+		avncache_disable();
+	} else if (!lua_isnoneornil(L, 1)) {
+		luaL_checktype(L, 1, LUA_TTABLE);
+
+		lua_getfield(L, 1, "dir");
+		if (!lua_isnil(L, -1))
+			dir = luaL_checkstring(L, -1);
+
+		lua_getfield(L, 1, "size");
+		if (!lua_isnil(L, -1)) {
+			size = luaL_checkinteger(L, -1);
+			if (size < 1)
+				return RANGE_ERROR((double)size);
+		}
+
+		if (!avncache_enable(dir, (off_t)size))
+			return luaL_error(L, "couldn't use cache directory \"%s\"",
+				dir != NULL ? dir : "(default)");
+	}
+
+	lua_settop(L, 0);
+	avncache_stats(&stats);
+
+	lua_createtable(L, 0, 6);
+	lua_pushboolean(L, stats.enabled);
+	lua_setfield(L, -2, "enabled");
+	lua_pushstring(L, stats.dir);
+	lua_setfield(L, -2, "dir");
+	lua_pushinteger(L, stats.size);
+	lua_setfield(L, -2, "size");
+	lua_pushinteger(L, stats.used);
+	lua_setfield(L, -2, "used");
+	lua_pushinteger(L, stats.hits);
+	lua_setfield(L, -2, "hits");
+	lua_pushinteger(L, stats.misses);
+	lua_setfield(L, -2, "misses");
+
+	return 1;
+}
+
+
 static int
 avenida_charcoal(lua_State *L)
 {
@@ -125,6 +233,25 @@ avenida_charcoal(lua_State *L)
 }
 
 
+/*
+ * avenida.close(avnraster)
+ *
+ * Frees the raster's pixels and history right away, rather than whenever
+ * the garbage collector gets around to it; this is also its __gc. Using the
+ * raster afterwards is an error, but closing it again is fine.
+ */
+static int
+avenida_close(lua_State *L)
+{
+	avnraster **avn;
+
+	avn = (avnraster**)luaL_checkudata(L, 1, "avnraster");
+	avnraster_free(*avn);
+	*avn = NULL;
+	return 0;
+}
+
+
 /*
  * avenida.crop(avnraster, x, y, width, height)
  */
@@ -353,6 +480,10 @@ avenida_implode(lua_State *L)
 
 /*
  * table = avenida.info(avnraster)
+ *
+ * Everything but "ncolors" comes from the header. Counting the colors
+ * means decoding the image, so that's only done if the script actually
+ * looks at it.
  */
 static int
 avenida_info(lua_State *L)
@@ -360,27 +491,84 @@ avenida_info(lua_State *L)
 	avnraster **avn;
 
 	avn = AVNRASTER_ARG1;
-	lua_pop(L, 1);
 
-	lua_createtable(L, 0, 5);
+	/* A render that was put off may well change the dimensions. */
+	avnraster_sync(*avn);
+
+	lua_createtable(L, 0, 6);
 	lua_pushinteger(L, (*avn)->info.width);
 	lua_setfield(L, -2, "width");
 	lua_pushinteger(L, (*avn)->info.height);
 	lua_setfield(L, -2, "height");
+	lua_pushinteger(L, (*avn)->info.depth);
+	lua_setfield(L, -2, "depth");
+	lua_pushboolean(L, (*avn)->info.alpha);
+	lua_setfield(L, -2, "alpha");
 	lua_pushstring(L, (*avn)->info.codec);
 	lua_setfield(L, -2, "codec");
 	lua_pushstring(L, (*avn)->info.path);
 	lua_setfield(L, -2, "path");
-	lua_pushinteger(L, avnraster_info_ncolors(*avn));
-	lua_setfield(L, -2, "ncolors");
 
+	/* The metatable's __index keeps the raster alive for as long as it is. */
+	lua_createtable(L, 0, 1);
+	lua_pushvalue(L, 1);
+	lua_pushcclosure(L, avenida_info_index, 1);
+	lua_setfield(L, -2, "__index");
+	lua_setmetatable(L, -2);
+
+	return 1;
+}
+
+
+static int
+avenida_info_index(lua_State *L)
+{
+	avnraster **avn;
+	const char *key;
+
+	avn = (avnraster**)lua_touserdata(L, lua_upvalueindex(1));
+	key = lua_tostring(L, 2);
+
+	if (*avn == NULL)
+		return luaL_error(L, "raster is closed");
+
+	if ((key == NULL) || (strcmp(key, "ncolors") != 0))
+		return 0;
+
+	lua_pushinteger(L, avnraster_info_ncolors(*avn));
+	lua_pushvalue(L, -1);
+	lua_setfield(L, 1, "ncolors");
 	return 1;
 }
 
 
+/*
+ * raster.levels(img, black, white, gamma?)
+ *
+ * The black and white points are percentages. The gamma defaults to 1.0.
+ */
 static int
 avenida_levels(lua_State *L)
 {
+	avnraster **avn;
+	double black, white, gamma;
+
+	avn = AVNRASTER_ARG1;
+	black = luaL_checknumber(L, 2);
+	white = luaL_checknumber(L, 3);
+	gamma = luaL_optnumber(L, 4, 1.0);
+	lua_settop(L, 0);
+
+	if ((black < 0.0) || (black > 100.0))
+		return RANGE_ERROR(black);
+	if ((white <= black) || (white > 100.0))
+		return RANGE_ERROR(white);
+	if (gamma <= 0.0)
+		return RANGE_ERROR(gamma);
+
+	if (!avnraster_levels(*avn, black, white, gamma))
+		return DEFAULT_ERROR;
+
 	return 0;
 }
 
@@ -489,6 +677,7 @@ avenida_oilpaint(lua_State *L)
  * avnraster? = avenida.open(path)
  *
  * Returns an "avnraster" userdata if successful, or nil if there's an issue.
+ * A path of "-" reads the image from standard input.
  */
 static int
 avenida_open(lua_State *L)
@@ -497,23 +686,164 @@ avenida_open(lua_State *L)
 	char *path;
 
 	path = (char*)luaL_checkstring(L, 1);
-	lua_pop(L, 1);
 
+	/* The path stays on the stack so it can't be collected under us. */
 	avn = (avnraster**)lua_newuserdata(L, sizeof(avnraster *));
-	*avn = avnraster_new(path);
+	if ((*avn = avnraster_new(path)) == NULL)
+		return DEFAULT_ERROR;
 
 	if (avnraster_open(*avn)) {
 		luaL_setmetatable(L, "avnraster");
 	} else {
 		avnraster_free(*avn);
+		*avn = NULL;
 		luaL_error(L, "couldn't open raster \"%s\"", path);
 		return 0;
 	}
 
+	avenida_pressure(L, *avn);
+	return 1;
+}
+
+
+/*
+ * avnraster = avenida.openblob(string)
+ *
+ * Same as avenida.open(), but the string is the image itself. The decoder
+ * reads it in place, without copying it first.
+ */
+static int
+avenida_openblob(lua_State *L)
+{
+	avnraster **avn;
+	const char *data;
+	size_t len;
+
+	data = luaL_checklstring(L, 1, &len);
+
+	avn = (avnraster**)lua_newuserdata(L, sizeof(avnraster *));
+	if ((*avn = avnraster_new("(blob)")) == NULL)
+		return DEFAULT_ERROR;
+
+	if (!avnraster_open_blob(*avn, data, len)) {
+		avnraster_free(*avn);
+		*avn = NULL;
+		return luaL_error(L, "couldn't open raster from a %d byte string",
+			(int)len);
+	}
+
+	luaL_setmetatable(L, "avnraster");
+	avenida_pressure(L, *avn);
+	return 1;
+}
+
+
+/*
+ * stats = avenida.pixelcache([false | {dir=, threshold=}])
+ *
+ * Turns the pixel cache on with the given options (both optional), or off
+ * with false, so that big images are kept in mapped scratch files instead
+ * of in memory. Either way, returns the current settings and how many
+ * bytes are mapped now, and at most so far.
+ */
+static int
+avenida_pixelcache(lua_State *L)
+{
+	struct avnpixelcachestats stats;
+	const char *dir = NULL;
+	lua_Integer threshold = 0;
+
+	if (lua_isboolean(L, 1) && !lua_toboolean(L, 1)) {
+		avnpixelcache_disable();
+	} else if (!lua_isnoneornil(L, 1)) {
+		luaL_checktype(L, 1, LUA_TTABLE);
+
+		lua_getfield(L, 1, "dir");
+		if (!lua_isnil(L, -1))
+			dir = luaL_checkstring(L, -1);
+
+		lua_getfield(L, 1, "threshold");
+		if (!lua_isnil(L, -1)) {
+			threshold = luaL_checkinteger(L, -1);
+			if (threshold < 1)
+				return RANGE_ERROR((double)threshold);
+		}
+
+		if (!avnpixelcache_enable(dir, (size_t)threshold))
+			return luaL_error(L, "couldn't use scratch directory \"%s\"",
+				dir != NULL ? dir : "(default)");
+	}
+
+	lua_settop(L, 0);
+	avnpixelcache_stats(&stats);
+
+	lua_createtable(L, 0, 5);
+	lua_pushboolean(L, stats.enabled);
+	lua_setfield(L, -2, "enabled");
+	lua_pushstring(L, stats.dir);
+	lua_setfield(L, -2, "dir");
+	lua_pushinteger(L, stats.threshold);
+	lua_setfield(L, -2, "threshold");
+	lua_pushinteger(L, stats.mapped);
+	lua_setfield(L, -2, "mapped");
+	lua_pushinteger(L, stats.peak);
+	lua_setfield(L, -2, "peak");
+
+	return 1;
+}
+
+
+/*
+ * plan = avenida.plan({{"gamma", 1.2}, {"resize", 800, 600, "lanczos3"}})
+ * plan = avenida.plan(json)
+ *
+ * Checks a list of ops once, so that it can be applied to any number of
+ * rasters with avenida.apply(). The ops can also be given the way
+ * avenida.serialize() writes them, either as a table or as the JSON itself.
+ * Each op takes all of its arguments, with no defaults.
+ */
+static int
+avenida_plan(lua_State *L)
+{
+	avnoplist *plan;
+	cJSON *json;
+	int bad;
+	bool ok;
+
+	if (lua_type(L, 1) != LUA_TSTRING)
+		luaL_checktype(L, 1, LUA_TTABLE);
+	lua_settop(L, 1);
+
+	plan = (avnoplist*)lua_newuserdata(L, sizeof(avnoplist));
+	avnoplist_init(plan);
+	luaL_setmetatable(L, "avnplan");
+
+	if (lua_type(L, 1) == LUA_TSTRING) {
+		ok = avnplan_parse(plan, lua_tostring(L, 1), &bad);
+	} else {
+		json = avenida_plan_table(L, 1);
+		ok = avnplan_from_json(plan, json, &bad);
+		cJSON_Delete(json);
+	}
+
+	if (!ok) {
+		if (bad >= 0)
+			return luaL_error(L, "op %d of the plan isn't valid", bad + 1);
+		return luaL_error(L, "plan isn't a list of ops");
+	}
+
 	return 1;
 }
 
 
+static int
+avenida_plan_gc(lua_State *L)
+{
+	avnoplist_free((avnoplist*)luaL_checkudata(L, 1, "avnplan"));
+	return 0;
+}
+
+
 /*
  * avenida.radialblur(avnraster, angle)
  */
@@ -535,40 +865,82 @@ avenida_radialblur(lua_State *L)
 
 
 /*
- * avenida.render(avnraster)
+ * profile = avenida.render(avnraster, [verbose])
+ *
+ * The profile has one table per step of the render, in order, like
+ *
+ *     {name="negate+gamma", ops=2, wall_ms=8.1, cpu_ms=30.9,
+ *      pixels=1000000, peak_rss_delta_kb=0}
+ *
+ * It's empty when the render cache puts the render off.
  */
 static int
 avenida_render(lua_State *L)
 {
 	avnraster **avn;
+	const struct avnprofile *prof;
 	bool verbose;
+	unsigned int i;
 
 	avn = AVNRASTER_ARG1;
 	verbose = lua_toboolean(L, 2);
-	lua_pop(L, 2);
+
+	/* The raster stays on the stack so it can't be collected under us. */
+	lua_settop(L, 1);
 
 	avnraster_render(*avn, verbose);
-	return 0;
+	avenida_pressure(L, *avn);
+
+	lua_createtable(L, (*avn)->nprofile, 0);
+
+	for (i = 0; i < (*avn)->nprofile; i++) {
+		prof = &(*avn)->profile[i];
+		lua_createtable(L, 0, 6);
+		lua_pushstring(L, prof->name);
+		lua_setfield(L, -2, "name");
+		lua_pushinteger(L, prof->nops);
+		lua_setfield(L, -2, "ops");
+		lua_pushnumber(L, prof->wall_ms);
+		lua_setfield(L, -2, "wall_ms");
+		lua_pushnumber(L, prof->cpu_ms);
+		lua_setfield(L, -2, "cpu_ms");
+		lua_pushinteger(L, prof->pixels);
+		lua_setfield(L, -2, "pixels");
+		lua_pushinteger(L, prof->peak_rss_delta_kb);
+		lua_setfield(L, -2, "peak_rss_delta_kb");
+		lua_rawseti(L, -2, i + 1);
+	}
+
+	return 1;
 }
 
 
 /*
- * avenida.resize(avnraster, width, height)
+ * avenida.resize(avnraster, width, height, [filter])
+ *
+ * The filter is "box", "triangle", "catrom", "lanczos2" or "lanczos3"
+ * (the default).
  */
 static int
 avenida_resize(lua_State *L)
 {
 	avnraster **avn;
 	size_t width, height;
+	const char *filter;
+	enum avnfilter f;
 
 	avn = AVNRASTER_ARG1;
 	width = (size_t)luaL_checkinteger(L, 2);
 	height = (size_t)luaL_checkinteger(L, 3);
-	lua_pop(L, 3);
+	filter = luaL_optstring(L, 4, NULL);
 
-	if (!avnraster_resize(*avn, width, height))
+	if ((filter != NULL) && !avnresample_filter(filter, &f))
+		return luaL_error(L, "unknown filter \"%s\"", filter);
+
+	if (!avnraster_resize(*avn, width, height, filter))
 		return DEFAULT_ERROR;
 
+	lua_settop(L, 0);
 	return 0;
 }
 
@@ -649,24 +1021,32 @@ avenida_saturation(lua_State *L)
 
 
 /*
- * avenida.scale(avnraster, factor)
+ * avenida.scale(avnraster, factor, [filter])
+ *
+ * Same filters as avenida.resize(), but the default is "box".
  */
 static int
 avenida_scale(lua_State *L)
 {
 	avnraster **avn;
 	double factor;
+	const char *filter;
+	enum avnfilter f;
 
 	avn = AVNRASTER_ARG1;
 	factor = luaL_checknumber(L, 2);
-	lua_pop(L, 2);
+	filter = luaL_optstring(L, 3, NULL);
 
 	if (factor <= 0.0)
 		return RANGE_ERROR(factor);
 
-	if (!avnraster_scale(*avn, factor))
+	if ((filter != NULL) && !avnresample_filter(filter, &f))
+		return luaL_error(L, "unknown filter \"%s\"", filter);
+
+	if (!avnraster_scale(*avn, factor, filter))
 		return DEFAULT_ERROR;
 
+	lua_settop(L, 0);
 	return 0;
 }
 
@@ -691,6 +1071,54 @@ avenida_sharpen(lua_State *L)
 }
 
 
+/*
+ * integer = avenida.snapshots([bytes])
+ *
+ * Sets how much memory each raster may spend on remembering intermediate
+ * renders, where zero turns it off. Either way, returns the budget.
+ */
+static int
+avenida_snapshots(lua_State *L)
+{
+	lua_Integer n;
+
+	if (lua_gettop(L) >= 1) {
+		n = luaL_checkinteger(L, 1);
+		lua_pop(L, 1);
+
+		if (n < 0)
+			return RANGE_ERROR((double)n);
+
+		avnraster_set_snapshot_budget((size_t)n);
+	}
+
+	lua_pushinteger(L, avnraster_snapshot_budget());
+	return 1;
+}
+
+
+/*
+ * bool = avenida.stream(avnraster, path)
+ *
+ * Renders straight from the file into a .pam or .ppm, a few rows at a
+ * time, for images too big to fit in memory. Only works when every op can
+ * be done that way; see stream.c.
+ */
+static int
+avenida_stream(lua_State *L)
+{
+	avnraster **avn;
+	char *path;
+
+	avn = AVNRASTER_ARG1;
+	path = (char*)luaL_checkstring(L, 2);
+	lua_pop(L, 2);
+
+	lua_pushboolean(L, avnraster_stream(*avn, path));
+	return 1;
+}
+
+
 /*
  * avenida.swirl(avnraster, degrees)
  */
@@ -711,8 +1139,36 @@ avenida_swirl(lua_State *L)
 }
 
 
+/*
+ * n = raster.threads(n?)
+ *
+ * Sets how many threads rendering may use, where zero means one per CPU.
+ * Either way, returns how many threads will actually be used.
+ */
+static int
+avenida_threads(lua_State *L)
+{
+	lua_Integer n;
+
+	if (lua_gettop(L) >= 1) {
+		n = luaL_checkinteger(L, 1);
+		lua_pop(L, 1);
+
+		if (n < 0)
+			return RANGE_ERROR((double)n);
+
+		avntiles_set_nthreads((unsigned int)n);
+	}
+
+	lua_pushinteger(L, avntiles_nthreads());
+	return 1;
+}
+
+
 /*
  * avenida.tint(avnraster, color, opacity)
+ *
+ * An opacity of 0 leaves the image alone, 1 paints it over completely.
  */
 static int
 avenida_tint(lua_State *L)
@@ -726,6 +1182,9 @@ avenida_tint(lua_State *L)
 	opacity = luaL_checknumber(L, 3);
 	lua_pop(L, 3);
 
+	if ((opacity < 0.0) || (opacity > 1.0))
+		return RANGE_ERROR(opacity);
+
 	if (!avnraster_tint(*avn, color, opacity))
 		return DEFAULT_ERROR;
 
@@ -733,6 +1192,129 @@ avenida_tint(lua_State *L)
 }
 
 
+/*
+ * string = avenida.toblob(avnraster, [format], [opts])
+ *
+ * Same as avenida.write(), but returns the encoded image instead of writing
+ * it anywhere. The format defaults to the one the image was read in.
+ */
+static int
+avenida_toblob(lua_State *L)
+{
+	avnraster **avn;
+	avnwriteopts opts;
+	const char *format;
+	unsigned char *blob;
+	size_t len;
+
+	avn = AVNRASTER_ARG1;
+	format = luaL_optstring(L, 2, NULL);
+	avnwriteopts_init(&opts);
+
+	if (!lua_isnoneornil(L, 3)) {
+		luaL_checktype(L, 3, LUA_TTABLE);
+		avenida_write_options(L, 3, &opts);
+	}
+
+	if ((blob = avnraster_write_blob(*avn, format, &opts, &len)) == NULL)
+		return luaL_error(L, "couldn't encode raster as \"%s\"",
+			format != NULL ? format : (*avn)->info.codec);
+
+	/* Lua strings have to live in Lua's own memory, so this is the one copy. */
+	lua_settop(L, 0);
+	lua_pushlstring(L, (const char *)blob, len);
+	avnraster_free_blob(blob);
+	return 1;
+}
+
+
+/*
+ * results = avenida.variants(avnraster, {variant, ...})
+ *
+ * Renders the raster once and writes it out at several sizes, like
+ *
+ *     {resize=800, write="800.jpg", quality=80},
+ *     {resize={400, 300}, write="400.webp", preset="small"}
+ *
+ * "resize" is a width, or a {width, height} table where either can be 0 to
+ * keep the aspect ratio; without it, the size stays the same. "filter" is
+ * the same as avenida.resize()'s. Anything else is the same as
+ * avenida.write()'s options. Returns a table of bools, one
+ * per variant, for whether it was written.
+ */
+static int
+avenida_variants(lua_State *L)
+{
+	avnraster **avn;
+	struct avnvariant variants[AVNVARIANTS_MAX];
+	struct avnvariant *v;
+	enum avnfilter f;
+	lua_Integer width, height;
+	unsigned int i, nvariants;
+
+	avn = AVNRASTER_ARG1;
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lua_settop(L, 2);
+
+	nvariants = (unsigned int)lua_rawlen(L, 2);
+	if ((nvariants == 0) || (nvariants > AVNVARIANTS_MAX))
+		return RANGE_ERROR((double)nvariants);
+
+	for (i = 0; i < nvariants; i++) {
+		v = &variants[i];
+		lua_rawgeti(L, 2, i + 1);
+		luaL_checktype(L, 3, LUA_TTABLE);
+
+		width = height = 0;
+		lua_getfield(L, 3, "resize");
+		if (lua_istable(L, -1)) {
+			lua_rawgeti(L, -1, 1);
+			lua_rawgeti(L, -2, 2);
+			width = luaL_optinteger(L, -2, 0);
+			height = luaL_optinteger(L, -1, 0);
+			lua_pop(L, 2);
+		} else if (!lua_isnil(L, -1)) {
+			width = luaL_checkinteger(L, -1);
+		}
+		lua_pop(L, 1);
+
+		if (width < 0)
+			return RANGE_ERROR((double)width);
+		if (height < 0)
+			return RANGE_ERROR((double)height);
+		v->width = (size_t)width;
+		v->height = (size_t)height;
+
+		/* The strings stay put for as long as the table does. */
+		lua_getfield(L, 3, "write");
+		if ((v->path = lua_tostring(L, -1)) == NULL)
+			return luaL_error(L, "variant %d has nowhere to \"write\"", i + 1);
+		lua_pop(L, 1);
+
+		lua_getfield(L, 3, "filter");
+		v->filter = lua_tostring(L, -1);
+		if ((v->filter != NULL) && !avnresample_filter(v->filter, &f))
+			return luaL_error(L, "unknown filter \"%s\"", v->filter);
+		lua_pop(L, 1);
+
+		avnwriteopts_init(&v->opts);
+		avenida_write_options(L, 3, &v->opts);
+		lua_pop(L, 1);
+	}
+
+	avnraster_variants(*avn, variants, nvariants);
+
+	lua_settop(L, 0);
+	lua_createtable(L, nvariants, 0);
+	for (i = 0; i < nvariants; i++) {
+		lua_pushboolean(L, variants[i].ok);
+		lua_rawseti(L, -2, i + 1);
+	}
+
+	return 1;
+}
+
+
 /*
  * avenida.verticalflip(avnraster)
  */
@@ -778,47 +1360,248 @@ avenida_wave(lua_State *L)
 
 
 /*
- * bool = avenida.write(avnraster, path)
+ * bool = avenida.write(avnraster, path, [opts])
+ *
+ * The options are all optional:
+ *
+ *     {preset="fast" | "balanced" | "small", quality=1..100,
+ *      sampling="4:2:0" | "4:2:2" | "4:4:4", progressive=bool (JPEG only),
+ *      png_level=0..9, png_filter="none" | "sub" | "up" | "average" |
+ *      "paeth" | "adaptive", webp_method=0..6}
+ *
+ * A preset fills everything in, and anything else given overrides it. A
+ * path of "-" writes to standard output, in the format the image was read
+ * in; use avenida.toblob() for any other.
  */
 static int
 avenida_write(lua_State *L)
 {
 	avnraster **avn;
+	avnwriteopts opts;
 	char *path;
 
 	avn = AVNRASTER_ARG1;
 	path = (char*)luaL_checkstring(L, 2);
-	lua_pop(L, 2);
+	avnwriteopts_init(&opts);
+
+	if (!lua_isnoneornil(L, 3)) {
+		luaL_checktype(L, 3, LUA_TTABLE);
+		avenida_write_options(L, 3, &opts);
+	}
+
+	lua_settop(L, 0);
 
-	lua_pushboolean(L, avnraster_write(*avn, path));
+	lua_pushboolean(L, avnraster_write(*avn, path, &opts));
 	return 1;
 }
 
 
 /*
- * str = avenida.serialize(avnraster)
+ * Fills in the options from the table at the given index; errors out if
+ * any of them are no good.
+ */
+static int
+avenida_write_options(lua_State *L, const int idx, avnwriteopts *opts)
+{
+	static const char *filters[] = {
+		"none", "sub", "up", "average", "paeth", "adaptive", NULL
+	};
+	static const char *samplings[] = {
+		"4:2:0", "4:2:2", "4:4:4", NULL
+	};
+	const char *preset;
+	lua_Integer n;
+
+	lua_getfield(L, idx, "preset");
+	if (!lua_isnil(L, -1)) {
+		preset = luaL_checkstring(L, -1);
+		if (!avnwriteopts_preset(opts, preset))
+			return luaL_error(L, "unknown preset \"%s\"", preset);
+	}
+
+	lua_getfield(L, idx, "quality");
+	if (!lua_isnil(L, -1)) {
+		n = luaL_checkinteger(L, -1);
+		if ((n < 1) || (n > 100))
+			return RANGE_ERROR((double)n);
+		opts->quality = (int)n;
+	}
+
+	lua_getfield(L, idx, "sampling");
+	if (!lua_isnil(L, -1)) {
+		snprintf(opts->sampling, sizeof(opts->sampling), "%s",
+			samplings[luaL_checkoption(L, -1, NULL, samplings)]);
+	}
+
+	lua_getfield(L, idx, "progressive");
+	if (!lua_isnil(L, -1))
+		opts->progressive = lua_toboolean(L, -1);
+
+	lua_getfield(L, idx, "png_level");
+	if (!lua_isnil(L, -1)) {
+		n = luaL_checkinteger(L, -1);
+		if ((n < 0) || (n > 9))
+			return RANGE_ERROR((double)n);
+		opts->png_level = (int)n;
+	}
+
+	lua_getfield(L, idx, "png_filter");
+	if (!lua_isnil(L, -1))
+		opts->png_filter = luaL_checkoption(L, -1, NULL, filters);
+
+	lua_getfield(L, idx, "webp_method");
+	if (!lua_isnil(L, -1)) {
+		n = luaL_checkinteger(L, -1);
+		if ((n < 0) || (n > 6))
+			return RANGE_ERROR((double)n);
+		opts->webp_method = (int)n;
+	}
+
+	lua_pop(L, 7);
+	return 0;
+}
+
+
+/*
+ * str = avenida.serialize(avnraster | plan)
  */
 static int
 avenida_serialize(lua_State *L)
 {
-	avnraster **avn;
+	avnoplist *plan;
+	char *json;
 
-	avn = AVNRASTER_ARG1;
-	lua_pop(L, 1);
+	if ((plan = (avnoplist*)luaL_testudata(L, 1, "avnplan")) != NULL)
+		json = avnplan_to_json(plan);
+	else
+		json = avnraster_history_json(*AVNRASTER_ARG1);
 
-	lua_pushstring(L, avnraster_history_json(*avn));
+	if (json == NULL)
+		return DEFAULT_ERROR;
+
+	lua_settop(L, 0);
+	lua_pushstring(L, json);
+	free(json);
 	return 1;
 }
 
+
+/*
+ * Like luaL_checkudata(), but a closed raster is an error too.
+ */
+static avnraster **
+avenida_checkraster(lua_State *L, const int arg)
+{
+	avnraster **avn;
+
+	avn = (avnraster**)luaL_checkudata(L, arg, "avnraster");
+	if (*avn == NULL)
+		luaL_argerror(L, arg, "raster is closed");
+
+	return avn;
+}
+
+
+/*
+ * Turns a table of ops into the JSON that plans are read from. Each op is
+ * either written the way the call would be, {"gamma", 1.2}, or the way
+ * it's serialized, {name = "gamma", args = {1.2}}.
+ */
+static cJSON *
+avenida_plan_table(lua_State *L, const int arg)
+{
+	cJSON *ary, *op, *args;
+	lua_Integer i, j, n, first, last;
+	int t;
+
+	ary = cJSON_CreateArray();
+	n = (lua_Integer)lua_rawlen(L, arg);
+
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(L, arg, i);
+		t = lua_gettop(L);
+
+		/* Leaves the name at t + 1, and the arguments at t + 2. */
+		if (lua_type(L, t) != LUA_TTABLE) {
+			lua_pushnil(L);
+			lua_pushnil(L);
+			first = 1;
+		} else if (lua_getfield(L, t, "name") != LUA_TNIL) {
+			lua_getfield(L, t, "args");
+			first = 1;
+		} else {
+			lua_pop(L, 1);
+			lua_rawgeti(L, t, 1);
+			lua_pushvalue(L, t);
+			first = 2;
+		}
+
+		if ((lua_type(L, t + 1) != LUA_TSTRING) ||
+			(!lua_isnil(L, t + 2) && !lua_istable(L, t + 2))) {
+				cJSON_Delete(ary);
+				luaL_error(L, "op %d of the plan isn't valid", (int)i);
+		}
+
+		op = cJSON_CreateObject();
+		args = cJSON_CreateArray();
+		cJSON_AddStringToObject(op, "name", lua_tostring(L, t + 1));
+		cJSON_AddItemToObject(op, "args", args);
+		cJSON_AddItemToArray(ary, op);
+
+		last = lua_istable(L, t + 2) ? (lua_Integer)lua_rawlen(L, t + 2) : 0;
+
+		for (j = first; j <= last; j++) {
+			switch (lua_rawgeti(L, t + 2, j)) {
+			case LUA_TNUMBER:
+				cJSON_AddItemToArray(args,
+					cJSON_CreateNumber(lua_tonumber(L, -1)));
+				break;
+			case LUA_TSTRING:
+				cJSON_AddItemToArray(args,
+					cJSON_CreateString(lua_tostring(L, -1)));
+				break;
+			default:
+				cJSON_Delete(ary);
+				luaL_error(L, "op %d of the plan isn't valid", (int)i);
+			}
+			lua_pop(L, 1);
+		}
+
+		lua_settop(L, t - 1);
+	}
+
+	return ary;
+}
+
+
+/*
+ * All Lua sees of a raster is a pointer, so left to itself, the collector
+ * would never hurry on account of the pixels behind it, and a script that
+ * opens one image after another would run out of memory first. Each new
+ * raster, and each render, makes it do as much work as if the pixels were
+ * its own.
+ */
+static void
+avenida_pressure(lua_State *L, const avnraster *avn)
+{
+	size_t kb;
+
+	kb = avnraster_footprint(avn) / 1024;
+	lua_gc(L, LUA_GCSTEP, (kb > INT_MAX) ? INT_MAX : (int)kb);
+}
+
 /* */
 
 int
 luaopen_raster(lua_State *L)
 {
 	luaL_Reg funcs[] = {
+		{"apply", avenida_apply},
 		{"border", avenida_border},
 		{"brightness", avenida_brightness},
+		{"cache", avenida_cache},
 		{"charcoal", avenida_charcoal},
+		{"close", avenida_close},
 		{"crop", avenida_crop},
 		{"despeckle", avenida_despeckle},
 		{"edge", avenida_edge},
@@ -837,6 +1620,9 @@ luaopen_raster(lua_State *L)
 		{"normalize", avenida_normalize},
 		{"oilpaint", avenida_oilpaint},
 		{"open", avenida_open},
+		{"openblob", avenida_openblob},
+		{"pixelcache", avenida_pixelcache},
+		{"plan", avenida_plan},
 		{"radialblur", avenida_radialblur},
 		{"render", avenida_render},
 		{"resize", avenida_resize},
@@ -845,8 +1631,13 @@ luaopen_raster(lua_State *L)
 		{"saturation", avenida_saturation},
 		{"scale", avenida_scale},
 		{"sharpen", avenida_sharpen},
+		{"snapshots", avenida_snapshots},
+		{"stream", avenida_stream},
 		{"swirl", avenida_swirl},
+		{"threads", avenida_threads},
 		{"tint", avenida_tint},
+		{"toblob", avenida_toblob},
+		{"variants", avenida_variants},
 		{"verticalflip", avenida_verticalflip},
 		{"wave", avenida_wave},
 		{"write", avenida_write},
@@ -855,6 +1646,12 @@ luaopen_raster(lua_State *L)
 	};
 
 	luaL_newlib(L, funcs);
+	luaL_newmetatable(L, "avnplan");
+	lua_pushcfunction(L, avenida_plan_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
 	luaL_newmetatable(L, "avnraster");
+	lua_pushcfunction(L, avenida_close);
+	lua_setfield(L, -2, "__gc");
 	return 2;
 }
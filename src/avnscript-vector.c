@@ -5,6 +5,7 @@
  * Christian Koch <cfkoch@sdf.lonestar.org>
  */
 
+#include <limits.h>
 #include <stdbool.h>
 
 #include <lua.h>
@@ -12,8 +13,9 @@
 
 #include "vector.h"
 
-#define AVNVECTOR_ARG1 ((avnvector**)luaL_checkudata(L, 1, "avnvector"))
+#define AVNVECTOR_ARG1 (avenida_checkvector(L, 1))
 
+static int avenida_close(lua_State *);
 static int avenida_closepath(lua_State *);
 static int avenida_lineto(lua_State *);
 static int avenida_moveto(lua_State *);
@@ -25,10 +27,30 @@ static int avenida_setwidth(lua_State *);
 static int avenida_stroke(lua_State *);
 static int avenida_write(lua_State *);
 
+static avnvector **avenida_checkvector(lua_State *, const int);
+
 int luaopen_vector(lua_State *L);
 
 /* */
 
+/*
+ * avenida.close(avnvector)
+ *
+ * Frees the vector's surface right away; this is also its __gc. Using the
+ * vector afterwards is an error, but closing it again is fine.
+ */
+static int
+avenida_close(lua_State *L)
+{
+	avnvector **avn;
+
+	avn = (avnvector**)luaL_checkudata(L, 1, "avnvector");
+	avnvector_free(*avn);
+	*avn = NULL;
+	return 0;
+}
+
+
 /*
  * bool = avenida.closepath(avnvector)
  */
@@ -90,15 +112,20 @@ static int
 avenida_new(lua_State *L)
 {
 	avnvector **avn;
-	size_t width, height;
+	size_t width, height, kb;
 
 	width = (size_t)luaL_checkinteger(L, 1);
 	height = (size_t)luaL_checkinteger(L, 2);
 	lua_pop(L, 2);
 
 	avn = (avnvector**)lua_newuserdata(L, sizeof(avnvector*));
-	*avn = avnvector_new(width, height);
+	if ((*avn = avnvector_new(width, height)) == NULL)
+		return luaL_error(L, "%s", __func__);
 	luaL_setmetatable(L, "avnvector");
+
+	/* Lua can't see the surface, so tell the collector what it costs. */
+	kb = width * height * 4 / 1024;
+	lua_gc(L, LUA_GCSTEP, (kb > INT_MAX) ? INT_MAX : (int)kb);
 	return 1;
 }
 
@@ -173,12 +200,29 @@ avenida_write(lua_State *L)
 	return 1;
 }
 
+
+/*
+ * Like luaL_checkudata(), but a closed vector is an error too.
+ */
+static avnvector **
+avenida_checkvector(lua_State *L, const int arg)
+{
+	avnvector **avn;
+
+	avn = (avnvector**)luaL_checkudata(L, arg, "avnvector");
+	if (*avn == NULL)
+		luaL_argerror(L, arg, "vector is closed");
+
+	return avn;
+}
+
 /* */
 
 int
 luaopen_vector(lua_State *L)
 {
 	luaL_Reg funcs[] = {
+		{"close", avenida_close},
 		{"closepath", avenida_closepath},
 		{"lineto", avenida_lineto},
 		{"moveto", avenida_moveto},
@@ -194,5 +238,7 @@ luaopen_vector(lua_State *L)
 
 	luaL_newlib(L, funcs);
 	luaL_newmetatable(L, "avnvector");
+	lua_pushcfunction(L, avenida_close);
+	lua_setfield(L, -2, "__gc");
 	return 2;
 }
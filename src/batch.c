@@ -0,0 +1,378 @@
+/*
+ * vim: noet
+ *
+ * batch.c
+ * Christian Koch <cfkoch@sdf.lonestar.org>
+ *
+ * Batch mode runs one script over many files, using a pool of forked
+ * worker processes. The parent hands out file indices one at a time over a
+ * shared pipe, so a worker that gets stuck on a huge image doesn't hold up
+ * a whole share of the list, and the workers send back one fixed size
+ * result per file over another pipe. Every file gets a fresh avnscript, so
+ * whatever one run leaves behind in its globals can't leak into the next.
+ *
+ * A worker that crashes only takes the file it was working on with it; the
+ * parent starts a replacement as long as there's work left.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "script.h"
+
+/*
+ * A result has to fit in PIPE_BUF, so that writes from different workers
+ * never interleave.
+ */
+struct result {
+	uint32_t index;
+	uint32_t ok;
+	char error[AVNBATCH_ERROR_LEN];
+};
+
+struct outcome {
+	bool done;
+	bool ok;
+	char *error;
+};
+
+struct pool {
+	const char *script;
+	char **files;
+	int jobs[2];
+	int results[2];
+	pid_t pids[AVNBATCH_MAX_JOBS];
+	unsigned int nworkers;
+};
+
+static bool spawn(struct pool *, const unsigned int slot);
+static unsigned int reap(struct pool *, const bool block);
+static bool collect(struct pool *, struct outcome *, const unsigned int);
+static void worker(const struct pool *);
+static bool read_full(int, void *, size_t);
+static bool write_full(int, const void *, size_t);
+static void report(char *files[], struct outcome *, const unsigned int);
+
+/*
+ * Runs the script once for every file, with the file as its only argument,
+ * using up to njobs processes at a time. Prints a line for every file once
+ * they're all done, and returns true if every one of them succeeded.
+ */
+bool
+avnbatch_run(const char *script, char *files[], const unsigned int nfiles,
+	const unsigned int njobs)
+{
+	struct pool pool;
+	struct outcome *outcomes = NULL;
+	struct pollfd pfd[2];
+	uint32_t next = 0, ndone = 0, i;
+	unsigned int npfd;
+	bool ok = true;
+	void (*oldpipe)(int);
+
+	if (nfiles == 0)
+		return true;
+
+	memset(&pool, 0, sizeof(pool));
+	pool.script = script;
+	pool.files = files;
+	pool.jobs[0] = pool.jobs[1] = -1;
+	pool.results[0] = pool.results[1] = -1;
+	pool.nworkers = (njobs > AVNBATCH_MAX_JOBS) ? AVNBATCH_MAX_JOBS : njobs;
+	if (pool.nworkers > nfiles)
+		pool.nworkers = nfiles;
+
+	if ((outcomes = calloc(nfiles, sizeof(struct outcome))) == NULL) {
+		warn("calloc");
+		return false;
+	}
+
+	/* If every worker died, a write to the job pipe must not kill us. */
+	oldpipe = signal(SIGPIPE, SIG_IGN);
+
+	if ((pipe(pool.jobs) == -1) || (pipe(pool.results) == -1)) {
+		warn("pipe");
+		goto cleanup;
+	}
+
+	fcntl(pool.jobs[1], F_SETFL, fcntl(pool.jobs[1], F_GETFL) | O_NONBLOCK);
+	fflush(NULL);
+
+	for (i = 0; i < pool.nworkers; i++) {
+		if (!spawn(&pool, i))
+			break;
+	}
+
+	while (ndone < nfiles) {
+		pfd[0].fd = pool.results[0];
+		pfd[0].events = POLLIN;
+		npfd = 1;
+
+		if (pool.jobs[1] != -1) {
+			pfd[1].fd = pool.jobs[1];
+			pfd[1].events = POLLOUT;
+			npfd = 2;
+		}
+
+		/* Wake up every so often to replace workers which have crashed. */
+		if (poll(pfd, npfd, 250) == -1) {
+			if (errno == EINTR)
+				continue;
+			warn("poll");
+			break;
+		}
+
+		if ((npfd == 2) && (pfd[1].revents != 0)) {
+			while (next < nfiles) {
+				if (write(pool.jobs[1], &next, sizeof(next)) != sizeof(next))
+					break;
+				next++;
+			}
+
+			if ((next == nfiles) || ((errno != EAGAIN) && (errno != EINTR))) {
+				close(pool.jobs[1]);
+				pool.jobs[1] = -1;
+			}
+		}
+
+		if ((pfd[0].revents != 0) && collect(&pool, outcomes, nfiles))
+			ndone++;
+
+		/*
+		 * Once everyone's gone, whatever they left in the pipe is all
+		 * we're going to get.
+		 */
+		if (reap(&pool, false) == 0) {
+			pfd[0].fd = pool.results[0];
+			pfd[0].events = POLLIN;
+			while ((ndone < nfiles) && (poll(pfd, 1, 0) == 1) &&
+				collect(&pool, outcomes, nfiles))
+					ndone++;
+			break;
+		}
+	}
+
+cleanup:
+	if (pool.jobs[1] != -1)
+		close(pool.jobs[1]);
+	reap(&pool, true);
+	if (pool.jobs[0] != -1)
+		close(pool.jobs[0]);
+	if (pool.results[0] != -1)
+		close(pool.results[0]);
+	if (pool.results[1] != -1)
+		close(pool.results[1]);
+	signal(SIGPIPE, oldpipe);
+
+	report(files, outcomes, nfiles);
+
+	for (i = 0; i < nfiles; i++) {
+		if (!outcomes[i].ok)
+			ok = false;
+		free(outcomes[i].error);
+	}
+
+	free(outcomes);
+	return ok;
+}
+
+/* */
+
+static bool
+spawn(struct pool *pool, const unsigned int slot)
+{
+	pid_t pid;
+
+	switch (pid = fork()) {
+	case -1:
+		warn("fork");
+		return false;
+	case 0:
+		close(pool->jobs[1]);
+		close(pool->results[0]);
+		worker(pool);
+		fflush(NULL);
+		_exit(EXIT_SUCCESS);
+	default:
+		pool->pids[slot] = pid;
+		return true;
+	}
+}
+
+
+/*
+ * Workers only exit on their own once the job pipe is closed, so if one is
+ * gone while it's still open, it crashed, and gets replaced. Returns the
+ * number of workers still running.
+ */
+static unsigned int
+reap(struct pool *pool, const bool block)
+{
+	unsigned int i, nalive = 0;
+	int status;
+	pid_t pid;
+
+	for (i = 0; i < pool->nworkers; i++) {
+		if (pool->pids[i] <= 0)
+			continue;
+
+		pid = waitpid(pool->pids[i], &status, block ? 0 : WNOHANG);
+		if ((pid == 0) || ((pid == -1) && (errno == EINTR))) {
+			nalive++;
+			continue;
+		}
+
+		pool->pids[i] = 0;
+		if ((pid > 0) && WIFSIGNALED(status))
+			warnx("worker %d killed by signal %d", pid, WTERMSIG(status));
+
+		if (!block && (pool->jobs[1] != -1) && spawn(pool, i))
+			nalive++;
+	}
+
+	return nalive;
+}
+
+
+/*
+ * Reads one result off the pipe. Returns true if it was for a file we
+ * hadn't heard about yet.
+ */
+static bool
+collect(struct pool *pool, struct outcome *outcomes, const unsigned int nfiles)
+{
+	struct result res;
+	struct outcome *o;
+
+	if (!read_full(pool->results[0], &res, sizeof(res)))
+		return false;
+
+	if ((res.index >= nfiles) || outcomes[res.index].done)
+		return false;
+
+	o = &outcomes[res.index];
+	o->done = true;
+	o->ok = res.ok ? true : false;
+
+	if (!o->ok) {
+		res.error[AVNBATCH_ERROR_LEN-1] = '\0';
+		o->error = strdup(res.error);
+	}
+
+	return true;
+}
+
+
+static void
+worker(const struct pool *pool)
+{
+	struct result res;
+	avnscript *avn;
+	uint32_t index;
+
+	while (read_full(pool->jobs[0], &index, sizeof(index))) {
+		memset(&res, 0, sizeof(res));
+		res.index = index;
+
+		if ((avn = avnscript_new(pool->script)) == NULL) {
+			snprintf(res.error, sizeof(res.error),
+				"couldn't create struct avnscript");
+		} else {
+			avnscript_setup(avn);
+			avnscript_setargs(avn, 1, &pool->files[index]);
+			if (avnscript_execute(avn))
+				res.ok = 1;
+			else
+				snprintf(res.error, sizeof(res.error), "%s", avn->error);
+			avnscript_free(avn);
+		}
+
+		if (!write_full(pool->results[1], &res, sizeof(res)))
+			break;
+	}
+}
+
+
+/*
+ * Returns false on EOF or error, including EOF partway through.
+ */
+static bool
+read_full(int fd, void *buf, size_t len)
+{
+	unsigned char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = read(fd, p, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		} else if (n == 0) {
+			return false;
+		}
+		p += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+
+static bool
+write_full(int fd, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = write(fd, p, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		p += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+
+/*
+ * One tab-separated line per file, in the order they were given, so that
+ * the report can be fed to cut(1) and friends. A file which never came back
+ * was being worked on by a worker that crashed.
+ */
+static void
+report(char *files[], struct outcome *outcomes, const unsigned int nfiles)
+{
+	unsigned int i, nfailed = 0;
+
+	for (i = 0; i < nfiles; i++) {
+		if (outcomes[i].ok) {
+			printf("ok\t%s\n", files[i]);
+		} else {
+			nfailed++;
+			printf("failed\t%s\t%s\n", files[i],
+				!outcomes[i].done ? "worker died" :
+				(outcomes[i].error != NULL) ? outcomes[i].error : "unknown error");
+		}
+	}
+
+	fflush(stdout);
+
+	if (nfailed > 0)
+		warnx("%u of %u files failed", nfailed, nfiles);
+}
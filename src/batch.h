@@ -0,0 +1,19 @@
+/*
+ * vim: noet
+ *
+ * batch.h
+ * Christian Koch <cfkoch@sdf.lonestar.org>
+ */
+
+#ifndef AVENIDA_BATCH_H
+#define AVENIDA_BATCH_H
+
+#include <stdbool.h>
+
+#define AVNBATCH_MAX_JOBS 256
+#define AVNBATCH_ERROR_LEN 248
+
+bool avnbatch_run(const char *script, char *files[],
+	const unsigned int nfiles, const unsigned int njobs);
+
+#endif /* AVENIDA_BATCH_H */
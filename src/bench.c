@@ -0,0 +1,593 @@
+/*
+ * vim: noet
+ *
+ * bench.c
+ * Christian Koch <cfkoch@sdf.lonestar.org>
+ *
+ * The benchmark times every op on synthetic images of a few sizes, two
+ * ways: "deferred", the way scripts do it, by recording the op and then
+ * rendering (optimizer, native kernels, bands and all), and "direct", as a
+ * single GraphicsMagick call on one thread (see avnraster_apply_op()).
+ *
+ * Every op at every size runs in a forked child of its own, so the peak RSS
+ * it reports is its own, and an op which crashes only takes its own entry
+ * in the report with it. The report is JSON on stdout. Everything in it
+ * comes out in the same order every time and the numbers are rounded, so
+ * the reports from two builds can be diffed.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <wand/magick_wand.h>
+
+#include "cJSON.h"
+
+#include "avenida.h"
+#include "bench.h"
+#include "commands.h"
+#include "kernels.h"
+#include "raster.h"
+#include "tiles.h"
+#include "util.h"
+#include "vector.h"
+
+/* How many lines the vector case strokes. */
+#define BENCH_SEGMENTS 1000
+
+/* How many rows of the synthetic image get filled in at once. */
+#define BENCH_FILL_ROWS 64
+
+struct timing {
+	uint32_t ok;
+	double p50_ms;
+	double p99_ms;
+	double mp_per_s;
+};
+
+/* What a child sends back to the parent. */
+struct outcome {
+	struct timing deferred;
+	struct timing direct;
+	long peak_rss_kb;
+};
+
+struct benchcase {
+	MagickWand *base;
+	enum avncmdname name;
+	size_t width;
+	size_t height;
+	double megapixels;
+	unsigned int runs;
+};
+
+typedef void (*benchfn)(const struct benchcase *, struct outcome *);
+
+static const unsigned int default_sizes[] = { 1, 12, 50 };
+
+static MagickWand *synthesize(const size_t, const size_t);
+static bool measure(benchfn, const struct benchcase *, struct outcome *);
+static void bench_raster(const struct benchcase *, struct outcome *);
+static void bench_vector(const struct benchcase *, struct outcome *);
+static bool record_raster(avnraster *, const enum avncmdname);
+static bool record_vector(avnvector *);
+static void summarize(double *, const unsigned int, const double,
+	struct timing *);
+static int ms_cmp(const void *, const void *);
+static cJSON *result_json(const char *, const char *,
+	const struct benchcase *, const struct outcome *);
+static cJSON *timing_json(const struct timing *);
+static double rounded(const double);
+
+void
+avnbench_init(avnbench *bench)
+{
+	unsigned int i;
+
+	bench->nsizes = sizeof(default_sizes) / sizeof(default_sizes[0]);
+	for (i = 0; i < bench->nsizes; i++)
+		bench->sizes[i] = default_sizes[i];
+	bench->runs = AVNBENCH_DEFAULT_RUNS;
+}
+
+
+/*
+ * Parses a comma separated list of sizes in megapixels, like "1,12,50".
+ */
+bool
+avnbench_set_sizes(avnbench *bench, const char *list)
+{
+	const char *p = list;
+	char *end;
+	long mp;
+	unsigned int n = 0;
+
+	for (;;) {
+		mp = strtol(p, &end, 10);
+		if ((end == p) || (mp < 1) || (mp > 1000) ||
+			(n == AVNBENCH_MAX_SIZES))
+				return false;
+		bench->sizes[n++] = (unsigned int)mp;
+
+		if (*end == '\0')
+			break;
+		if (*end != ',')
+			return false;
+		p = end + 1;
+	}
+
+	bench->nsizes = n;
+	return true;
+}
+
+
+bool
+avnbench_run(const avnbench *bench)
+{
+	cJSON *json, *results;
+	struct benchcase c;
+	struct outcome out;
+	unsigned int i;
+	enum avncmdname name;
+	char *str;
+	bool ok = true;
+
+	json = cJSON_CreateObject();
+	cJSON_AddStringToObject(json, "version", AVENIDA_VERSION);
+	cJSON_AddStringToObject(json, "isa", avnkernel_isa());
+	cJSON_AddNumberToObject(json, "threads", avntiles_nthreads());
+	cJSON_AddNumberToObject(json, "quantum_depth", QuantumDepth);
+	cJSON_AddNumberToObject(json, "runs", bench->runs);
+	results = cJSON_CreateArray();
+
+	for (i = 0; i < bench->nsizes; i++) {
+		/* Something like a camera's 4:3. */
+		c.megapixels = bench->sizes[i];
+		c.width = (size_t)round(sqrt(c.megapixels * 1e6 * 4.0 / 3.0));
+		c.height = (size_t)round(c.megapixels * 1e6 / c.width);
+		c.runs = bench->runs;
+
+		if ((c.base = synthesize(c.width, c.height)) == NULL) {
+			warnx("couldn't make a %zux%zu image", c.width, c.height);
+			ok = false;
+			continue;
+		}
+
+		for (name = RASTER_BORDER; name <= RASTER_WAVE; name++) {
+			c.name = name;
+			fprintf(stderr, "bench: %s, %uMP\n", stravncmdname(name),
+				bench->sizes[i]);
+			if (!measure(bench_raster, &c, &out))
+				ok = false;
+			cJSON_AddItemToArray(results, result_json("raster",
+				stravncmdname(name), &c, &out));
+		}
+
+		c.name = VECTOR_STROKE;
+		fprintf(stderr, "bench: %s, %uMP\n", stravncmdname(c.name),
+			bench->sizes[i]);
+		if (!measure(bench_vector, &c, &out))
+			ok = false;
+		cJSON_AddItemToArray(results, result_json("vector",
+			stravncmdname(c.name), &c, &out));
+
+		DestroyMagickWand(c.base);
+	}
+
+	cJSON_AddItemToObject(json, "results", results);
+
+	if ((str = cJSON_Print(json)) != NULL) {
+		printf("%s\n", str);
+		free(str);
+	} else {
+		ok = false;
+	}
+
+	cJSON_Delete(json);
+	return ok;
+}
+
+/* */
+
+/*
+ * Makes an image out of nothing: a gradient in red and green, and noise in
+ * blue, so that neither the flat-color shortcuts some ops have nor a
+ * compressible pattern flatter anything. The noise is seeded the same way
+ * every time.
+ */
+static MagickWand *
+synthesize(const size_t width, const size_t height)
+{
+	MagickWand *wand;
+	PixelWand *black;
+	unsigned char *rows, *p;
+	uint32_t seed = 2463534242U;
+	size_t x, y, i, n;
+	bool ok;
+
+	if ((wand = NewMagickWand()) == NULL)
+		return NULL;
+
+	if ((black = NewPixelWand()) == NULL) {
+		DestroyMagickWand(wand);
+		return NULL;
+	}
+
+	PixelSetColor(black, "black");
+	ok = MagickNewImage(wand, width, height, black) == MagickPass;
+	DestroyPixelWand(black);
+
+	if (!ok || ((rows = malloc(width * 3 * BENCH_FILL_ROWS)) == NULL)) {
+		DestroyMagickWand(wand);
+		return NULL;
+	}
+
+	for (y = 0; ok && (y < height); y += n) {
+		n = (height - y < BENCH_FILL_ROWS) ? height - y : BENCH_FILL_ROWS;
+
+		for (i = 0, p = rows; i < n; i++) {
+			for (x = 0; x < width; x++) {
+				seed ^= seed << 13;
+				seed ^= seed >> 17;
+				seed ^= seed << 5;
+				*p++ = (unsigned char)((x * 255) / width);
+				*p++ = (unsigned char)(((y + i) * 255) / height);
+				*p++ = (unsigned char)(seed >> 24);
+			}
+		}
+
+		ok = MagickSetImagePixels(wand, 0, (long)y, width, n, "RGB",
+			CharPixel, rows) == MagickPass;
+	}
+
+	free(rows);
+
+	if (!ok) {
+		DestroyMagickWand(wand);
+		return NULL;
+	}
+
+	return wand;
+}
+
+
+/*
+ * Runs the case in a child and waits for its outcome. If the child dies,
+ * the outcome is a failure all round.
+ */
+static bool
+measure(benchfn fn, const struct benchcase *c, struct outcome *out)
+{
+	int fds[2], status;
+	pid_t pid;
+	ssize_t n;
+
+	memset(out, 0, sizeof(*out));
+	fflush(NULL);
+
+	if (pipe(fds) == -1) {
+		warn("pipe");
+		return false;
+	}
+
+	switch (pid = fork()) {
+	case -1:
+		warn("fork");
+		close(fds[0]);
+		close(fds[1]);
+		return false;
+	case 0:
+		close(fds[0]);
+		fn(c, out);
+		out->peak_rss_kb = avnutil_peak_rss_kb();
+		n = write(fds[1], out, sizeof(*out));
+		_exit(n == sizeof(*out) ? EXIT_SUCCESS : EXIT_FAILURE);
+	default:
+		break;
+	}
+
+	close(fds[1]);
+
+	do {
+		n = read(fds[0], out, sizeof(*out));
+	} while ((n == -1) && (errno == EINTR));
+
+	close(fds[0]);
+
+	while ((waitpid(pid, &status, 0) == -1) && (errno == EINTR))
+		continue;
+
+	if ((n != sizeof(*out)) || !WIFEXITED(status) ||
+		(WEXITSTATUS(status) != EXIT_SUCCESS)) {
+			memset(out, 0, sizeof(*out));
+			return false;
+	}
+
+	return out->deferred.ok && out->direct.ok;
+}
+
+
+/*
+ * Both ways start from their own copy of the base image, and the two take
+ * turns so that neither gets all the warm caches. Copying the base isn't
+ * timed, but whatever copying a render does of its own is.
+ */
+static void
+bench_raster(const struct benchcase *c, struct outcome *out)
+{
+	double deferred[AVNBENCH_MAX_RUNS], direct[AVNBENCH_MAX_RUNS], t;
+	MagickWand *wand;
+	avnraster *avn;
+	unsigned int i;
+	bool ok;
+
+	out->deferred.ok = out->direct.ok = true;
+
+	for (i = 0; i < c->runs; i++) {
+		if ((wand = CloneMagickWand(c->base)) == NULL)
+			goto fail;
+		if ((avn = avnraster_new_with_wand("bench", wand)) == NULL) {
+			DestroyMagickWand(wand);
+			goto fail;
+		}
+
+		t = avnutil_clock_ms(CLOCK_MONOTONIC);
+		ok = record_raster(avn, c->name) && avnraster_render(avn, false);
+		deferred[i] = avnutil_clock_ms(CLOCK_MONOTONIC) - t;
+		if (!ok)
+			out->deferred.ok = false;
+		avnraster_free(avn);
+
+		if ((wand = CloneMagickWand(c->base)) == NULL)
+			goto fail;
+		if ((avn = avnraster_new_with_wand("bench", wand)) == NULL) {
+			DestroyMagickWand(wand);
+			goto fail;
+		}
+
+		if (record_raster(avn, c->name)) {
+			t = avnutil_clock_ms(CLOCK_MONOTONIC);
+			ok = avnraster_apply_op(avn, avn->history.ops[0]);
+			direct[i] = avnutil_clock_ms(CLOCK_MONOTONIC) - t;
+		} else {
+			ok = false;
+			direct[i] = 0.0;
+		}
+		if (!ok)
+			out->direct.ok = false;
+		avnraster_free(avn);
+	}
+
+	summarize(deferred, c->runs, c->megapixels, &out->deferred);
+	summarize(direct, c->runs, c->megapixels, &out->direct);
+	return;
+
+fail:
+	out->deferred.ok = out->direct.ok = false;
+}
+
+
+/*
+ * Vector ops only do anything worth timing once they're stroked, so the
+ * vector case is one whole path. Directly here means drawing the ops as
+ * they come, without recording them first.
+ */
+static void
+bench_vector(const struct benchcase *c, struct outcome *out)
+{
+	double deferred[AVNBENCH_MAX_RUNS], direct[AVNBENCH_MAX_RUNS], t;
+	avnvector *avn;
+	unsigned int i, j;
+	bool ok;
+
+	out->deferred.ok = out->direct.ok = true;
+
+	for (i = 0; i < c->runs; i++) {
+		if ((avn = avnvector_new(c->width, c->height)) == NULL)
+			goto fail;
+
+		t = avnutil_clock_ms(CLOCK_MONOTONIC);
+		ok = record_vector(avn);
+		avnvector_render(avn);
+		deferred[i] = avnutil_clock_ms(CLOCK_MONOTONIC) - t;
+		if (!ok)
+			out->deferred.ok = false;
+		avnvector_free(avn);
+
+		if ((avn = avnvector_new(c->width, c->height)) == NULL)
+			goto fail;
+
+		ok = record_vector(avn);
+		t = avnutil_clock_ms(CLOCK_MONOTONIC);
+		for (j = 0; ok && (j < avn->history.nops); j++)
+			ok = avnvector_apply_op(avn, avn->history.ops[j]);
+		direct[i] = avnutil_clock_ms(CLOCK_MONOTONIC) - t;
+		if (!ok)
+			out->direct.ok = false;
+		avnvector_free(avn);
+	}
+
+	summarize(deferred, c->runs, c->megapixels, &out->deferred);
+	summarize(direct, c->runs, c->megapixels, &out->direct);
+	return;
+
+fail:
+	out->deferred.ok = out->direct.ok = false;
+}
+
+
+/*
+ * Records the op with arguments that make it do some real work. Anything
+ * that depends on the geometry is relative to the image's size.
+ */
+static bool
+record_raster(avnraster *avn, const enum avncmdname name)
+{
+	size_t w = avn->info.width, h = avn->info.height;
+
+	switch (name) {
+	case RASTER_BORDER:
+		return avnraster_border(avn, 16, 16, "black");
+	case RASTER_BRIGHTNESS:
+		return avnraster_brightness(avn, 20.0);
+	case RASTER_CHARCOAL:
+		return avnraster_charcoal(avn, 1.0);
+	case RASTER_CROP:
+		return avnraster_crop(avn, w / 4, h / 4, w / 2, h / 2);
+	case RASTER_DESPECKLE:
+		return avnraster_despeckle(avn);
+	case RASTER_EDGE:
+		return avnraster_edge(avn, 1.0);
+	case RASTER_EMBOSS:
+		return avnraster_emboss(avn, 1.0);
+	case RASTER_EQUALIZE:
+		return avnraster_equalize(avn);
+	case RASTER_GAMMA:
+		return avnraster_gamma(avn, 1.8);
+	case RASTER_GAUSSIANBLUR:
+		return avnraster_gaussianblur(avn, 2.0);
+	case RASTER_HORIZONTALFLIP:
+		return avnraster_horizontalflip(avn);
+	case RASTER_HUE:
+		return avnraster_hue(avn, 30.0);
+	case RASTER_IMPLODE:
+		return avnraster_implode(avn, 0.5);
+	case RASTER_LEVELS:
+		return avnraster_levels(avn, 5.0, 95.0, 1.2);
+	case RASTER_MODULATE:
+		/* Scripts only get this one out of the optimizer. */
+		return avnraster_add_op(avn, RASTER_MODULATE, 3, AVN_DOUBLE, 110.0,
+			AVN_DOUBLE, 90.0, AVN_DOUBLE, 120.0);
+	case RASTER_MOTIONBLUR:
+		return avnraster_motionblur(avn, 5.0, 45.0);
+	case RASTER_NEGATE:
+		return avnraster_negate(avn);
+	case RASTER_NEGATEGRAYS:
+		return avnraster_negategrays(avn);
+	case RASTER_NORMALIZE:
+		return avnraster_normalize(avn);
+	case RASTER_OILPAINT:
+		return avnraster_oilpaint(avn, 2.0);
+	case RASTER_RADIALBLUR:
+		return avnraster_radialblur(avn, 10.0);
+	case RASTER_RESIZE:
+		return avnraster_resize(avn, w / 2, h / 2, NULL);
+	case RASTER_ROLL:
+		return avnraster_roll(avn, (int)(w / 3), (int)(h / 3));
+	case RASTER_ROTATE:
+		return avnraster_rotate(avn, 30.0, "black");
+	case RASTER_SATURATION:
+		return avnraster_saturation(avn, 20.0);
+	case RASTER_SCALE:
+		return avnraster_scale(avn, 0.5, NULL);
+	case RASTER_SHARPEN:
+		return avnraster_sharpen(avn, 2.0);
+	case RASTER_SWIRL:
+		return avnraster_swirl(avn, 90.0);
+	case RASTER_TINT:
+		return avnraster_tint(avn, "#ff8000", 0.5);
+	case RASTER_VERTICALFLIP:
+		return avnraster_verticalflip(avn);
+	case RASTER_WAVE:
+		return avnraster_wave(avn, 10.0, 100.0);
+	default:
+		return false;
+	}
+}
+
+
+/*
+ * A zigzag from one side of the canvas to the other.
+ */
+static bool
+record_vector(avnvector *avn)
+{
+	double w = avn->info.width, h = avn->info.height;
+	unsigned int i;
+
+	if (!avnvector_setcolor(avn, "#336699") || !avnvector_setwidth(avn, 8) ||
+		!avnvector_setcap(avn) || !avnvector_moveto(avn, 0.0, 0.0))
+			return false;
+
+	for (i = 1; i <= BENCH_SEGMENTS; i++) {
+		if (!avnvector_lineto(avn, (w * i) / BENCH_SEGMENTS,
+			(i % 2) ? h : 0.0))
+				return false;
+	}
+
+	return avnvector_stroke(avn);
+}
+
+
+/*
+ * Percentiles are nearest-rank, so they're always one of the actual runs.
+ */
+static void
+summarize(double *ms, const unsigned int n, const double megapixels,
+	struct timing *t)
+{
+	qsort(ms, n, sizeof(double), ms_cmp);
+
+	t->p50_ms = ms[(n * 50 + 99) / 100 - 1];
+	t->p99_ms = ms[(n * 99 + 99) / 100 - 1];
+	t->mp_per_s = (t->p50_ms > 0.0) ? megapixels / (t->p50_ms / 1000.0) : 0.0;
+}
+
+
+static int
+ms_cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+
+static cJSON *
+result_json(const char *species, const char *op, const struct benchcase *c,
+	const struct outcome *out)
+{
+	cJSON *json;
+
+	json = cJSON_CreateObject();
+	cJSON_AddStringToObject(json, "species", species);
+	cJSON_AddStringToObject(json, "op", op);
+	cJSON_AddNumberToObject(json, "megapixels", c->megapixels);
+	cJSON_AddNumberToObject(json, "width", c->width);
+	cJSON_AddNumberToObject(json, "height", c->height);
+	cJSON_AddItemToObject(json, "deferred", timing_json(&out->deferred));
+	cJSON_AddItemToObject(json, "direct", timing_json(&out->direct));
+	cJSON_AddNumberToObject(json, "peak_rss_kb", out->peak_rss_kb);
+	return json;
+}
+
+
+static cJSON *
+timing_json(const struct timing *t)
+{
+	cJSON *json;
+
+	json = cJSON_CreateObject();
+	cJSON_AddBoolToObject(json, "ok", t->ok);
+	cJSON_AddNumberToObject(json, "mp_per_s", rounded(t->mp_per_s));
+	cJSON_AddNumberToObject(json, "p50_ms", rounded(t->p50_ms));
+	cJSON_AddNumberToObject(json, "p99_ms", rounded(t->p99_ms));
+	return json;
+}
+
+
+static double
+rounded(const double x)
+{
+	return round(x * 1000.0) / 1000.0;
+}
@@ -0,0 +1,32 @@
+/*
+ * vim: noet
+ *
+ * bench.h
+ * Christian Koch <cfkoch@sdf.lonestar.org>
+ */
+
+#ifndef AVENIDA_BENCH_H
+#define AVENIDA_BENCH_H
+
+#include <stdbool.h>
+
+#define AVNBENCH_MAX_SIZES 8
+#define AVNBENCH_MAX_RUNS 1000
+#define AVNBENCH_DEFAULT_RUNS 5
+
+/*
+ * What to benchmark: the image sizes, in megapixels, and how many times to
+ * time each op at each size.
+ */
+struct avnbench {
+	unsigned int sizes[AVNBENCH_MAX_SIZES];
+	unsigned int nsizes;
+	unsigned int runs;
+};
+typedef struct avnbench avnbench;
+
+void avnbench_init(avnbench *);
+bool avnbench_set_sizes(avnbench *, const char *list);
+bool avnbench_run(const avnbench *);
+
+#endif /* AVENIDA_BENCH_H */
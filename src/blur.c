@@ -0,0 +1,513 @@
+/*
+ * vim: noet
+ *
+ * blur.c
+ * Christian Koch <cfkoch@sdf.lonestar.org>
+ *
+ * Native blurs. A Gaussian is separable, so it's done as a pass along the
+ * rows and then a pass down the columns, each with a 1D filter. Small
+ * sigmas use the Gaussian kernel itself. Bigger ones use three boxes one
+ * after the other, which come out very close to a Gaussian and cost the
+ * same at any size, since a box is just a running sum.
+ *
+ * The filters work on lines of samples with a few "lanes" of values side
+ * by side. Along a row, the lanes are a pixel's channels; down the
+ * columns, they're the channels of a strip of AVNBLUR_COLUMN_BLOCK pixels,
+ * so each step down reads a few whole cache lines instead of one pixel.
+ * Either way the inner loops run over contiguous memory, which the
+ * compiler vectorizes.
+ *
+ * Past the edges, the edge pixels are repeated, as GraphicsMagick does.
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blur.h"
+#include "pixelcache.h"
+#include "pixels.h"
+#include "tiles.h"
+
+/*
+ * A 1D filter: some boxes, run one after the other, or else a kernel where
+ * weights[k] applies to the sample (k - origin) away.
+ */
+struct filter {
+	unsigned int nboxes;
+	long radii[AVNBLUR_NBOXES];
+	double *weights;
+	long nweights;
+	long origin;
+};
+
+struct blurjob {
+	avnpixels *px;
+	const struct filter *filter;
+	const unsigned char *orig;
+	double amount;
+};
+
+static bool gaussian_filter(struct filter *, const double sigma);
+static bool motion_filter(struct filter *, const double sigma,
+	const bool backwards);
+static bool separable(avnpixels *, const struct filter *, const bool rows,
+	const bool columns);
+static double *filter_line(const struct filter *, double *, double *,
+	const size_t n, const size_t lanes, double *sum);
+static void box(const double *, double *, const size_t n,
+	const size_t lanes, const long radius, double *sum);
+static void convolve(const struct filter *, const double *, double *,
+	const size_t n, const size_t lanes);
+static void load(const avnpixels *, const unsigned char *, const size_t x,
+	const size_t y, const size_t count, double *);
+static void store(avnpixels *, const size_t x, const size_t y,
+	const size_t count, const double *);
+static bool row_task(void *, const unsigned int);
+static bool column_task(void *, const unsigned int);
+static bool unsharp_task(void *, const unsigned int);
+
+bool
+avnblur_gaussian(avnpixels *px, const double sigma)
+{
+	struct filter f;
+	bool ok;
+
+	if (sigma <= 0.0)
+		return true;
+
+	if (!gaussian_filter(&f, sigma))
+		return false;
+
+	ok = separable(px, &f, true, true);
+	free(f.weights);
+	return ok;
+}
+
+
+/*
+ * Unsharp masking: the image plus amount times the difference between it
+ * and a blurred copy of it.
+ */
+bool
+avnblur_unsharp(avnpixels *px, const double sigma, const double amount)
+{
+	struct blurjob job;
+	unsigned char *orig;
+	size_t size;
+	bool mapped, ok;
+
+	if (sigma <= 0.0)
+		return true;
+
+	size = px->stride * px->height;
+	if ((orig = avnpixelcache_alloc(size, &mapped)) == NULL)
+		return false;
+	memcpy(orig, px->data, size);
+
+	ok = avnblur_gaussian(px, sigma);
+
+	if (ok) {
+		job = (struct blurjob){ .px = px, .orig = orig, .amount = amount };
+		ok = avntiles_run((px->height + AVNBLUR_ROW_BLOCK - 1) /
+			AVNBLUR_ROW_BLOCK, unsharp_task, &job);
+	}
+
+	avnpixelcache_free(orig, size, mapped);
+	return ok;
+}
+
+
+/*
+ * Motion blur smears each pixel along a line, so it's only separable when
+ * the line is one of the axes.
+ */
+bool
+avnblur_motion_supported(const double angle)
+{
+	return fmod(fabs(angle), 90.0) == 0.0;
+}
+
+
+/*
+ * Like GraphicsMagick's, each pixel becomes a mix of the ones from it
+ * towards the angle, weighted by a one-sided Gaussian: 0 degrees looks to
+ * the right, 90 down, and so on.
+ */
+bool
+avnblur_motion(avnpixels *px, const double sigma, const double angle)
+{
+	struct filter f;
+	long quadrant;
+	bool ok;
+
+	if (!avnblur_motion_supported(angle))
+		return false;
+
+	if (sigma <= 0.0)
+		return true;
+
+	quadrant = ((long)(fmod(angle, 360.0) / 90.0) + 4) % 4;
+
+	if (!motion_filter(&f, sigma, quadrant >= 2))
+		return false;
+
+	ok = separable(px, &f, (quadrant % 2) == 0, (quadrant % 2) == 1);
+	free(f.weights);
+	return ok;
+}
+
+/* */
+
+/*
+ * The box widths come from Kovesi's "Fast Almost-Gaussian Filtering": odd
+ * widths either side of the ideal one, mixed so that the variance of the
+ * stack matches the Gaussian's.
+ */
+static bool
+gaussian_filter(struct filter *f, const double sigma)
+{
+	double ideal, sum;
+	long lower, m, r, k;
+	unsigned int i;
+
+	memset(f, 0, sizeof(*f));
+
+	if (sigma >= AVNBLUR_BOX_SIGMA) {
+		ideal = sqrt(12.0 * sigma * sigma / AVNBLUR_NBOXES + 1.0);
+		lower = (long)floor(ideal);
+		if (lower % 2 == 0)
+			lower--;
+		m = lround((12.0 * sigma * sigma - AVNBLUR_NBOXES * lower * lower -
+			4.0 * AVNBLUR_NBOXES * lower - 3.0 * AVNBLUR_NBOXES) /
+			(-4.0 * lower - 4.0));
+
+		f->nboxes = AVNBLUR_NBOXES;
+		for (i = 0; i < AVNBLUR_NBOXES; i++)
+			f->radii[i] = (((long)i < m) ? lower : lower + 2) / 2;
+		return true;
+	}
+
+	r = (long)ceil(3.0 * sigma);
+	f->nweights = 2 * r + 1;
+	f->origin = r;
+
+	if ((f->weights = malloc(f->nweights * sizeof(double))) == NULL)
+		return false;
+
+	sum = 0.0;
+	for (k = 0; k < f->nweights; k++) {
+		f->weights[k] = exp(-((k - r) * (k - r)) / (2.0 * sigma * sigma));
+		sum += f->weights[k];
+	}
+	for (k = 0; k < f->nweights; k++)
+		f->weights[k] /= sum;
+
+	return true;
+}
+
+
+static bool
+motion_filter(struct filter *f, const double sigma, const bool backwards)
+{
+	double sum;
+	long k, n;
+
+	memset(f, 0, sizeof(*f));
+
+	n = (long)ceil(3.0 * sigma) + 1;
+	f->nweights = n;
+	f->origin = backwards ? n - 1 : 0;
+
+	if ((f->weights = malloc(n * sizeof(double))) == NULL)
+		return false;
+
+	sum = 0.0;
+	for (k = 0; k < n; k++) {
+		f->weights[backwards ? n - 1 - k : k] =
+			exp(-(k * k) / (2.0 * sigma * sigma));
+		sum += f->weights[backwards ? n - 1 - k : k];
+	}
+	for (k = 0; k < n; k++)
+		f->weights[k] /= sum;
+
+	return true;
+}
+
+
+static bool
+separable(avnpixels *px, const struct filter *f, const bool rows,
+	const bool columns)
+{
+	struct blurjob job = { .px = px, .filter = f };
+
+	if (rows && !avntiles_run((px->height + AVNBLUR_ROW_BLOCK - 1) /
+		AVNBLUR_ROW_BLOCK, row_task, &job))
+			return false;
+
+	if (columns && !avntiles_run((px->width + AVNBLUR_COLUMN_BLOCK - 1) /
+		AVNBLUR_COLUMN_BLOCK, column_task, &job))
+			return false;
+
+	return true;
+}
+
+
+/*
+ * Filters n samples of the given number of lanes, starting out in a and
+ * using b for scratch. Returns whichever one the result ended up in.
+ */
+static double *
+filter_line(const struct filter *f, double *a, double *b, const size_t n,
+	const size_t lanes, double *sum)
+{
+	double *tmp;
+	unsigned int i;
+
+	if (f->nboxes == 0) {
+		convolve(f, a, b, n, lanes);
+		return b;
+	}
+
+	for (i = 0; i < f->nboxes; i++) {
+		box(a, b, n, lanes, f->radii[i], sum);
+		tmp = a;
+		a = b;
+		b = tmp;
+	}
+
+	return a;
+}
+
+
+/*
+ * A running sum: each step adds the sample coming into the window and
+ * takes away the one leaving it. The sums are doubles, so that thousands
+ * of steps down a line don't drift.
+ */
+static void
+box(const double *src, double *dst, const size_t n, const size_t lanes,
+	const long radius, double *sum)
+{
+	const double inv = 1.0 / (2 * radius + 1);
+	const double *in, *out;
+	size_t i, l;
+	long k;
+
+	for (l = 0; l < lanes; l++)
+		sum[l] = src[l] * (radius + 1);
+
+	for (k = 1; k <= radius; k++) {
+		in = src + (((size_t)k < n) ? (size_t)k : n - 1) * lanes;
+		for (l = 0; l < lanes; l++)
+			sum[l] += in[l];
+	}
+
+	for (i = 0; i < n; i++) {
+		for (l = 0; l < lanes; l++)
+			dst[i * lanes + l] = sum[l] * inv;
+
+		in = src + ((i + radius + 1 < n) ? i + radius + 1 : n - 1) * lanes;
+		out = src + ((i >= (size_t)radius) ? i - radius : 0) * lanes;
+		for (l = 0; l < lanes; l++)
+			sum[l] += in[l] - out[l];
+	}
+}
+
+
+static void
+convolve(const struct filter *f, const double *src, double *dst,
+	const size_t n, const size_t lanes)
+{
+	const double *in;
+	size_t i, l;
+	long j, k;
+	double w;
+
+	for (i = 0; i < n; i++) {
+		for (l = 0; l < lanes; l++)
+			dst[i * lanes + l] = 0.0;
+
+		for (k = 0; k < f->nweights; k++) {
+			j = (long)i + k - f->origin;
+			if (j < 0)
+				j = 0;
+			else if ((size_t)j >= n)
+				j = n - 1;
+
+			in = src + j * lanes;
+			w = f->weights[k];
+			for (l = 0; l < lanes; l++)
+				dst[i * lanes + l] += w * in[l];
+		}
+	}
+}
+
+
+/*
+ * Reads count pixels of row y, starting at x, out of data (which is laid
+ * out like the pixels) into doubles.
+ */
+static void
+load(const avnpixels *px, const unsigned char *data, const size_t x,
+	const size_t y, const size_t count, double *dst)
+{
+	const size_t n = count * px->channels;
+	const uint8_t *p8;
+	const uint16_t *p16;
+	size_t i;
+
+	if (px->depth == 8) {
+		p8 = data + y * px->stride + x * px->channels;
+		for (i = 0; i < n; i++)
+			dst[i] = p8[i];
+	} else {
+		p16 = (const uint16_t *)(data + y * px->stride) + x * px->channels;
+		for (i = 0; i < n; i++)
+			dst[i] = p16[i];
+	}
+}
+
+
+static void
+store(avnpixels *px, const size_t x, const size_t y, const size_t count,
+	const double *src)
+{
+	const size_t n = count * px->channels;
+	const double max = (px->depth == 8) ? 255.0 : 65535.0;
+	uint8_t *p8;
+	uint16_t *p16;
+	double v;
+	size_t i;
+
+	if (px->depth == 8) {
+		p8 = avnpixels_row(px, y) + x * px->channels;
+		for (i = 0; i < n; i++) {
+			v = src[i] + 0.5;
+			p8[i] = (v < 0.0) ? 0 : ((v > max) ? max : v);
+		}
+	} else {
+		p16 = (uint16_t *)avnpixels_row(px, y) + x * px->channels;
+		for (i = 0; i < n; i++) {
+			v = src[i] + 0.5;
+			p16[i] = (v < 0.0) ? 0 : ((v > max) ? max : v);
+		}
+	}
+}
+
+
+/*
+ * The tasks all run on worker threads, and each has its own scratch.
+ */
+static bool
+row_task(void *arg, const unsigned int task)
+{
+	struct blurjob *job = arg;
+	avnpixels *px = job->px;
+	const size_t lanes = px->channels;
+	double *a, *b, *sum, *out;
+	size_t y, last;
+
+	a = malloc(px->width * lanes * sizeof(double));
+	b = malloc(px->width * lanes * sizeof(double));
+	sum = malloc(lanes * sizeof(double));
+
+	if ((a == NULL) || (b == NULL) || (sum == NULL)) {
+		free(a);
+		free(b);
+		free(sum);
+		return false;
+	}
+
+	y = task * AVNBLUR_ROW_BLOCK;
+	last = (y + AVNBLUR_ROW_BLOCK > px->height) ? px->height :
+		y + AVNBLUR_ROW_BLOCK;
+
+	for (; y < last; y++) {
+		load(px, px->data, 0, y, px->width, a);
+		out = filter_line(job->filter, a, b, px->width, lanes, sum);
+		store(px, 0, y, px->width, out);
+	}
+
+	free(a);
+	free(b);
+	free(sum);
+	return true;
+}
+
+
+static bool
+column_task(void *arg, const unsigned int task)
+{
+	struct blurjob *job = arg;
+	avnpixels *px = job->px;
+	double *a, *b, *sum, *out;
+	size_t x, width, lanes, y;
+
+	x = task * AVNBLUR_COLUMN_BLOCK;
+	width = (x + AVNBLUR_COLUMN_BLOCK > px->width) ? px->width - x :
+		AVNBLUR_COLUMN_BLOCK;
+	lanes = width * px->channels;
+
+	a = malloc(px->height * lanes * sizeof(double));
+	b = malloc(px->height * lanes * sizeof(double));
+	sum = malloc(lanes * sizeof(double));
+
+	if ((a == NULL) || (b == NULL) || (sum == NULL)) {
+		free(a);
+		free(b);
+		free(sum);
+		return false;
+	}
+
+	for (y = 0; y < px->height; y++)
+		load(px, px->data, x, y, width, a + y * lanes);
+
+	out = filter_line(job->filter, a, b, px->height, lanes, sum);
+
+	for (y = 0; y < px->height; y++)
+		store(px, x, y, width, out + y * lanes);
+
+	free(a);
+	free(b);
+	free(sum);
+	return true;
+}
+
+
+static bool
+unsharp_task(void *arg, const unsigned int task)
+{
+	struct blurjob *job = arg;
+	avnpixels *px = job->px;
+	const size_t n = px->width * px->channels;
+	double *orig, *blurred;
+	size_t i, y, last;
+
+	orig = malloc(n * sizeof(double));
+	blurred = malloc(n * sizeof(double));
+
+	if ((orig == NULL) || (blurred == NULL)) {
+		free(orig);
+		free(blurred);
+		return false;
+	}
+
+	y = task * AVNBLUR_ROW_BLOCK;
+	last = (y + AVNBLUR_ROW_BLOCK > px->height) ? px->height :
+		y + AVNBLUR_ROW_BLOCK;
+
+	for (; y < last; y++) {
+		load(px, job->orig, 0, y, px->width, orig);
+		load(px, px->data, 0, y, px->width, blurred);
+		for (i = 0; i < n; i++)
+			blurred[i] = orig[i] + job->amount * (orig[i] - blurred[i]);
+		store(px, 0, y, px->width, blurred);
+	}
+
+	free(orig);
+	free(blurred);
+	return true;
+}
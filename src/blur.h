@@ -0,0 +1,31 @@
+/*
+ * vim: noet
+ *
+ * blur.h
+ * Christian Koch <cfkoch@sdf.lonestar.org>
+ */
+
+#ifndef AVENIDA_BLUR_H
+#define AVENIDA_BLUR_H
+
+#include <stdbool.h>
+
+#include "pixels.h"
+
+/*
+ * Below this sigma, blurs convolve with a real Gaussian kernel; from here
+ * up, with three stacked boxes, which cost the same at any size.
+ */
+#define AVNBLUR_BOX_SIGMA 2.0
+#define AVNBLUR_NBOXES 3
+
+/* How many pixels wide a strip of columns is, for the vertical passes. */
+#define AVNBLUR_COLUMN_BLOCK 16
+#define AVNBLUR_ROW_BLOCK 16
+
+bool avnblur_gaussian(avnpixels *, const double sigma);
+bool avnblur_unsharp(avnpixels *, const double sigma, const double amount);
+bool avnblur_motion_supported(const double angle);
+bool avnblur_motion(avnpixels *, const double sigma, const double angle);
+
+#endif /* AVENIDA_BLUR_H */
@@ -0,0 +1,258 @@
+/*
+ * vim: noet
+ *
+ * bytecode.c
+ * Christian Koch <cfkoch@sdf.lonestar.org>
+ *
+ * The bytecode cache keeps each script compiled, so that running the same
+ * one over and over, as batch and server mode do, only reads it instead of
+ * parsing it every time.
+ *
+ * There's one entry per script path, named after a hash of the path. It
+ * starts with a digest of the path, the script's mtime and contents, and
+ * the versions of Avenida and Lua; if that doesn't match, the script is
+ * compiled again and the entry replaced. Hashing the contents costs a read
+ * of the script, which is still a lot cheaper than parsing it, and catches
+ * edits that don't change the mtime.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "avenida.h"
+#include "bytecode.h"
+#include "cache.h"
+#include "hash.h"
+
+struct buffer {
+	unsigned char *data;
+	size_t len;
+	size_t cap;
+};
+
+static bool enabled = false;
+static char cachedir[PATH_MAX];
+
+static bool read_file(const char *, struct buffer *);
+static void stamp(const char *, const struct stat *, const struct buffer *,
+	unsigned char [AVNHASH_LEN]);
+static void store(lua_State *, const char *, const unsigned char *);
+static int dump_writer(lua_State *, const void *, size_t, void *);
+static bool buffer_append(struct buffer *, const void *, size_t);
+
+/*
+ * Starts caching bytecode in the given directory, creating it if need be.
+ * A NULL directory means "bytecode" in the usual spot for caches.
+ */
+bool
+avnbytecode_enable(const char *dir)
+{
+	char defdir[PATH_MAX];
+
+	if (dir == NULL) {
+		if (!avncache_default_dir(defdir))
+			return false;
+		strncat(defdir, "/bytecode", PATH_MAX - strlen(defdir) - 1);
+		dir = defdir;
+	}
+
+	if (!avncache_mkdirs(dir))
+		return false;
+
+	snprintf(cachedir, PATH_MAX, "%s", dir);
+	enabled = true;
+	return true;
+}
+
+
+void
+avnbytecode_disable(void)
+{
+	enabled = false;
+}
+
+
+/*
+ * Same as luaL_loadfile(), but goes through the cache when it's on. Any
+ * trouble with the cache just means compiling the script as usual.
+ */
+int
+avnbytecode_loadfile(lua_State *L, const char *path)
+{
+	struct buffer src = { NULL, 0, 0 }, entry = { NULL, 0, 0 };
+	unsigned char digest[AVNHASH_LEN], name[AVNHASH_LEN];
+	char hex[AVNHASH_HEX_LEN], entrypath[PATH_MAX], chunkname[PATH_MAX + 1];
+	struct stat sb;
+	avnhash h;
+	size_t skip;
+	int rv;
+
+	if (!enabled || (stat(path, &sb) == -1) || !read_file(path, &src) ||
+		(src.len == 0)) {
+			free(src.data);
+			return luaL_loadfile(L, path);
+	}
+
+	stamp(path, &sb, &src, digest);
+
+	avnhash_init(&h);
+	avnhash_update(&h, path, strlen(path));
+	avnhash_final(&h, name);
+	avnhash_hex(name, hex);
+	snprintf(entrypath, PATH_MAX, "%s/%s", cachedir, hex);
+	snprintf(chunkname, sizeof(chunkname), "@%s", path);
+
+	if (read_file(entrypath, &entry) && (entry.len > AVNHASH_LEN) &&
+		(memcmp(entry.data, digest, AVNHASH_LEN) == 0)) {
+			rv = luaL_loadbufferx(L, (const char *)entry.data + AVNHASH_LEN,
+				entry.len - AVNHASH_LEN, chunkname, "b");
+			if (rv == LUA_OK)
+				goto done;
+			lua_pop(L, 1);
+	}
+
+	/* Like luaL_loadfile(), skip a "#!" line, but keep the line numbers. */
+	skip = 0;
+	if ((src.len > 0) && (src.data[0] == '#')) {
+		while ((skip < src.len) && (src.data[skip] != '\n'))
+			skip++;
+	}
+	memset(src.data, ' ', skip);
+
+	rv = luaL_loadbufferx(L, (const char *)src.data, src.len, chunkname,
+		NULL);
+	if (rv == LUA_OK)
+		store(L, entrypath, digest);
+
+done:
+	free(src.data);
+	free(entry.data);
+	return rv;
+}
+
+/* */
+
+static bool
+read_file(const char *path, struct buffer *buf)
+{
+	unsigned char chunk[64 * 1024];
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return false;
+
+	while ((n = read(fd, chunk, sizeof(chunk))) != 0) {
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (!buffer_append(buf, chunk, n)) {
+			n = -1;
+			break;
+		}
+	}
+
+	close(fd);
+	return n == 0;
+}
+
+
+/*
+ * Everything that an entry has to match to be any use. Bytecode isn't
+ * portable between Lua versions, so that's in here too.
+ */
+static void
+stamp(const char *path, const struct stat *sb, const struct buffer *src,
+	unsigned char digest[AVNHASH_LEN])
+{
+	avnhash h;
+	char line[LINE_MAX];
+
+	snprintf(line, sizeof(line), "avenida %s %s\n%s\n%lld %lld\n",
+		AVENIDA_VERSION, LUA_RELEASE, path, (long long)sb->st_mtime,
+		(long long)sb->st_size);
+
+	avnhash_init(&h);
+	avnhash_update(&h, line, strlen(line));
+	avnhash_update(&h, src->data, src->len);
+	avnhash_final(&h, digest);
+}
+
+
+/*
+ * Dumps the function on top of the stack into the cache. It's written
+ * under a temporary name first, so that a concurrent avenida never sees a
+ * half-written entry. The debug info is kept, so errors still have line
+ * numbers.
+ */
+static void
+store(lua_State *L, const char *entrypath, const unsigned char *digest)
+{
+	struct buffer out = { NULL, 0, 0 };
+	char tmp[PATH_MAX];
+	FILE *fp;
+	bool ok;
+
+	if (!buffer_append(&out, digest, AVNHASH_LEN) ||
+		(lua_dump(L, dump_writer, &out, 0) != 0)) {
+			free(out.data);
+			return;
+	}
+
+	snprintf(tmp, PATH_MAX, "%s.%ld", entrypath, (long)getpid());
+
+	if ((fp = fopen(tmp, "wb")) == NULL) {
+		free(out.data);
+		return;
+	}
+
+	ok = (fwrite(out.data, 1, out.len, fp) == out.len);
+	ok = (fclose(fp) == 0) && ok;
+
+	if (!ok || (rename(tmp, entrypath) == -1))
+		unlink(tmp);
+
+	free(out.data);
+}
+
+
+static int
+dump_writer(lua_State *L, const void *p, size_t len, void *ud)
+{
+	return buffer_append(ud, p, len) ? 0 : 1;
+}
+
+
+static bool
+buffer_append(struct buffer *buf, const void *p, size_t len)
+{
+	unsigned char *tmp;
+	size_t cap;
+
+	if (buf->len + len > buf->cap) {
+		cap = (buf->cap > 0) ? buf->cap : 4096;
+		while (cap < buf->len + len)
+			cap *= 2;
+		if ((tmp = realloc(buf->data, cap)) == NULL)
+			return false;
+		buf->data = tmp;
+		buf->cap = cap;
+	}
+
+	memcpy(buf->data + buf->len, p, len);
+	buf->len += len;
+	return true;
+}
@@ -0,0 +1,19 @@
+/*
+ * vim: noet
+ *
+ * bytecode.h
+ * Christian Koch <cfkoch@sdf.lonestar.org>
+ */
+
+#ifndef AVENIDA_BYTECODE_H
+#define AVENIDA_BYTECODE_H
+
+#include <stdbool.h>
+
+#include <lua.h>
+
+bool avnbytecode_enable(const char *dir);
+void avnbytecode_disable(void);
+int avnbytecode_loadfile(lua_State *, const char *path);
+
+#endif /* AVENIDA_BYTECODE_H */
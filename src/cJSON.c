@@ -95,31 +95,32 @@ void cJSON_Delete(cJSON *c)
 /* Parse the input text to generate a number, and populate the result into item. */
 static const char *parse_number(cJSON *item,const char *num)
 {
-	double n=0,sign=1,scale=0;int subscale=0,signsubscale=1;
-
-	if (*num=='-') sign=-1,num++;	/* Has sign? */
-	if (*num=='0') num++;			/* is zero */
-	if (*num>='1' && *num<='9')	do	n=(n*10.0)+(*num++ -'0');	while (*num>='0' && *num<='9');	/* Number? */
-	if (*num=='.' && num[1]>='0' && num[1]<='9') {num++;		do	n=(n*10.0)+(*num++ -'0'),scale--; while (*num>='0' && *num<='9');}	/* Fractional part? */
-	if (*num=='e' || *num=='E')		/* Exponent? */
-	{	num++;if (*num=='+') num++;	else if (*num=='-') signsubscale=-1,num++;		/* With sign? */
-		while (*num>='0' && *num<='9') subscale=(subscale*10)+(*num++ - '0');	/* Number? */
-	}
+	const char *p=num;char *end;double n;
+
+	/* Check the JSON grammar, then let strtod() round it correctly. */
+	if (*p=='-') p++;
+	if (*p=='0') p++;
+	else if (*p>='1' && *p<='9') while (*p>='0' && *p<='9') p++;
+	else {ep=num;return 0;}
+	if (*p=='.' && p[1]>='0' && p[1]<='9') {p++;while (*p>='0' && *p<='9') p++;}
+	if ((*p=='e' || *p=='E') && ((p[1]>='0' && p[1]<='9') || ((p[1]=='+' || p[1]=='-') && p[2]>='0' && p[2]<='9')))
+	{	p+=2;while (*p>='0' && *p<='9') p++;	}
+
+	n=strtod(num,&end);
+	if (end!=p) {ep=num;return 0;}
 
-	n=sign*n*pow(10.0,(scale+subscale*signsubscale));	/* number = +/- number.fraction * 10^+/- exponent */
-	
 	item->valuedouble=n;
 	item->valueint=(int)n;
 	item->type=cJSON_Number;
-	return num;
+	return p;
 }
 
-/* Render the number nicely from the given item into a string. */
+/* Render the number so that it reads back as exactly the same double. */
 static char *print_number(cJSON *item)
 {
 	char *str;
 	double d=item->valuedouble;
-	if (fabs(((double)item->valueint)-d)<=DBL_EPSILON && d<=INT_MAX && d>=INT_MIN)
+	if (d==(double)item->valueint && d<=INT_MAX && d>=INT_MIN)
 	{
 		str=(char*)cJSON_malloc(21);	/* 2^64+1 can be represented in 21 chars. */
 		if (str) sprintf(str,"%d",item->valueint);
@@ -129,9 +130,8 @@ static char *print_number(cJSON *item)
 		str=(char*)cJSON_malloc(64);	/* This is a nice tradeoff. */
 		if (str)
 		{
-			if (fabs(floor(d)-d)<=DBL_EPSILON && fabs(d)<1.0e60)sprintf(str,"%.0f",d);
-			else if (fabs(d)<1.0e-6 || fabs(d)>1.0e9)			sprintf(str,"%e",d);
-			else												sprintf(str,"%f",d);
+			sprintf(str,"%.15g",d);
+			if (strtod(str,0)!=d) sprintf(str,"%.17g",d);
 		}
 	}
 	return str;
@@ -0,0 +1,352 @@
+/*
+ * vim: noet
+ *
+ * cache.c
+ * Christian Koch <cfkoch@sdf.lonestar.org>
+ *
+ * The render cache keeps finished output files around, named after a hash
+ * of everything that went into them: the source file's contents, the op
+ * history, and how the output was encoded. If a script asks for the same
+ * thing again, the file is copied out of the cache instead of being
+ * decoded, rendered and encoded all over again.
+ *
+ * Entries are copied rather than linked, so that editing an output file in
+ * place can't corrupt the cache. Every hit touches the entry, and when the
+ * cache outgrows its size limit, the entries which were used longest ago
+ * are thrown out first.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "avenida.h"
+#include "cache.h"
+#include "hash.h"
+
+struct entry {
+	char name[AVNHASH_HEX_LEN];
+	off_t size;
+	time_t mtime;
+};
+
+static struct avncachestats cache = { .enabled = false };
+
+static bool copy_file(const char *, const char *);
+static bool scan(const bool evict);
+static int entry_cmp(const void *, const void *);
+
+/*
+ * Starts caching renders in the given directory, creating it if need be,
+ * and keeping it under "size" bytes. A NULL directory means the usual spot
+ * (see avncache_default_dir()).
+ */
+bool
+avncache_enable(const char *dir, const off_t size)
+{
+	char defdir[PATH_MAX];
+
+	if (dir == NULL) {
+		if (!avncache_default_dir(defdir))
+			return false;
+		dir = defdir;
+	}
+
+	if (!avncache_mkdirs(dir))
+		return false;
+
+	snprintf(cache.dir, PATH_MAX, "%s", dir);
+	cache.size = (size > 0) ? size : AVNCACHE_DEFAULT_SIZE;
+	cache.enabled = true;
+	return scan(true);
+}
+
+
+void
+avncache_disable(void)
+{
+	cache.enabled = false;
+}
+
+
+bool
+avncache_enabled(void)
+{
+	return cache.enabled;
+}
+
+
+void
+avncache_stats(struct avncachestats *stats)
+{
+	*stats = cache;
+}
+
+
+/*
+ * The key covers the version too, since a newer renderer may well produce
+ * different pixels from the same history.
+ */
+bool
+avncache_key(const char *source, const char *history, const char *options,
+	char key[AVNHASH_HEX_LEN])
+{
+	avnhash h, src;
+	unsigned char digest[AVNHASH_LEN];
+	char hex[AVNHASH_HEX_LEN];
+
+	avnhash_init(&src);
+	if (!avnhash_file(&src, source))
+		return false;
+	avnhash_final(&src, digest);
+	avnhash_hex(digest, hex);
+
+	avnhash_init(&h);
+	avnhash_update(&h, "avenida " AVENIDA_VERSION "\n",
+		strlen("avenida " AVENIDA_VERSION "\n"));
+	avnhash_update(&h, hex, strlen(hex));
+	avnhash_update(&h, "\n", 1);
+	avnhash_update(&h, history, strlen(history));
+	avnhash_update(&h, "\n", 1);
+	avnhash_update(&h, options, strlen(options));
+	avnhash_final(&h, digest);
+	avnhash_hex(digest, key);
+	return true;
+}
+
+
+/*
+ * Copies the entry for the given key to path. Returns false on a miss, and
+ * on any kind of trouble, in which case the caller should just render.
+ */
+bool
+avncache_fetch(const char *key, const char *path)
+{
+	char entry[PATH_MAX];
+
+	if (!cache.enabled)
+		return false;
+
+	snprintf(entry, PATH_MAX, "%s/%s", cache.dir, key);
+
+	if (!copy_file(entry, path)) {
+		cache.misses++;
+		return false;
+	}
+
+	utimes(entry, NULL);
+	cache.hits++;
+	return true;
+}
+
+
+/*
+ * Adds the file at path to the cache under the given key. It's written
+ * under a temporary name first, so that a concurrent avenida never sees a
+ * half-written entry.
+ */
+bool
+avncache_store(const char *key, const char *path)
+{
+	char entry[PATH_MAX], tmp[PATH_MAX];
+	struct stat sb;
+
+	if (!cache.enabled)
+		return false;
+
+	snprintf(entry, PATH_MAX, "%s/%s", cache.dir, key);
+	snprintf(tmp, PATH_MAX, "%s/.%s.%ld", cache.dir, key, (long)getpid());
+
+	if (!copy_file(path, tmp))
+		goto fail;
+
+	if ((stat(tmp, &sb) == -1) || (rename(tmp, entry) == -1))
+		goto fail;
+
+	cache.used += sb.st_size;
+
+	/*
+	 * Other processes may be filling the same cache, so "used" is only a
+	 * guess until the directory is scanned again.
+	 */
+	if (cache.used > cache.size)
+		scan(true);
+
+	return true;
+
+fail:
+	unlink(tmp);
+	return false;
+}
+
+/*
+ * Where Avenida keeps its caches unless told otherwise: under
+ * $XDG_CACHE_HOME or ~/.cache.
+ */
+bool
+avncache_default_dir(char dir[PATH_MAX])
+{
+	const char *base;
+
+	if ((base = getenv("XDG_CACHE_HOME")) != NULL && (*base != '\0'))
+		snprintf(dir, PATH_MAX, "%s/avenida", base);
+	else if ((base = getenv("HOME")) != NULL)
+		snprintf(dir, PATH_MAX, "%s/.cache/avenida", base);
+	else
+		return false;
+
+	return true;
+}
+
+
+/*
+ * Like mkdir -p.
+ */
+bool
+avncache_mkdirs(const char *dir)
+{
+	char path[PATH_MAX];
+	char *p;
+
+	snprintf(path, PATH_MAX, "%s", dir);
+
+	for (p = path + 1; *p != '\0'; p++) {
+		if (*p != '/')
+			continue;
+		*p = '\0';
+		if ((mkdir(path, 0755) == -1) && (errno != EEXIST))
+			return false;
+		*p = '/';
+	}
+
+	if ((mkdir(path, 0755) == -1) && (errno != EEXIST))
+		return false;
+
+	return true;
+}
+
+/* */
+
+static bool
+copy_file(const char *from, const char *to)
+{
+	char buf[64 * 1024];
+	ssize_t n, w, off;
+	int in, out;
+	bool ok = true;
+
+	if ((in = open(from, O_RDONLY)) == -1)
+		return false;
+
+	if ((out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+		close(in);
+		return false;
+	}
+
+	while (ok && ((n = read(in, buf, sizeof(buf))) != 0)) {
+		if (n == -1) {
+			ok = (errno == EINTR);
+			continue;
+		}
+
+		for (off = 0; off < n; off += w) {
+			if ((w = write(out, buf + off, n - off)) == -1) {
+				ok = false;
+				break;
+			}
+		}
+	}
+
+	close(in);
+	if (close(out) == -1)
+		ok = false;
+
+	return ok;
+}
+
+
+/*
+ * Adds up the size of every entry. If that's over the limit and "evict" is
+ * set, throws out the least recently used entries until it's down to 90%
+ * of the limit, so that we're not back in here on the very next store.
+ */
+static bool
+scan(const bool evict)
+{
+	DIR *dir;
+	struct dirent *de;
+	struct stat sb;
+	struct entry *entries = NULL, *tmp;
+	size_t i, n = 0, cap = 0;
+	char path[PATH_MAX];
+	off_t used = 0;
+
+	if ((dir = opendir(cache.dir)) == NULL)
+		return false;
+
+	while ((de = readdir(dir)) != NULL) {
+		/* Skips ".", ".." and anything still being written. */
+		if ((de->d_name[0] == '.') ||
+			(strlen(de->d_name) != AVNHASH_HEX_LEN - 1))
+				continue;
+
+		snprintf(path, PATH_MAX, "%s/%s", cache.dir, de->d_name);
+		if ((stat(path, &sb) == -1) || !S_ISREG(sb.st_mode))
+			continue;
+
+		if (n == cap) {
+			cap = (cap > 0) ? cap * 2 : 256;
+			if ((tmp = realloc(entries, cap * sizeof(struct entry))) == NULL) {
+				free(entries);
+				closedir(dir);
+				return false;
+			}
+			entries = tmp;
+		}
+
+		snprintf(entries[n].name, AVNHASH_HEX_LEN, "%s", de->d_name);
+		entries[n].size = sb.st_size;
+		entries[n].mtime = sb.st_mtime;
+		used += sb.st_size;
+		n++;
+	}
+
+	closedir(dir);
+
+	if (evict && (used > cache.size)) {
+		qsort(entries, n, sizeof(struct entry), entry_cmp);
+
+		for (i = 0; (i < n) && (used > (cache.size / 10) * 9); i++) {
+			snprintf(path, PATH_MAX, "%s/%s", cache.dir, entries[i].name);
+			if (unlink(path) == 0)
+				used -= entries[i].size;
+		}
+	}
+
+	cache.used = used;
+	free(entries);
+	return true;
+}
+
+
+static int
+entry_cmp(const void *a, const void *b)
+{
+	const struct entry *ea = a, *eb = b;
+
+	if (ea->mtime < eb->mtime)
+		return -1;
+	else if (ea->mtime > eb->mtime)
+		return 1;
+	else
+		return 0;
+}
@@ -0,0 +1,39 @@
+/*
+ * vim: noet
+ *
+ * cache.h
+ * Christian Koch <cfkoch@sdf.lonestar.org>
+ */
+
+#ifndef AVENIDA_CACHE_H
+#define AVENIDA_CACHE_H
+
+#include <limits.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "hash.h"
+
+#define AVNCACHE_DEFAULT_SIZE ((off_t)1024 * 1024 * 1024)
+
+struct avncachestats {
+	bool enabled;
+	char dir[PATH_MAX];
+	off_t size;
+	off_t used;
+	unsigned long hits;
+	unsigned long misses;
+};
+
+bool avncache_enable(const char *dir, const off_t size);
+void avncache_disable(void);
+bool avncache_enabled(void);
+void avncache_stats(struct avncachestats *);
+bool avncache_key(const char *source, const char *history,
+	const char *options, char key[AVNHASH_HEX_LEN]);
+bool avncache_fetch(const char *key, const char *path);
+bool avncache_store(const char *key, const char *path);
+bool avncache_default_dir(char dir[PATH_MAX]);
+bool avncache_mkdirs(const char *dir);
+
+#endif /* AVENIDA_CACHE_H */
@@ -6,89 +6,64 @@
  */
 
 #include <limits.h>
-#include <stdarg.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "cJSON.h"
 
 #include "commands.h"
+#include "hash.h"
+#include "oplist.h"
 
-struct avncmdarg *
-avncmdarg_new(void)
-{
-	struct avncmdarg *cmdarg;
-	cmdarg = malloc(sizeof(struct avncmdarg));
-	return cmdarg;
-}
-
-
-struct avncmdarg *
-avncmdarg_new_uint(const unsigned int arg)
-{
-	struct avncmdarg *cmdarg;
-
-	if ((cmdarg = avncmdarg_new()) == NULL)
-		return NULL;
-
-	cmdarg->type = AVN_UINT;
-	cmdarg->arg_uint = arg;
-
-	return cmdarg;
-}
-
-
-struct avncmdarg *
-avncmdarg_new_int(const int arg)
-{
-	struct avncmdarg *cmdarg;
-
-	if ((cmdarg = avncmdarg_new()) == NULL)
-		return NULL;
-
-	cmdarg->type = AVN_INT;
-	cmdarg->arg_int = arg;
-
-	return cmdarg;
-}
-
-
-struct avncmdarg *
-avncmdarg_new_double(const double arg)
-{
-	struct avncmdarg *cmdarg;
-
-	if ((cmdarg = avncmdarg_new()) == NULL)
-		return NULL;
-
-	cmdarg->type = AVN_DOUBLE;
-	cmdarg->arg_double = arg;
-
-	return cmdarg;
-}
-
-
-struct avncmdarg *
-avncmdarg_new_str(const char *arg)
-{
-	struct avncmdarg *cmdarg;
-
-	if ((cmdarg = avncmdarg_new()) == NULL)
-		return NULL;
-
-	cmdarg->type = AVN_STRING;
-	cmdarg->arg_str = (char *)arg;
-
-	return cmdarg;
-}
-
-
-void
-avncmdarg_free(struct avncmdarg *cmdarg)
-{
-	free(cmdarg);
-}
-
+/*
+ * The arguments each raster op is recorded with, one letter apiece: "u"
+ * for an unsigned int, "i" for an int, "d" for a double and "s" for a
+ * string. Modulate is in here too; only the optimizer makes it, but a plan
+ * can ask for it directly.
+ */
+static const struct {
+	enum avncmdname name;
+	const char *args;
+} signatures[] = {
+	{RASTER_BORDER, "uus"},
+	{RASTER_BRIGHTNESS, "d"},
+	{RASTER_CHARCOAL, "d"},
+	{RASTER_CROP, "uuuu"},
+	{RASTER_DESPECKLE, ""},
+	{RASTER_EDGE, "d"},
+	{RASTER_EMBOSS, "d"},
+	{RASTER_EQUALIZE, ""},
+	{RASTER_GAMMA, "d"},
+	{RASTER_GAUSSIANBLUR, "d"},
+	{RASTER_HORIZONTALFLIP, ""},
+	{RASTER_HUE, "d"},
+	{RASTER_IMPLODE, "d"},
+	{RASTER_LEVELS, "ddd"},
+	{RASTER_MODULATE, "ddd"},
+	{RASTER_MOTIONBLUR, "dd"},
+	{RASTER_NEGATE, ""},
+	{RASTER_NEGATEGRAYS, ""},
+	{RASTER_NORMALIZE, ""},
+	{RASTER_OILPAINT, "d"},
+	{RASTER_RADIALBLUR, "d"},
+	{RASTER_RESIZE, "uus"},
+	{RASTER_ROLL, "ii"},
+	{RASTER_ROTATE, "ds"},
+	{RASTER_SATURATION, "d"},
+	{RASTER_SCALE, "ds"},
+	{RASTER_SHARPEN, "d"},
+	{RASTER_SWIRL, "d"},
+	{RASTER_TINT, "sd"},
+	{RASTER_VERTICALFLIP, ""},
+	{RASTER_WAVE, "dd"},
+};
+
+static bool arg_from_json(struct avncmdarg *, const char, const cJSON *);
 
 char *
 stravncmdname(const enum avncmdname cmdname)
@@ -110,6 +85,7 @@ stravncmdname(const enum avncmdname cmdname)
 	case RASTER_HUE: s = "hue"; break;
 	case RASTER_IMPLODE: s = "implode"; break;
 	case RASTER_LEVELS: s = "levels"; break;
+	case RASTER_MODULATE: s = "modulate"; break;
 	case RASTER_MOTIONBLUR: s = "motionblur"; break;
 	case RASTER_NEGATE: s = "negate"; break;
 	case RASTER_NEGATEGRAYS: s = "negategrays"; break;
@@ -140,68 +116,6 @@ stravncmdname(const enum avncmdname cmdname)
 }
 
 
-struct avnop *
-avnop_new(const enum avncmdname name)
-{
-	struct avnop *op;
-
-	if ((op = malloc(sizeof(struct avnop))) == NULL)
-		return NULL;
-
-	op->name = name;
-	op->nargs = 0;
-
-	return op;
-}
-
-
-void
-avnop_add_arg(struct avnop *op, const enum avncmdargtype type, ...)
-{
-	va_list ap;
-	struct avncmdarg *arg;
-
-	va_start(ap, type);
-
-	switch (type) {
-	case AVN_UINT:
-		arg = avncmdarg_new_uint(va_arg(ap, unsigned int));
-		break;
-	case AVN_INT:
-		arg = avncmdarg_new_int(va_arg(ap, int));
-		break;
-	case AVN_DOUBLE:
-		arg = avncmdarg_new_double(va_arg(ap, double));
-		break;
-	case AVN_STRING:
-		arg = avncmdarg_new_str(va_arg(ap, char *));
-		break;
-	default:
-		return; /* NOTREACHED */
-	}
-
-	if (arg == NULL)
-		return;
-
-	va_end(ap);
-
-	op->args[op->nargs] = arg;
-	(op->nargs)++;
-}
-
-
-void
-avnop_free(struct avnop *op)
-{
-	int i;
-
-	for (i = 0; i < op->nargs; i++)
-		avncmdarg_free(op->args[i]);
-
-	free(op);
-}
-
-
 /*
  * Serializes the given avnop to a cJSON* object. It needs to be eventually
  * freed with cJSON_Delete().
@@ -225,22 +139,22 @@ avnop_to_json(const struct avnop *op)
 	args_ary = cJSON_CreateArray();
 
 	for (i = 0; i < op->nargs; i++) {
-		switch (op->args[i]->type) {
+		switch (op->args[i].type) {
 		case AVN_UINT: 
 			cJSON_AddItemToArray(args_ary,
-				cJSON_CreateNumber(op->args[i]->arg_uint));
+				cJSON_CreateNumber(op->args[i].arg_uint));
 			break;
 		case AVN_INT:
 			cJSON_AddItemToArray(args_ary,
-				cJSON_CreateNumber(op->args[i]->arg_int));
+				cJSON_CreateNumber(op->args[i].arg_int));
 			break;
 		case AVN_DOUBLE:
 			cJSON_AddItemToArray(args_ary,
-				cJSON_CreateNumber(op->args[i]->arg_double));
+				cJSON_CreateNumber(op->args[i].arg_double));
 			break;
 		case AVN_STRING:
 			cJSON_AddItemToArray(args_ary,
-				cJSON_CreateString(op->args[i]->arg_str));
+				cJSON_CreateString(op->args[i].arg_str));
 			break;
 		}
 	}
@@ -249,3 +163,159 @@ avnop_to_json(const struct avnop *op)
 
 	return json;
 }
+
+
+/*
+ * Feeds the op into the hash exactly: its name, and each argument's type
+ * and value, with doubles as their bits and strings in full. Unlike the
+ * JSON, two ops only hash the same if they really are the same.
+ */
+void
+avnop_hash(struct avnhash *h, const struct avnop *op)
+{
+	const struct avncmdarg *arg;
+	uint32_t name, nargs, type;
+	uint64_t len;
+	unsigned int i;
+
+	name = (uint32_t)op->name;
+	nargs = (uint32_t)op->nargs;
+	avnhash_update(h, &name, sizeof(name));
+	avnhash_update(h, &nargs, sizeof(nargs));
+
+	for (i = 0; i < op->nargs; i++) {
+		arg = &op->args[i];
+		type = (uint32_t)arg->type;
+		avnhash_update(h, &type, sizeof(type));
+
+		switch (arg->type) {
+		case AVN_UINT:
+			avnhash_update(h, &arg->arg_uint, sizeof(arg->arg_uint));
+			break;
+		case AVN_INT:
+			avnhash_update(h, &arg->arg_int, sizeof(arg->arg_int));
+			break;
+		case AVN_DOUBLE:
+			avnhash_update(h, &arg->arg_double, sizeof(arg->arg_double));
+			break;
+		case AVN_STRING:
+			len = strlen(arg->arg_str);
+			avnhash_update(h, &len, sizeof(len));
+			avnhash_update(h, arg->arg_str, len);
+			break;
+		}
+	}
+}
+
+
+/*
+ * The opposite of avnop_to_json(): adds the raster op the given object
+ * describes to the list, and returns it. Returns NULL if there's no such
+ * op, or if its arguments aren't the ones it's recorded with.
+ */
+struct avnop *
+avnop_from_json(struct avnoplist *list, const cJSON *json)
+{
+	struct avnop *op, *added;
+	cJSON *name, *args;
+	const char *sig;
+	unsigned int i, nargs;
+
+	if ((json == NULL) || (json->type != cJSON_Object))
+		return NULL;
+
+	name = cJSON_GetObjectItem((cJSON*)json, "name");
+	args = cJSON_GetObjectItem((cJSON*)json, "args");
+
+	if ((name == NULL) || (name->type != cJSON_String))
+		return NULL;
+
+	sig = NULL;
+	for (i = 0; i < sizeof(signatures) / sizeof(signatures[0]); i++) {
+		if (!strcmp(name->valuestring, stravncmdname(signatures[i].name))) {
+			sig = signatures[i].args;
+			break;
+		}
+	}
+
+	if (sig == NULL)
+		return NULL;
+
+	/* An op with no arguments can leave them out altogether. */
+	nargs = (unsigned int)strlen(sig);
+	if (args == NULL) {
+		if (nargs > 0)
+			return NULL;
+	} else if ((args->type != cJSON_Array) ||
+		(cJSON_GetArraySize(args) != (int)nargs)) {
+			return NULL;
+	}
+
+	op = malloc(offsetof(struct avnop, args) +
+		nargs * sizeof(struct avncmdarg));
+	if (op == NULL)
+		return NULL;
+
+	op->name = signatures[i].name;
+	op->nargs = nargs;
+
+	for (i = 0; i < nargs; i++) {
+		if (!arg_from_json(&op->args[i], sig[i],
+			cJSON_GetArrayItem(args, i))) {
+				free(op);
+				return NULL;
+		}
+	}
+
+	added = avnoplist_push(list, op);
+	free(op);
+
+	return added;
+}
+
+/* */
+
+/*
+ * Numbers all come out of JSON as doubles, so the integer kinds have to
+ * be whole and fit. Strings are borrowed from the JSON until the op is
+ * pushed, which makes its own copy.
+ */
+static bool
+arg_from_json(struct avncmdarg *arg, const char kind, const cJSON *json)
+{
+	const double v = json->valuedouble;
+
+	if (kind == 's') {
+		if (json->type != cJSON_String)
+			return false;
+		arg->type = AVN_STRING;
+		arg->arg_str = json->valuestring;
+		return true;
+	}
+
+	if (json->type != cJSON_Number)
+		return false;
+
+	switch (kind) {
+	case 'u':
+		if ((v != floor(v)) || (v < 0.0) || (v > (double)UINT_MAX))
+			return false;
+		arg->type = AVN_UINT;
+		arg->arg_uint = (unsigned int)v;
+		break;
+	case 'i':
+		if ((v != floor(v)) || (v < (double)INT_MIN) ||
+			(v > (double)INT_MAX))
+				return false;
+		arg->type = AVN_INT;
+		arg->arg_int = (int)v;
+		break;
+	default:
+		if (!isfinite(v))
+			return false;
+		arg->type = AVN_DOUBLE;
+		arg->arg_double = v;
+	}
+
+	return true;
+}
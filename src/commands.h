@@ -14,6 +14,9 @@
 
 #include "cJSON.h"
 
+struct avnhash;
+struct avnoplist;
+
 enum avncmdname {
 	/* Audio commands */
 	/* ... */
@@ -33,6 +36,7 @@ enum avncmdname {
 	RASTER_HUE,
 	RASTER_IMPLODE,
 	RASTER_LEVELS,
+	RASTER_MODULATE,
 	RASTER_MOTIONBLUR,
 	RASTER_NEGATE,
 	RASTER_NEGATEGRAYS,
@@ -90,25 +94,19 @@ struct avncmdarg {
 };
 
 /*
- * An Avenida operation consists of zero or more arguments.
+ * An Avenida operation consists of zero or more arguments, which are
+ * stored right after it. Ops are only ever created inside an avnoplist
+ * (see oplist.h), which owns them.
  */
 struct avnop {
 	enum avncmdname name;
 	unsigned int nargs;
-	struct avncmdarg *args[AVENIDA_CMD_MAX_ARGS];
+	struct avncmdarg args[];
 };
 
-struct avncmdarg *avncmdarg_new(void);
-struct avncmdarg *avncmdarg_new_uint(const unsigned int);
-struct avncmdarg *avncmdarg_new_int(const int);
-struct avncmdarg *avncmdarg_new_double(const double);
-struct avncmdarg *avncmdarg_new_str(const char *);
-void avncmdarg_free(struct avncmdarg *);
-
 char *stravncmdname(const enum avncmdname cmdname);
-struct avnop *avnop_new(const enum avncmdname);
-void avnop_add_arg(struct avnop *, const enum avncmdargtype, ...);
-void avnop_free(struct avnop *);
 cJSON *avnop_to_json(const struct avnop *);
+struct avnop *avnop_from_json(struct avnoplist *, const cJSON *);
+void avnop_hash(struct avnhash *, const struct avnop *);
 
 #endif /* AVENIDA_COMMANDS_H */
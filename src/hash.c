@@ -0,0 +1,185 @@
+/*
+ * vim: noet
+ *
+ * hash.c
+ * Christian Koch <cfkoch@sdf.lonestar.org>
+ *
+ * SHA-256, as described in FIPS 180-4. We only need it for cache keys, so
+ * it's written for clarity rather than speed; hashing a file is still a lot
+ * cheaper than decoding it.
+ */
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hash.h"
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static const uint32_t k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static void compress(avnhash *, const unsigned char *);
+
+void
+avnhash_init(avnhash *h)
+{
+	static const uint32_t iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	memcpy(h->state, iv, sizeof(iv));
+	h->length = 0;
+	h->nblock = 0;
+}
+
+
+void
+avnhash_update(avnhash *h, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	size_t n;
+
+	h->length += len;
+
+	while (len > 0) {
+		if ((h->nblock == 0) && (len >= 64)) {
+			compress(h, p);
+			p += 64;
+			len -= 64;
+			continue;
+		}
+
+		n = 64 - h->nblock;
+		if (n > len)
+			n = len;
+
+		memcpy(h->block + h->nblock, p, n);
+		h->nblock += n;
+		p += n;
+		len -= n;
+
+		if (h->nblock == 64) {
+			compress(h, h->block);
+			h->nblock = 0;
+		}
+	}
+}
+
+
+void
+avnhash_final(avnhash *h, unsigned char digest[AVNHASH_LEN])
+{
+	uint64_t bits = h->length * 8;
+	unsigned char pad[72];
+	size_t npad;
+	int i;
+
+	/* A one bit, zeros up to 56 mod 64, then the length in bits. */
+	npad = (h->nblock < 56) ? (56 - h->nblock) : (120 - h->nblock);
+	memset(pad, 0, sizeof(pad));
+	pad[0] = 0x80;
+	for (i = 0; i < 8; i++)
+		pad[npad + i] = bits >> (56 - (i * 8));
+
+	avnhash_update(h, pad, npad + 8);
+
+	for (i = 0; i < 8; i++) {
+		digest[(i * 4) + 0] = h->state[i] >> 24;
+		digest[(i * 4) + 1] = h->state[i] >> 16;
+		digest[(i * 4) + 2] = h->state[i] >> 8;
+		digest[(i * 4) + 3] = h->state[i];
+	}
+}
+
+
+/*
+ * Feeds the whole file at the given path into the hash.
+ */
+bool
+avnhash_file(avnhash *h, const char *path)
+{
+	unsigned char buf[64 * 1024];
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return false;
+
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		avnhash_update(h, buf, n);
+
+	close(fd);
+	return n == 0;
+}
+
+
+void
+avnhash_hex(const unsigned char digest[AVNHASH_LEN],
+	char hex[AVNHASH_HEX_LEN])
+{
+	int i;
+
+	for (i = 0; i < AVNHASH_LEN; i++)
+		snprintf(hex + (i * 2), 3, "%02x", digest[i]);
+}
+
+/* */
+
+static void
+compress(avnhash *h, const unsigned char *block)
+{
+	uint32_t w[64], s[8], t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		w[i] = ((uint32_t)block[(i * 4) + 0] << 24) |
+			((uint32_t)block[(i * 4) + 1] << 16) |
+			((uint32_t)block[(i * 4) + 2] << 8) |
+			(uint32_t)block[(i * 4) + 3];
+	}
+
+	for (i = 16; i < 64; i++) {
+		w[i] = w[i-16] + w[i-7] +
+			(ROTR(w[i-15], 7) ^ ROTR(w[i-15], 18) ^ (w[i-15] >> 3)) +
+			(ROTR(w[i-2], 17) ^ ROTR(w[i-2], 19) ^ (w[i-2] >> 10));
+	}
+
+	memcpy(s, h->state, sizeof(s));
+
+	for (i = 0; i < 64; i++) {
+		t1 = s[7] + (ROTR(s[4], 6) ^ ROTR(s[4], 11) ^ ROTR(s[4], 25)) +
+			((s[4] & s[5]) ^ (~s[4] & s[6])) + k[i] + w[i];
+		t2 = (ROTR(s[0], 2) ^ ROTR(s[0], 13) ^ ROTR(s[0], 22)) +
+			((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+		s[7] = s[6];
+		s[6] = s[5];
+		s[5] = s[4];
+		s[4] = s[3] + t1;
+		s[3] = s[2];
+		s[2] = s[1];
+		s[1] = s[0];
+		s[0] = t1 + t2;
+	}
+
+	for (i = 0; i < 8; i++)
+		h->state[i] += s[i];
+}
+
+#undef ROTR
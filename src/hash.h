@@ -0,0 +1,36 @@
+/*
+ * vim: noet
+ *
+ * hash.h
+ * Christian Koch <cfkoch@sdf.lonestar.org>
+ */
+
+#ifndef AVENIDA_HASH_H
+#define AVENIDA_HASH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define AVNHASH_LEN 32
+#define AVNHASH_HEX_LEN (AVNHASH_LEN * 2 + 1)
+
+/*
+ * The state of a SHA-256 computation.
+ */
+struct avnhash {
+	uint32_t state[8];
+	uint64_t length;
+	unsigned char block[64];
+	size_t nblock;
+};
+typedef struct avnhash avnhash;
+
+void avnhash_init(avnhash *);
+void avnhash_update(avnhash *, const void *, size_t);
+void avnhash_final(avnhash *, unsigned char digest[AVNHASH_LEN]);
+bool avnhash_file(avnhash *, const char *path);
+void avnhash_hex(const unsigned char digest[AVNHASH_LEN],
+	char hex[AVNHASH_HEX_LEN]);
+
+#endif /* AVENIDA_HASH_H */
@@ -0,0 +1,143 @@
+/*
+ * vim: noet
+ *
+ * kernels-simd.h
+ * Christian Koch <cfkoch@sdf.lonestar.org>
+ *
+ * This file has no include guard on purpose: kernels.c includes it once per
+ * instruction set, after defining KERNEL_ISA, KERNEL_TARGET and the V*
+ * macros for that instruction set. Each kernel finishes whatever doesn't
+ * fill a whole vector with the scalar version, which does exactly the same
+ * arithmetic in exactly the same order, so that every instruction set
+ * produces the same bits.
+ */
+
+#define KCAT_(a, b) a ## _ ## b
+#define KCAT(a, b) KCAT_(a, b)
+#define KNAME(name) KCAT(name, KERNEL_ISA)
+
+/*
+ * XORs the buffer against the repeating 32 byte pattern. The buffer must
+ * start at a multiple of the pattern's period.
+ */
+static KERNEL_TARGET void
+KNAME(negate)(unsigned char *p, const size_t n, const unsigned char *pattern)
+{
+	size_t i;
+	const VI mask = VILOAD(pattern);
+
+	for (i = 0; i + VBYTES <= n; i += VBYTES)
+		VISTORE(p + i, VIXOR(VILOAD(p + i), mask));
+
+	negate_scalar(p + i, n - i, pattern);
+}
+
+
+/*
+ * RGBA8 only: a pixel is gray if (x ^ (x >> 8)) has nothing left in its
+ * red and green bytes, i.e. red == green and green == blue.
+ */
+static KERNEL_TARGET void
+KNAME(negategrays8)(unsigned char *p, const size_t npixels)
+{
+	size_t i;
+	VI x, gray;
+	const VI rg = VISET32(0x0000ffff);
+	const VI rgb = VISET32(0x00ffffff);
+	const VI zero = VISET32(0);
+
+	for (i = 0; i + VBYTES / 4 <= npixels; i += VBYTES / 4) {
+		x = VILOAD(p + (i * 4));
+		gray = VIEQ32(VIAND(VIXOR(x, VISHR32(x, 8)), rg), zero);
+		VISTORE(p + (i * 4), VIXOR(x, VIAND(gray, rgb)));
+	}
+
+	negategrays8_scalar(p + (i * 4), npixels - i);
+}
+
+
+static inline KERNEL_TARGET VF
+KNAME(hue2rgb)(const VF p, const VF q, VF t)
+{
+	const VF zero = VSET(0.0f), one = VSET(1.0f), six = VSET(6.0f);
+	const VF sixth = VSET(1.0f / 6.0f), half = VSET(0.5f);
+	const VF twothirds = VSET(2.0f / 3.0f);
+	VF rise, fall, v;
+
+	t = VSEL(VLT(t, zero), VADD(t, one), t);
+	t = VSEL(VLT(one, t), VSUB(t, one), t);
+
+	rise = VADD(p, VMUL(VMUL(VSUB(q, p), six), t));
+	fall = VADD(p, VMUL(VMUL(VSUB(q, p), six), VSUB(twothirds, t)));
+
+	v = VSEL(VLT(t, twothirds), fall, p);
+	v = VSEL(VLT(t, half), q, v);
+	v = VSEL(VLT(t, sixth), rise, v);
+	return v;
+}
+
+
+/*
+ * Converts each pixel to HSL, scales its lightness and saturation, rotates
+ * its hue, and converts it back. See hsl_modulate_scalar() for the long
+ * hand version.
+ */
+static KERNEL_TARGET void
+KNAME(hsl_modulate)(float *r, float *g, float *b, const size_t n,
+	const struct hslmod *m)
+{
+	size_t i;
+	const VF zero = VSET(0.0f), half = VSET(0.5f), one = VSET(1.0f);
+	const VF two = VSET(2.0f), four = VSET(4.0f);
+	const VF sixth = VSET(1.0f / 6.0f), third = VSET(1.0f / 3.0f);
+	const VF lf = VSET(m->lightness), sf = VSET(m->saturation);
+	const VF hshift = VSET(m->hue);
+	VF vr, vg, vb, mx, mn, sum, d, dsafe, h, s, l, q, p;
+	VM gray;
+
+	for (i = 0; i + VWIDTH <= n; i += VWIDTH) {
+		vr = VLOAD(r + i);
+		vg = VLOAD(g + i);
+		vb = VLOAD(b + i);
+
+		mx = VMAX(VMAX(vr, vg), vb);
+		mn = VMIN(VMIN(vr, vg), vb);
+		sum = VADD(mx, mn);
+		l = VMUL(sum, half);
+		d = VSUB(mx, mn);
+		gray = VEQ(d, zero);
+		dsafe = VSEL(gray, one, d);
+
+		s = VSEL(VLE(l, half), VDIV(d, sum), VDIV(d, VSUB(two, sum)));
+
+		h = VADD(four, VDIV(VSUB(vr, vg), dsafe));
+		h = VSEL(VEQ(vg, mx), VADD(two, VDIV(VSUB(vb, vr), dsafe)), h);
+		h = VSEL(VEQ(vr, mx), VDIV(VSUB(vg, vb), dsafe), h);
+		h = VMUL(h, sixth);
+		h = VSEL(VLT(h, zero), VADD(h, one), h);
+
+		h = VSEL(gray, zero, h);
+		s = VSEL(gray, zero, s);
+
+		h = VADD(h, hshift);
+		h = VSEL(VLT(h, zero), VADD(h, one), h);
+		h = VSEL(VLE(one, h), VSUB(h, one), h);
+		s = VMIN(VMUL(s, sf), one);
+		l = VMIN(VMUL(l, lf), one);
+
+		q = VSEL(VLT(l, half), VMUL(l, VADD(one, s)),
+			VSUB(VADD(l, s), VMUL(l, s)));
+		p = VSUB(VADD(l, l), q);
+
+		gray = VEQ(s, zero);
+		VSTORE(r + i, VSEL(gray, l, KNAME(hue2rgb)(p, q, VADD(h, third))));
+		VSTORE(g + i, VSEL(gray, l, KNAME(hue2rgb)(p, q, h)));
+		VSTORE(b + i, VSEL(gray, l, KNAME(hue2rgb)(p, q, VSUB(h, third))));
+	}
+
+	hsl_modulate_scalar(r + i, g + i, b + i, n - i, m);
+}
+
+#undef KNAME
+#undef KCAT
+#undef KCAT_
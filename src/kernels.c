@@ -0,0 +1,867 @@
+/*
+ * vim: noet
+ *
+ * kernels.c
+ * Christian Koch <cfkoch@sdf.lonestar.org>
+ *
+ * Native pixel kernels for the point operations. Everything here works on
+ * an avnpixels buffer, a band of rows at a time, so the caller is free to
+ * spread the rows across threads.
+ *
+ * The vectorized kernels live in kernels-simd.h and get stamped out once
+ * per instruction set. Which set to use is decided the first time a kernel
+ * runs; AVENIDA_KERNELS=scalar (or sse2, avx2, neon) in the environment
+ * overrides that, which is handy for comparing results.
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kernels.h"
+#include "pixels.h"
+
+#ifdef __clang__
+#pragma STDC FP_CONTRACT OFF
+#endif
+
+#define MODULATE_BLOCK 256
+
+/*
+ * Modulation factors in the form the HSL kernels want them: lightness and
+ * saturation are multipliers, hue is a fraction of a full turn.
+ */
+struct hslmod {
+	float lightness;
+	float saturation;
+	float hue;
+};
+
+struct kernelset {
+	const char *isa;
+	void (*negate)(unsigned char *, const size_t, const unsigned char *);
+	void (*negategrays8)(unsigned char *, const size_t);
+	void (*hsl_modulate)(float *, float *, float *, const size_t,
+		const struct hslmod *);
+};
+
+static void negate_scalar(unsigned char *, const size_t,
+	const unsigned char *);
+static void negategrays8_scalar(unsigned char *, const size_t);
+static void hsl_modulate_scalar(float *, float *, float *, const size_t,
+	const struct hslmod *);
+static float hue2rgb_scalar(const float, const float, float);
+
+static void choose_kernels(void);
+static const struct kernelset *kernelset(void);
+static unsigned int channel_max(const unsigned int depth);
+static void lut_histogram(const avnlut *, const uint64_t *,
+	const unsigned int depth, const unsigned int c, uint64_t *);
+static void histogram_bounds(const uint64_t *, const size_t,
+	const uint64_t, size_t *, size_t *);
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+#define KERNEL_ISA sse2
+#define KERNEL_TARGET __attribute__((target("sse2")))
+#define VWIDTH 4
+#define VBYTES 16
+#define VF __m128
+#define VM __m128
+#define VI __m128i
+#define VLOAD(p) _mm_loadu_ps(p)
+#define VSTORE(p, v) _mm_storeu_ps((p), (v))
+#define VSET(x) _mm_set1_ps(x)
+#define VADD(a, b) _mm_add_ps((a), (b))
+#define VSUB(a, b) _mm_sub_ps((a), (b))
+#define VMUL(a, b) _mm_mul_ps((a), (b))
+#define VDIV(a, b) _mm_div_ps((a), (b))
+#define VMIN(a, b) _mm_min_ps((a), (b))
+#define VMAX(a, b) _mm_max_ps((a), (b))
+#define VLT(a, b) _mm_cmplt_ps((a), (b))
+#define VLE(a, b) _mm_cmple_ps((a), (b))
+#define VEQ(a, b) _mm_cmpeq_ps((a), (b))
+#define VSEL(m, a, b) _mm_or_ps(_mm_and_ps((m), (a)), _mm_andnot_ps((m), (b)))
+#define VILOAD(p) _mm_loadu_si128((const __m128i *)(p))
+#define VISTORE(p, v) _mm_storeu_si128((__m128i *)(p), (v))
+#define VIXOR(a, b) _mm_xor_si128((a), (b))
+#define VIAND(a, b) _mm_and_si128((a), (b))
+#define VISET32(x) _mm_set1_epi32(x)
+#define VISHR32(v, n) _mm_srli_epi32((v), (n))
+#define VIEQ32(a, b) _mm_cmpeq_epi32((a), (b))
+#include "kernels-simd.h"
+#undef KERNEL_ISA
+#undef KERNEL_TARGET
+#undef VWIDTH
+#undef VBYTES
+#undef VF
+#undef VM
+#undef VI
+#undef VLOAD
+#undef VSTORE
+#undef VSET
+#undef VADD
+#undef VSUB
+#undef VMUL
+#undef VDIV
+#undef VMIN
+#undef VMAX
+#undef VLT
+#undef VLE
+#undef VEQ
+#undef VSEL
+#undef VILOAD
+#undef VISTORE
+#undef VIXOR
+#undef VIAND
+#undef VISET32
+#undef VISHR32
+#undef VIEQ32
+
+#define KERNEL_ISA avx2
+#define KERNEL_TARGET __attribute__((target("avx2")))
+#define VWIDTH 8
+#define VBYTES 32
+#define VF __m256
+#define VM __m256
+#define VI __m256i
+#define VLOAD(p) _mm256_loadu_ps(p)
+#define VSTORE(p, v) _mm256_storeu_ps((p), (v))
+#define VSET(x) _mm256_set1_ps(x)
+#define VADD(a, b) _mm256_add_ps((a), (b))
+#define VSUB(a, b) _mm256_sub_ps((a), (b))
+#define VMUL(a, b) _mm256_mul_ps((a), (b))
+#define VDIV(a, b) _mm256_div_ps((a), (b))
+#define VMIN(a, b) _mm256_min_ps((a), (b))
+#define VMAX(a, b) _mm256_max_ps((a), (b))
+#define VLT(a, b) _mm256_cmp_ps((a), (b), _CMP_LT_OQ)
+#define VLE(a, b) _mm256_cmp_ps((a), (b), _CMP_LE_OQ)
+#define VEQ(a, b) _mm256_cmp_ps((a), (b), _CMP_EQ_OQ)
+#define VSEL(m, a, b) _mm256_blendv_ps((b), (a), (m))
+#define VILOAD(p) _mm256_loadu_si256((const __m256i *)(p))
+#define VISTORE(p, v) _mm256_storeu_si256((__m256i *)(p), (v))
+#define VIXOR(a, b) _mm256_xor_si256((a), (b))
+#define VIAND(a, b) _mm256_and_si256((a), (b))
+#define VISET32(x) _mm256_set1_epi32(x)
+#define VISHR32(v, n) _mm256_srli_epi32((v), (n))
+#define VIEQ32(a, b) _mm256_cmpeq_epi32((a), (b))
+#include "kernels-simd.h"
+#undef KERNEL_ISA
+#undef KERNEL_TARGET
+#undef VWIDTH
+#undef VBYTES
+#undef VF
+#undef VM
+#undef VI
+#undef VLOAD
+#undef VSTORE
+#undef VSET
+#undef VADD
+#undef VSUB
+#undef VMUL
+#undef VDIV
+#undef VMIN
+#undef VMAX
+#undef VLT
+#undef VLE
+#undef VEQ
+#undef VSEL
+#undef VILOAD
+#undef VISTORE
+#undef VIXOR
+#undef VIAND
+#undef VISET32
+#undef VISHR32
+#undef VIEQ32
+#endif /* __x86_64__ */
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+
+#define KERNEL_ISA neon
+#define KERNEL_TARGET
+#define VWIDTH 4
+#define VBYTES 16
+#define VF float32x4_t
+#define VM uint32x4_t
+#define VI uint32x4_t
+#define VLOAD(p) vld1q_f32(p)
+#define VSTORE(p, v) vst1q_f32((p), (v))
+#define VSET(x) vdupq_n_f32(x)
+#define VADD(a, b) vaddq_f32((a), (b))
+#define VSUB(a, b) vsubq_f32((a), (b))
+#define VMUL(a, b) vmulq_f32((a), (b))
+#define VDIV(a, b) vdivq_f32((a), (b))
+#define VMIN(a, b) vminq_f32((a), (b))
+#define VMAX(a, b) vmaxq_f32((a), (b))
+#define VLT(a, b) vcltq_f32((a), (b))
+#define VLE(a, b) vcleq_f32((a), (b))
+#define VEQ(a, b) vceqq_f32((a), (b))
+#define VSEL(m, a, b) vbslq_f32((m), (a), (b))
+#define VILOAD(p) vreinterpretq_u32_u8(vld1q_u8((const uint8_t *)(p)))
+#define VISTORE(p, v) vst1q_u8((uint8_t *)(p), vreinterpretq_u8_u32(v))
+#define VIXOR(a, b) veorq_u32((a), (b))
+#define VIAND(a, b) vandq_u32((a), (b))
+#define VISET32(x) vdupq_n_u32(x)
+#define VISHR32(v, n) vshrq_n_u32((v), (n))
+#define VIEQ32(a, b) vceqq_u32((a), (b))
+#include "kernels-simd.h"
+#endif /* __aarch64__ && __ARM_NEON */
+
+static const struct kernelset kernelsets[] = {
+#if defined(__x86_64__)
+	{ "avx2", negate_avx2, negategrays8_avx2, hsl_modulate_avx2 },
+	{ "sse2", negate_sse2, negategrays8_sse2, hsl_modulate_sse2 },
+#endif
+#if defined(__aarch64__) && defined(__ARM_NEON)
+	{ "neon", negate_neon, negategrays8_neon, hsl_modulate_neon },
+#endif
+	{ "scalar", negate_scalar, negategrays8_scalar, hsl_modulate_scalar },
+};
+
+static const struct kernelset *kernels = NULL;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Returns the name of the instruction set the kernels are using.
+ */
+const char *
+avnkernel_isa(void)
+{
+	return kernelset()->isa;
+}
+
+
+void
+avnkernel_lut(avnpixels *px, const size_t y, const size_t rows,
+	const avnlut *lut)
+{
+	size_t i, n;
+	unsigned int c;
+	uint8_t *p8;
+	uint16_t *p16;
+
+	n = px->width * rows;
+
+	if (px->depth == 8) {
+		p8 = avnpixels_row(px, y);
+		for (i = 0; i < n; i++, p8 += px->channels) {
+			for (c = 0; c < 3; c++)
+				p8[c] = lut->table[c][p8[c]];
+		}
+	} else {
+		p16 = (uint16_t *)avnpixels_row(px, y);
+		for (i = 0; i < n; i++, p16 += px->channels) {
+			for (c = 0; c < 3; c++)
+				p16[c] = lut->table[c][p16[c]];
+		}
+	}
+}
+
+
+/*
+ * The arguments are MagickModulateImage()'s percentages. The pixels get
+ * converted to floats a block at a time, so that the HSL arithmetic, which
+ * is where the time goes, can run on whole vectors.
+ */
+void
+avnkernel_modulate(avnpixels *px, const size_t y, const size_t rows,
+	const double brightness, const double saturation, const double hue)
+{
+	float r[MODULATE_BLOCK], g[MODULATE_BLOCK], b[MODULATE_BLOCK];
+	struct hslmod m;
+	const struct kernelset *k = kernelset();
+	size_t i, j, n, len;
+	float max, inv, v;
+	uint8_t *p8 = NULL;
+	uint16_t *p16 = NULL;
+
+	m.lightness = brightness / 100.0;
+	m.saturation = saturation / 100.0;
+	m.hue = (hue - 100.0) / 200.0;
+
+	max = channel_max(px->depth);
+	inv = 1.0f / max;
+	n = px->width * rows;
+
+	if (px->depth == 8)
+		p8 = avnpixels_row(px, y);
+	else
+		p16 = (uint16_t *)avnpixels_row(px, y);
+
+	for (i = 0; i < n; i += len) {
+		len = (n - i < MODULATE_BLOCK) ? n - i : MODULATE_BLOCK;
+
+		for (j = 0; j < len; j++) {
+			if (p8 != NULL) {
+				r[j] = p8[(i+j) * px->channels] * inv;
+				g[j] = p8[(i+j) * px->channels + 1] * inv;
+				b[j] = p8[(i+j) * px->channels + 2] * inv;
+			} else {
+				r[j] = p16[(i+j) * px->channels] * inv;
+				g[j] = p16[(i+j) * px->channels + 1] * inv;
+				b[j] = p16[(i+j) * px->channels + 2] * inv;
+			}
+		}
+
+		k->hsl_modulate(r, g, b, len, &m);
+
+#define PACK(x) (v = (x), v = (v < 0.0f) ? 0.0f : ((v > 1.0f) ? 1.0f : v), \
+	(unsigned int)(v * max + 0.5f))
+
+		for (j = 0; j < len; j++) {
+			if (p8 != NULL) {
+				p8[(i+j) * px->channels] = PACK(r[j]);
+				p8[(i+j) * px->channels + 1] = PACK(g[j]);
+				p8[(i+j) * px->channels + 2] = PACK(b[j]);
+			} else {
+				p16[(i+j) * px->channels] = PACK(r[j]);
+				p16[(i+j) * px->channels + 1] = PACK(g[j]);
+				p16[(i+j) * px->channels + 2] = PACK(b[j]);
+			}
+		}
+
+#undef PACK
+	}
+}
+
+
+/*
+ * Negating a channel is the same as flipping all of its bits, so this is
+ * just an XOR against a pattern which leaves alpha alone.
+ */
+void
+avnkernel_negate(avnpixels *px, const size_t y, const size_t rows)
+{
+	unsigned char pattern[32];
+	unsigned int bytes, k;
+
+	bytes = px->depth / 8;
+
+	for (k = 0; k < sizeof(pattern); k++)
+		pattern[k] = ((k / bytes) % px->channels < 3) ? 0xff : 0x00;
+
+	kernelset()->negate(avnpixels_row(px, y), rows * px->stride, pattern);
+}
+
+
+/*
+ * Like avnkernel_negate(), but only for pixels which are a shade of gray.
+ */
+void
+avnkernel_negategrays(avnpixels *px, const size_t y, const size_t rows)
+{
+	size_t i, n;
+	uint8_t *p8;
+	uint16_t *p16;
+
+	n = px->width * rows;
+
+	/* Only the 8 bit RGBA layout is worth a vector version. */
+	if ((px->depth == 8) && (px->channels == 4)) {
+		kernelset()->negategrays8(avnpixels_row(px, y), n);
+		return;
+	}
+
+	if (px->depth == 8) {
+		p8 = avnpixels_row(px, y);
+		for (i = 0; i < n; i++, p8 += px->channels) {
+			if ((p8[0] == p8[1]) && (p8[1] == p8[2])) {
+				p8[0] ^= 0xff;
+				p8[1] ^= 0xff;
+				p8[2] ^= 0xff;
+			}
+		}
+		return;
+	}
+
+	p16 = (uint16_t *)avnpixels_row(px, y);
+	for (i = 0; i < n; i++, p16 += px->channels) {
+		if ((p16[0] == p16[1]) && (p16[1] == p16[2])) {
+			p16[0] ^= 0xffff;
+			p16[1] ^= 0xffff;
+			p16[2] ^= 0xffff;
+		}
+	}
+}
+
+
+/*
+ * Adds the red, green and blue values of a band of rows to counts, which
+ * is three histograms in a row, each with an entry for every value a
+ * channel can take at the pixels' depth.
+ */
+void
+avnkernel_histogram(const avnpixels *px, const size_t y, const size_t rows,
+	uint64_t *counts)
+{
+	const size_t size = (size_t)channel_max(px->depth) + 1;
+	size_t i, n;
+	const uint8_t *p8;
+	const uint16_t *p16;
+
+	n = px->width * rows;
+
+	if (px->depth == 8) {
+		p8 = avnpixels_row(px, y);
+		for (i = 0; i < n; i++, p8 += px->channels) {
+			counts[p8[0]]++;
+			counts[size + p8[1]]++;
+			counts[2 * size + p8[2]]++;
+		}
+	} else {
+		p16 = (const uint16_t *)avnpixels_row(px, y);
+		for (i = 0; i < n; i++, p16 += px->channels) {
+			counts[p16[0]]++;
+			counts[size + p16[1]]++;
+			counts[2 * size + p16[2]]++;
+		}
+	}
+}
+
+
+avnlut *
+avnlut_new(const unsigned int depth)
+{
+	avnlut *lut;
+	size_t i;
+	unsigned int c;
+
+	if ((lut = malloc(sizeof(avnlut))) == NULL)
+		return NULL;
+
+	lut->depth = depth;
+	lut->size = (size_t)channel_max(depth) + 1;
+
+	if ((lut->table[0] = malloc(3 * lut->size * sizeof(uint16_t))) == NULL) {
+		free(lut);
+		return NULL;
+	}
+
+	lut->table[1] = lut->table[0] + lut->size;
+	lut->table[2] = lut->table[1] + lut->size;
+
+	for (c = 0; c < 3; c++) {
+		for (i = 0; i < lut->size; i++)
+			lut->table[c][i] = i;
+	}
+
+	return lut;
+}
+
+
+void
+avnlut_free(avnlut *lut)
+{
+	if (lut == NULL)
+		return;
+
+	free(lut->table[0]);
+	free(lut);
+}
+
+
+/*
+ * Returns a copy of the table for pixels of a smaller depth. The curve is
+ * sampled from the wider table, so a table built up at 16 bits and then
+ * narrowed to 8 only rounds once, however many curves went into it.
+ */
+avnlut *
+avnlut_narrow(const avnlut *lut, const unsigned int depth)
+{
+	avnlut *narrow;
+	size_t i, step;
+	unsigned int c;
+	double scale;
+
+	if ((narrow = avnlut_new(depth)) == NULL)
+		return NULL;
+
+	step = (lut->size - 1) / (narrow->size - 1);
+	scale = (double)(narrow->size - 1) / (lut->size - 1);
+
+	for (c = 0; c < 3; c++) {
+		for (i = 0; i < narrow->size; i++) {
+			narrow->table[c][i] =
+				(uint16_t)(lut->table[c][i * step] * scale + 0.5);
+		}
+	}
+
+	return narrow;
+}
+
+/*
+ * The avnlut_*() functions below all map the table's current contents
+ * through another tone curve, so calling several of them in a row builds
+ * a table for the whole sequence.
+ */
+
+#define LUT_MAP(lut, expr) do { \
+	size_t i_; \
+	unsigned int c_; \
+	double max_ = (double)((lut)->size - 1), v; \
+	for (c_ = 0; c_ < 3; c_++) { \
+		for (i_ = 0; i_ < (lut)->size; i_++) { \
+			v = (lut)->table[c_][i_] / max_; \
+			v = (expr); \
+			v = (v < 0.0) ? 0.0 : ((v > 1.0) ? 1.0 : v); \
+			(lut)->table[c_][i_] = (uint16_t)(v * max_ + 0.5); \
+		} \
+	} \
+} while (0)
+
+/*
+ * Like GraphicsMagick, a gamma of zero leaves the image alone.
+ */
+void
+avnlut_gamma(avnlut *lut, const double gamma)
+{
+	if (gamma == 0.0)
+		return;
+
+	LUT_MAP(lut, pow(v, 1.0 / gamma));
+}
+
+
+/*
+ * The black and white points are percentages. Everything at or below the
+ * black point becomes black, everything at or above the white point becomes
+ * white, and what's in between is stretched out and gamma corrected.
+ */
+void
+avnlut_levels(avnlut *lut, const double black, const double white,
+	const double gamma)
+{
+	double lo = black / 100.0, hi = white / 100.0;
+
+	if (hi <= lo)
+		return;
+
+	LUT_MAP(lut, (v <= lo) ? 0.0 : ((v >= hi) ? 1.0 :
+		pow((v - lo) / (hi - lo), (gamma == 0.0) ? 1.0 : 1.0 / gamma)));
+}
+
+
+/*
+ * Blends every channel towards the given color, where rgb is in [0, 1] and
+ * an opacity of 1 means "all tint".
+ */
+void
+avnlut_tint(avnlut *lut, const double rgb[3], const double opacity)
+{
+	size_t i;
+	unsigned int c;
+	double max = (double)(lut->size - 1), v;
+
+	for (c = 0; c < 3; c++) {
+		for (i = 0; i < lut->size; i++) {
+			v = lut->table[c][i] / max;
+			v = v + (rgb[c] - v) * opacity;
+			v = (v < 0.0) ? 0.0 : ((v > 1.0) ? 1.0 : v);
+			lut->table[c][i] = (uint16_t)(v * max + 0.5);
+		}
+	}
+}
+
+
+void
+avnlut_negate(avnlut *lut)
+{
+	size_t i;
+	unsigned int c;
+
+	for (c = 0; c < 3; c++) {
+		for (i = 0; i < lut->size; i++)
+			lut->table[c][i] = (uint16_t)(lut->size - 1 - lut->table[c][i]);
+	}
+}
+
+
+/*
+ * Equalizing and normalizing depend on the image, so these take counts, a
+ * histogram of the pixels the table is going to be applied to, as
+ * avnkernel_histogram() makes it at the given depth. What the curves get
+ * worked out from is the histogram the pixels would have after the table,
+ * which is just the counts moved around, so the table never has to be
+ * applied to find out.
+ *
+ * Like GraphicsMagick, each channel gets its own curve.
+ */
+bool
+avnlut_equalize(avnlut *lut, const uint64_t *counts, const unsigned int depth)
+{
+	uint64_t *mapped, low, high;
+	size_t i;
+	unsigned int c;
+	double max = (double)(lut->size - 1);
+
+	if ((mapped = malloc(lut->size * sizeof(uint64_t))) == NULL)
+		return false;
+
+	for (c = 0; c < 3; c++) {
+		lut_histogram(lut, counts, depth, c, mapped);
+
+		/* The histogram becomes a running total. */
+		for (i = 1; i < lut->size; i++)
+			mapped[i] += mapped[i - 1];
+
+		low = mapped[0];
+		high = mapped[lut->size - 1];
+		if (high == low)
+			continue;
+
+		for (i = 0; i < lut->size; i++) {
+			lut->table[c][i] = (uint16_t)(max *
+				(mapped[lut->table[c][i]] - low) / (high - low) + 0.5);
+		}
+	}
+
+	free(mapped);
+	return true;
+}
+
+
+/*
+ * Stretches each channel out so that it spans the whole range, ignoring
+ * the darkest and lightest tenth of a percent of the pixels.
+ */
+bool
+avnlut_normalize(avnlut *lut, const uint64_t *counts, const unsigned int depth)
+{
+	uint64_t *mapped, total;
+	size_t i, low, high;
+	unsigned int c;
+	double max = (double)(lut->size - 1), v;
+
+	if ((mapped = malloc(lut->size * sizeof(uint64_t))) == NULL)
+		return false;
+
+	for (c = 0; c < 3; c++) {
+		lut_histogram(lut, counts, depth, c, mapped);
+
+		total = 0;
+		for (i = 0; i < lut->size; i++)
+			total += mapped[i];
+
+		histogram_bounds(mapped, lut->size, total / 1000, &low, &high);
+
+		/* If that's everything, go by the darkest and lightest values. */
+		if (low >= high)
+			histogram_bounds(mapped, lut->size, 0, &low, &high);
+
+		if (low >= high)
+			continue;
+
+		for (i = 0; i < lut->size; i++) {
+			v = ((double)lut->table[c][i] - low) / (high - low);
+			v = (v < 0.0) ? 0.0 : ((v > 1.0) ? 1.0 : v);
+			lut->table[c][i] = (uint16_t)(v * max + 0.5);
+		}
+	}
+
+	free(mapped);
+	return true;
+}
+
+#undef LUT_MAP
+
+/* */
+
+static void
+negate_scalar(unsigned char *p, const size_t n, const unsigned char *pattern)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		p[i] ^= pattern[i % 32];
+}
+
+
+static void
+negategrays8_scalar(unsigned char *p, const size_t npixels)
+{
+	size_t i;
+
+	for (i = 0; i < npixels; i++, p += 4) {
+		if ((p[0] == p[1]) && (p[1] == p[2])) {
+			p[0] ^= 0xff;
+			p[1] ^= 0xff;
+			p[2] ^= 0xff;
+		}
+	}
+}
+
+
+/*
+ * This has to stay in step with the vector versions in kernels-simd.h,
+ * operation for operation.
+ */
+static void
+hsl_modulate_scalar(float *r, float *g, float *b, const size_t n,
+	const struct hslmod *m)
+{
+	size_t i;
+	float mx, mn, sum, d, h, s, l, q, p;
+
+	for (i = 0; i < n; i++) {
+		mx = (r[i] > g[i]) ? r[i] : g[i];
+		mx = (mx > b[i]) ? mx : b[i];
+		mn = (r[i] < g[i]) ? r[i] : g[i];
+		mn = (mn < b[i]) ? mn : b[i];
+		sum = mx + mn;
+		l = sum * 0.5f;
+		d = mx - mn;
+
+		if (d == 0.0f) {
+			h = 0.0f;
+			s = 0.0f;
+		} else {
+			s = (l <= 0.5f) ? d / sum : d / (2.0f - sum);
+
+			if (r[i] == mx)
+				h = (g[i] - b[i]) / d;
+			else if (g[i] == mx)
+				h = 2.0f + (b[i] - r[i]) / d;
+			else
+				h = 4.0f + (r[i] - g[i]) / d;
+
+			h = h * (1.0f / 6.0f);
+			if (h < 0.0f)
+				h = h + 1.0f;
+		}
+
+		h = h + m->hue;
+		if (h < 0.0f)
+			h = h + 1.0f;
+		if (1.0f <= h)
+			h = h - 1.0f;
+		s = s * m->saturation;
+		s = (s < 1.0f) ? s : 1.0f;
+		l = l * m->lightness;
+		l = (l < 1.0f) ? l : 1.0f;
+
+		if (s == 0.0f) {
+			r[i] = g[i] = b[i] = l;
+			continue;
+		}
+
+		q = (l < 0.5f) ? l * (1.0f + s) : (l + s) - (l * s);
+		p = (l + l) - q;
+
+		r[i] = hue2rgb_scalar(p, q, h + (1.0f / 3.0f));
+		g[i] = hue2rgb_scalar(p, q, h);
+		b[i] = hue2rgb_scalar(p, q, h - (1.0f / 3.0f));
+	}
+}
+
+
+static float
+hue2rgb_scalar(const float p, const float q, float t)
+{
+	if (t < 0.0f)
+		t = t + 1.0f;
+	if (1.0f < t)
+		t = t - 1.0f;
+
+	if (t < (1.0f / 6.0f))
+		return p + ((q - p) * 6.0f) * t;
+	else if (t < 0.5f)
+		return q;
+	else if (t < (2.0f / 3.0f))
+		return p + ((q - p) * 6.0f) * ((2.0f / 3.0f) - t);
+	else
+		return p;
+}
+
+
+static void
+choose_kernels(void)
+{
+	const char *want;
+	size_t i, n;
+
+	n = sizeof(kernelsets) / sizeof(kernelsets[0]);
+	want = getenv("AVENIDA_KERNELS");
+
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+#endif
+
+	for (i = 0; i < n; i++) {
+		if ((want != NULL) && strcmp(want, kernelsets[i].isa))
+			continue;
+#if defined(__x86_64__)
+		if (!strcmp(kernelsets[i].isa, "avx2") &&
+			!__builtin_cpu_supports("avx2"))
+				continue;
+#endif
+		kernels = &kernelsets[i];
+		return;
+	}
+
+	/* Asked for something we can't do; the scalar kernels always work. */
+	kernels = &kernelsets[n - 1];
+}
+
+
+static const struct kernelset *
+kernelset(void)
+{
+	pthread_once(&kernels_once, choose_kernels);
+	return kernels;
+}
+
+
+static unsigned int
+channel_max(const unsigned int depth)
+{
+	return (depth == 16) ? 65535 : 255;
+}
+
+
+/*
+ * Fills in mapped with channel c's histogram as it would be after the
+ * table: counts is at the given depth, mapped has an entry for every value
+ * in the table.
+ */
+static void
+lut_histogram(const avnlut *lut, const uint64_t *counts,
+	const unsigned int depth, const unsigned int c, uint64_t *mapped)
+{
+	const size_t size = (size_t)channel_max(depth) + 1;
+	const size_t step = (lut->size - 1) / (size - 1);
+	size_t i;
+
+	memset(mapped, 0, lut->size * sizeof(uint64_t));
+
+	for (i = 0; i < size; i++)
+		mapped[lut->table[c][i * step]] += counts[c * size + i];
+}
+
+
+/*
+ * The first and last values with more than threshold pixels at or beyond
+ * them.
+ */
+static void
+histogram_bounds(const uint64_t *hist, const size_t size,
+	const uint64_t threshold, size_t *low, size_t *high)
+{
+	uint64_t sum;
+
+	sum = 0;
+	for (*low = 0; *low < size - 1; (*low)++) {
+		if ((sum += hist[*low]) > threshold)
+			break;
+	}
+
+	sum = 0;
+	for (*high = size - 1; *high > 0; (*high)--) {
+		if ((sum += hist[*high]) > threshold)
+			break;
+	}
+}
@@ -0,0 +1,52 @@
+/*
+ * vim: noet
+ *
+ * kernels.h
+ * Christian Koch <cfkoch@sdf.lonestar.org>
+ */
+
+#ifndef AVENIDA_KERNELS_H
+#define AVENIDA_KERNELS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pixels.h"
+
+/*
+ * A per-channel lookup table for the red, green and blue channels. There
+ * is one entry for every value a channel can take at the given depth.
+ */
+struct avnlut {
+	unsigned int depth;
+	size_t size;
+	uint16_t *table[3];
+};
+typedef struct avnlut avnlut;
+
+const char *avnkernel_isa(void);
+
+void avnkernel_lut(avnpixels *, const size_t y, const size_t rows,
+	const avnlut *);
+void avnkernel_modulate(avnpixels *, const size_t y, const size_t rows,
+	const double brightness, const double saturation, const double hue);
+void avnkernel_negate(avnpixels *, const size_t y, const size_t rows);
+void avnkernel_negategrays(avnpixels *, const size_t y, const size_t rows);
+void avnkernel_histogram(const avnpixels *, const size_t y, const size_t rows,
+	uint64_t *counts);
+
+avnlut *avnlut_new(const unsigned int depth);
+void avnlut_free(avnlut *);
+avnlut *avnlut_narrow(const avnlut *, const unsigned int depth);
+void avnlut_gamma(avnlut *, const double gamma);
+void avnlut_levels(avnlut *, const double black, const double white,
+	const double gamma);
+void avnlut_tint(avnlut *, const double rgb[3], const double opacity);
+void avnlut_negate(avnlut *);
+bool avnlut_equalize(avnlut *, const uint64_t *counts,
+	const unsigned int depth);
+bool avnlut_normalize(avnlut *, const uint64_t *counts,
+	const unsigned int depth);
+
+#endif /* AVENIDA_KERNELS_H */
@@ -6,6 +6,7 @@
  */
 
 #include <err.h>
+#include <getopt.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,8 +17,39 @@
 #include "lauxlib.h"
 
 #include "avenida.h"
+#include "batch.h"
+#include "bench.h"
+#include "bytecode.h"
 #include "linenoise.h"
+#include "plan.h"
+#include "raster.h"
 #include "script.h"
+#include "serve.h"
+#include "tiles.h"
+
+/* Long options which have no short version. */
+enum {
+	OPT_APPLY = CHAR_MAX + 1,
+	OPT_BENCH,
+	OPT_BENCH_RUNS,
+	OPT_BENCH_SIZES,
+	OPT_BYTECODE_CACHE,
+	OPT_PROFILE,
+	OPT_SERVE,
+};
+
+static const struct option longopts[] = {
+	{ "apply", required_argument, NULL, OPT_APPLY },
+	{ "bench", no_argument, NULL, OPT_BENCH },
+	{ "bench-runs", required_argument, NULL, OPT_BENCH_RUNS },
+	{ "bench-sizes", required_argument, NULL, OPT_BENCH_SIZES },
+	{ "bytecode-cache", optional_argument, NULL, OPT_BYTECODE_CACHE },
+	{ "help", no_argument, NULL, 'h' },
+	{ "profile", no_argument, NULL, OPT_PROFILE },
+	{ "serve", required_argument, NULL, OPT_SERVE },
+	{ "version", no_argument, NULL, 'v' },
+	{ NULL, 0, NULL, 0 },
+};
 
 static void usage(void);
 static void version(void);
@@ -31,16 +63,73 @@ int
 main(int argc, char *argv[])
 {
 	int ch;
+	long njobs = 0, nthreads = -1, runs;
+	unsigned int perjob;
+	char *end;
+	char *apply = NULL;
+	char *serve = NULL;
+	bool bench = false;
+	avnbench benchopts;
 	int rv = EXIT_SUCCESS;
 	char infile_path[PATH_MAX];
 	avnscript *avn = NULL;
 
-	while ((ch = getopt(argc, argv, "hv")) != -1) {
+	avnbench_init(&benchopts);
+
+	while ((ch = getopt_long(argc, argv, "hj:t:v", longopts, NULL)) != -1) {
 		switch (ch) {
+		case OPT_APPLY:
+			apply = optarg;
+			break;
+		case OPT_BENCH:
+			bench = true;
+			break;
+		case OPT_BENCH_RUNS:
+			runs = strtol(optarg, &end, 10);
+			if ((*end != '\0') || (runs < 1) || (runs > AVNBENCH_MAX_RUNS)) {
+				warnx("invalid run count \"%s\"", optarg);
+				return EXIT_FAILURE;
+			}
+			benchopts.runs = (unsigned int)runs;
+			break;
+		case OPT_BENCH_SIZES:
+			if (!avnbench_set_sizes(&benchopts, optarg)) {
+				warnx("invalid sizes \"%s\"", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case OPT_BYTECODE_CACHE:
+			if (!avnbytecode_enable(optarg)) {
+				warnx("couldn't use bytecode cache directory \"%s\"",
+					optarg != NULL ? optarg : "(default)");
+				return EXIT_FAILURE;
+			}
+			break;
+		case OPT_PROFILE:
+			avnraster_set_profiling(true);
+			break;
+		case OPT_SERVE:
+			serve = optarg;
+			break;
 		case 'h':
 			usage();
 			return EXIT_SUCCESS;
 			break;
+		case 'j':
+			njobs = strtol(optarg, &end, 10);
+			if ((*end != '\0') || (njobs < 1) || (njobs > AVNBATCH_MAX_JOBS)) {
+				warnx("invalid job count \"%s\"", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 't':
+			nthreads = strtol(optarg, &end, 10);
+			if ((*end != '\0') || (nthreads < 0)) {
+				warnx("invalid thread count \"%s\"", optarg);
+				return EXIT_FAILURE;
+			}
+			avntiles_set_nthreads((unsigned int)nthreads);
+			break;
 		case 'v':
 			version();
 			return EXIT_SUCCESS;
@@ -55,12 +144,62 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
+	if (bench) {
+		if ((argc > 0) || (njobs > 0)) {
+			usage();
+			return EXIT_FAILURE;
+		}
+		return avnbench_run(&benchopts) ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	if (apply != NULL) {
+		if ((argc != 2) || (njobs > 0) || (serve != NULL)) {
+			usage();
+			return EXIT_FAILURE;
+		}
+		return avnplan_run(apply, argv[0], argv[1]) ?
+			EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	if (serve != NULL) {
+		if (argc > 0) {
+			usage();
+			return EXIT_FAILURE;
+		}
+
+		/* One worker per CPU, each rendering on one thread. */
+		if (njobs == 0)
+			njobs = avntiles_nthreads();
+		if (nthreads < 0) {
+			perjob = avntiles_nthreads() / njobs;
+			avntiles_set_nthreads(perjob > 0 ? perjob : 1);
+		}
+
+		return avnserve_run(serve, njobs) ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
 	if (argc < 1) {
+		if (njobs > 0) {
+			usage();
+			return EXIT_FAILURE;
+		}
 		return repl();
 	}
 
 	snprintf(infile_path, PATH_MAX, "%s", argv[0]);
 
+	if (njobs > 0) {
+		/* Unless told otherwise, the workers split the CPUs between them. */
+		if (nthreads < 0) {
+			perjob = avntiles_nthreads() / njobs;
+			avntiles_set_nthreads(perjob > 0 ? perjob : 1);
+		}
+
+		if (!avnbatch_run(infile_path, argv + 1, argc - 1, njobs))
+			return EXIT_FAILURE;
+		return EXIT_SUCCESS;
+	}
+
 	if ((avn = avnscript_new(infile_path)) == NULL) {
 		warnx("couldn't create struct avnscript");
 		rv = EXIT_FAILURE;
@@ -68,8 +207,10 @@ main(int argc, char *argv[])
 	}
 
 	avnscript_setup(avn);
+	avnscript_setargs(avn, argc - 1, argv + 1);
 
 	if (!avnscript_execute(avn)) {
+		warnx("%s", avn->error);
 		rv = EXIT_FAILURE;
 		goto cleanup;
 	}
@@ -83,7 +224,14 @@ cleanup:
 static void
 usage(void)
 {
-	warnx("usage: %s [-h] [-v] [script]", getprogname());
+	warnx("usage: %s [-h] [-j njobs] [-t nthreads] [-v] [--profile] "
+		"[--bytecode-cache[=dir]] [script [arg ...]]", getprogname());
+	warnx("       %s --bench [--bench-runs n] [--bench-sizes mp,...] "
+		"[-t nthreads]", getprogname());
+	warnx("       %s --apply plan.json [-t nthreads] [--profile] in out",
+		getprogname());
+	warnx("       %s --serve socket [-j njobs] [-t nthreads] [--profile] "
+		"[--bytecode-cache[=dir]]", getprogname());
 }
 
 
@@ -0,0 +1,313 @@
+/*
+ * vim: noet
+ *
+ * oplist.c
+ * Christian Koch <cfkoch@sdf.lonestar.org>
+ *
+ * Every op used to be its own malloc, with another malloc for each of its
+ * arguments, and every media object carried a fixed array of pointers to
+ * them. Now an op is allocated with exactly as many arguments as it has,
+ * all in one piece, out of chunks which only ever grow, so a script that
+ * records tens of thousands of ops does a handful of mallocs rather than
+ * a hundred thousand.
+ *
+ * String arguments are copied into the chunks too, and each distinct
+ * string is only stored once; the caller's copy (often a Lua string that
+ * may be collected at any moment) never has to outlive the call.
+ */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "commands.h"
+#include "oplist.h"
+
+#define AVNOPLIST_FIRST_CHUNK 1024
+#define AVNOPLIST_MAX_CHUNK (64 * 1024)
+#define AVNOPLIST_ALIGN 8
+
+static void *arena_alloc(avnoplist *, size_t);
+static bool grow_index(avnoplist *);
+static bool grow_strings(avnoplist *);
+static uint32_t string_hash(const char *);
+
+void
+avnoplist_init(avnoplist *list)
+{
+	list->ops = NULL;
+	list->nops = 0;
+	list->capacity = 0;
+	list->chunks = NULL;
+	list->strings = NULL;
+	list->nstrings = 0;
+	list->strings_capacity = 0;
+}
+
+
+void
+avnoplist_free(avnoplist *list)
+{
+	struct avnchunk *chunk, *next;
+
+	for (chunk = list->chunks; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+
+	free(list->ops);
+	free(list->strings);
+	avnoplist_init(list);
+}
+
+
+/*
+ * Appends an op with the given arguments, which come in (type, value)
+ * pairs, e.g.
+ *
+ *     avnoplist_add(list, RASTER_ROLL, 2, AVN_INT, x, AVN_INT, y);
+ *
+ * The values must be of exactly the C type their tag says: unsigned int,
+ * int, double or char *. Returns the new op, or NULL if we ran out of
+ * memory, in which case the list is left as it was.
+ */
+struct avnop *
+avnoplist_add(avnoplist *list, const enum avncmdname name,
+	const unsigned int nargs, ...)
+{
+	struct avnop *op;
+	va_list ap;
+
+	va_start(ap, nargs);
+	op = avnoplist_vadd(list, name, nargs, ap);
+	va_end(ap);
+
+	return op;
+}
+
+
+struct avnop *
+avnoplist_vadd(avnoplist *list, const enum avncmdname name,
+	const unsigned int nargs, va_list ap)
+{
+	struct avnop *op;
+	struct avncmdarg *arg;
+	unsigned int i;
+
+	if (nargs > AVENIDA_CMD_MAX_ARGS)
+		return NULL;
+
+	if ((list->nops == list->capacity) && !grow_index(list))
+		return NULL;
+
+	op = arena_alloc(list, offsetof(struct avnop, args) +
+		(nargs * sizeof(struct avncmdarg)));
+	if (op == NULL)
+		return NULL;
+
+	op->name = name;
+	op->nargs = nargs;
+
+	for (i = 0; i < nargs; i++) {
+		arg = &op->args[i];
+		arg->type = (enum avncmdargtype)va_arg(ap, int);
+
+		switch (arg->type) {
+		case AVN_UINT:
+			arg->arg_uint = va_arg(ap, unsigned int);
+			break;
+		case AVN_INT:
+			arg->arg_int = va_arg(ap, int);
+			break;
+		case AVN_DOUBLE:
+			arg->arg_double = va_arg(ap, double);
+			break;
+		case AVN_STRING:
+			/* A failed intern just wastes the op's space in the arena. */
+			arg->arg_str = (char *)avnoplist_intern(list, va_arg(ap, char *));
+			if (arg->arg_str == NULL)
+				return NULL;
+			break;
+		default:
+			return NULL; /* NOTREACHED */
+		}
+	}
+
+	list->ops[list->nops] = op;
+	list->nops++;
+	return op;
+}
+
+
+/*
+ * Appends a copy of an op, which may well belong to some other list.
+ */
+struct avnop *
+avnoplist_push(avnoplist *list, const struct avnop *from)
+{
+	struct avnop *op;
+	size_t size;
+	unsigned int i;
+
+	if ((list->nops == list->capacity) && !grow_index(list))
+		return NULL;
+
+	size = offsetof(struct avnop, args) +
+		(from->nargs * sizeof(struct avncmdarg));
+
+	if ((op = arena_alloc(list, size)) == NULL)
+		return NULL;
+
+	memcpy(op, from, size);
+
+	for (i = 0; i < op->nargs; i++) {
+		if (op->args[i].type != AVN_STRING)
+			continue;
+		op->args[i].arg_str = (char *)avnoplist_intern(list,
+			from->args[i].arg_str);
+		if (op->args[i].arg_str == NULL)
+			return NULL;
+	}
+
+	list->ops[list->nops] = op;
+	list->nops++;
+	return op;
+}
+
+
+/*
+ * Returns the list's own copy of the given string, adding it if it isn't
+ * there yet. The strings are kept in an open addressed hash table, which
+ * is never more than half full.
+ */
+const char *
+avnoplist_intern(avnoplist *list, const char *str)
+{
+	uint32_t i, mask;
+	char *copy;
+	size_t len;
+
+	if (str == NULL)
+		return NULL;
+
+	if ((list->nstrings * 2 >= list->strings_capacity) && !grow_strings(list))
+		return NULL;
+
+	mask = list->strings_capacity - 1;
+
+	for (i = string_hash(str) & mask; list->strings[i] != NULL;
+		i = (i + 1) & mask) {
+		if (!strcmp(list->strings[i], str))
+			return list->strings[i];
+	}
+
+	len = strlen(str) + 1;
+	if ((copy = arena_alloc(list, len)) == NULL)
+		return NULL;
+
+	memcpy(copy, str, len);
+	list->strings[i] = copy;
+	list->nstrings++;
+	return copy;
+}
+
+/* */
+
+/*
+ * Hands out memory from the newest chunk, starting a new one, twice as
+ * big as the last up to a point, when that one's full.
+ */
+static void *
+arena_alloc(avnoplist *list, size_t size)
+{
+	struct avnchunk *chunk = list->chunks;
+	size_t chunksize;
+	void *p;
+
+	size = (size + AVNOPLIST_ALIGN - 1) & ~(size_t)(AVNOPLIST_ALIGN - 1);
+
+	if ((chunk == NULL) || (chunk->size - chunk->used < size)) {
+		chunksize = (chunk == NULL) ? AVNOPLIST_FIRST_CHUNK : chunk->size * 2;
+		if (chunksize > AVNOPLIST_MAX_CHUNK)
+			chunksize = AVNOPLIST_MAX_CHUNK;
+		if (chunksize < size)
+			chunksize = size;
+
+		if ((chunk = malloc(sizeof(struct avnchunk) + chunksize)) == NULL)
+			return NULL;
+
+		chunk->next = list->chunks;
+		chunk->size = chunksize;
+		chunk->used = 0;
+		list->chunks = chunk;
+	}
+
+	p = chunk->data + chunk->used;
+	chunk->used += size;
+	return p;
+}
+
+
+static bool
+grow_index(avnoplist *list)
+{
+	struct avnop **ops;
+	unsigned int capacity;
+
+	capacity = (list->capacity > 0) ? list->capacity * 2 : 16;
+
+	if ((ops = realloc(list->ops, capacity * sizeof(struct avnop *))) == NULL)
+		return false;
+
+	list->ops = ops;
+	list->capacity = capacity;
+	return true;
+}
+
+
+static bool
+grow_strings(avnoplist *list)
+{
+	const char **strings;
+	uint32_t i, j, capacity, mask;
+
+	capacity = (list->strings_capacity > 0) ? list->strings_capacity * 2 : 16;
+	mask = capacity - 1;
+
+	if ((strings = calloc(capacity, sizeof(char *))) == NULL)
+		return false;
+
+	for (i = 0; i < list->strings_capacity; i++) {
+		if (list->strings[i] == NULL)
+			continue;
+		for (j = string_hash(list->strings[i]) & mask; strings[j] != NULL;
+			j = (j + 1) & mask)
+				;
+		strings[j] = list->strings[i];
+	}
+
+	free(list->strings);
+	list->strings = strings;
+	list->strings_capacity = capacity;
+	return true;
+}
+
+
+/*
+ * FNV-1a.
+ */
+static uint32_t
+string_hash(const char *str)
+{
+	uint32_t h = 2166136261u;
+
+	for (; *str != '\0'; str++) {
+		h ^= (unsigned char)*str;
+		h *= 16777619u;
+	}
+
+	return h;
+}
@@ -0,0 +1,52 @@
+/*
+ * vim: noet
+ *
+ * oplist.h
+ * Christian Koch <cfkoch@sdf.lonestar.org>
+ */
+
+#ifndef AVENIDA_OPLIST_H
+#define AVENIDA_OPLIST_H
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "commands.h"
+
+/*
+ * A block of arena memory; see oplist.c.
+ */
+struct avnchunk {
+	struct avnchunk *next;
+	size_t size;
+	size_t used;
+	unsigned char data[];
+};
+
+/*
+ * The avnoplist structure is a growable list of ops. The ops themselves,
+ * their arguments and their strings all live in a few big chunks owned by
+ * the list, and are freed along with it in one go.
+ */
+struct avnoplist {
+	struct avnop **ops;
+	unsigned int nops;
+	unsigned int capacity;
+	struct avnchunk *chunks;
+	const char **strings;
+	unsigned int nstrings;
+	unsigned int strings_capacity;
+};
+typedef struct avnoplist avnoplist;
+
+void avnoplist_init(avnoplist *);
+void avnoplist_free(avnoplist *);
+struct avnop *avnoplist_add(avnoplist *, const enum avncmdname,
+	const unsigned int nargs, ...);
+struct avnop *avnoplist_vadd(avnoplist *, const enum avncmdname,
+	const unsigned int nargs, va_list);
+struct avnop *avnoplist_push(avnoplist *, const struct avnop *);
+const char *avnoplist_intern(avnoplist *, const char *);
+
+#endif /* AVENIDA_OPLIST_H */
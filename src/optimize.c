@@ -0,0 +1,374 @@
+/*
+ * vim: noet
+ *
+ * optimize.c
+ * Christian Koch <cfkoch@sdf.lonestar.org>
+ *
+ * The optimizer runs over a recorded op list right before it is rendered,
+ * and produces an equivalent "plan" with fewer full-image passes. The
+ * recorded history itself is never touched, so avnraster_history_json()
+ * still reports exactly what the script asked for.
+ *
+ * The plan is built like a stack: each op is either dropped (it's an
+ * identity), merged into the op on top of the stack, cancelled against it,
+ * or pushed.
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "commands.h"
+#include "oplist.h"
+#include "optimize.h"
+
+/*
+ * The three MagickModulateImage() arguments, in GraphicsMagick's
+ * percentages, where 100 means "leave it alone".
+ */
+struct modulation {
+	double brightness;
+	double saturation;
+	double hue;
+};
+
+static bool is_identity(const struct avnop *);
+static bool is_flip(const enum avncmdname);
+static bool as_modulation(const struct avnop *, struct modulation *);
+static bool fuse_factors(double *, const double);
+static bool fuse_modulations(struct modulation *, const struct modulation *);
+static bool fuse_scales(const double, const double);
+static bool is_power_of_two(const double);
+static struct avnop *modulate_op(avnoplist *, const struct modulation *);
+static bool combine(avnoplist *, const struct avnop *);
+static bool replace_top(avnoplist *, const struct avnop *);
+
+#define ARG(op, n) ((op)->args[n])
+
+/*
+ * Fills in the plan for the given ops. The plan has its own copies of
+ * everything, so it must be freed with avnoplist_free(). Returns false if
+ * we ran out of memory, in which case there's nothing to free.
+ */
+bool
+avnraster_optimize(struct avnop * const *ops, const unsigned int nops,
+	avnoplist *plan)
+{
+	unsigned int i;
+
+	avnoplist_init(plan);
+
+	for (i = 0; i < nops; i++) {
+		if (is_identity(ops[i]))
+			continue;
+
+		if (combine(plan, ops[i])) {
+			/* A merge can leave an identity behind, e.g. hue +50, hue -50. */
+			if ((plan->nops > 0) && is_identity(plan->ops[plan->nops-1]))
+				plan->nops--;
+			continue;
+		}
+
+		if (avnoplist_push(plan, ops[i]) == NULL) {
+			avnoplist_free(plan);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* */
+
+/*
+ * Ops which are known to leave the image untouched no matter what it looks
+ * like. Crop and resize aren't in here since whether they're a noop depends
+ * on the image's geometry at that point in the list.
+ */
+static bool
+is_identity(const struct avnop *op)
+{
+	struct modulation m;
+
+	switch (op->name) {
+	case RASTER_BRIGHTNESS: /* FALLTHROUGH */
+	case RASTER_HUE:
+	case RASTER_SATURATION:
+	case RASTER_MODULATE:
+		as_modulation(op, &m);
+		return (m.brightness == 100.0) && (m.saturation == 100.0) &&
+			(m.hue == 100.0);
+	case RASTER_BORDER:
+		return (ARG(op, 0).arg_uint == 0) && (ARG(op, 1).arg_uint == 0);
+	case RASTER_GAMMA:
+		/* A gamma of zero is treated as a noop all the way down. */
+		return (ARG(op, 0).arg_double == 1.0) ||
+			(ARG(op, 0).arg_double == 0.0);
+	case RASTER_LEVELS:
+		return (ARG(op, 0).arg_double == 0.0) &&
+			(ARG(op, 1).arg_double == 100.0) && (ARG(op, 2).arg_double == 1.0);
+	case RASTER_ROLL:
+		return (ARG(op, 0).arg_int == 0) && (ARG(op, 1).arg_int == 0);
+	case RASTER_ROTATE:
+		return fmod(ARG(op, 0).arg_double, 360.0) == 0.0;
+	case RASTER_SCALE:
+		return ARG(op, 0).arg_double == 1.0;
+	case RASTER_WAVE:
+		return ARG(op, 0).arg_double == 0.0;
+	case RASTER_CHARCOAL: /* FALLTHROUGH */
+	case RASTER_EMBOSS:
+	case RASTER_GAUSSIANBLUR:
+	case RASTER_MOTIONBLUR:
+	case RASTER_SHARPEN:
+	case RASTER_SWIRL:
+		/* These were already treated as noops by the renderer. */
+		return ARG(op, 0).arg_double == 0.0;
+	default:
+		return false;
+	}
+}
+
+
+static bool
+is_flip(const enum avncmdname name)
+{
+	return (name == RASTER_HORIZONTALFLIP) || (name == RASTER_VERTICALFLIP);
+}
+
+
+/*
+ * Brightness, saturation and hue are all just MagickModulateImage() with
+ * the other two arguments left alone.
+ */
+static bool
+as_modulation(const struct avnop *op, struct modulation *m)
+{
+	*m = (struct modulation){ 100.0, 100.0, 100.0 };
+
+	switch (op->name) {
+	case RASTER_BRIGHTNESS:
+		m->brightness = ARG(op, 0).arg_double + 100.0;
+		return true;
+	case RASTER_SATURATION:
+		m->saturation = ARG(op, 0).arg_double + 100.0;
+		return true;
+	case RASTER_HUE:
+		m->hue = ARG(op, 0).arg_double + 100.0;
+		return true;
+	case RASTER_MODULATE:
+		m->brightness = ARG(op, 0).arg_double;
+		m->saturation = ARG(op, 1).arg_double;
+		m->hue = ARG(op, 2).arg_double;
+		return true;
+	default:
+		return false;
+	}
+}
+
+
+/*
+ * Lightness and saturation get scaled and then clamped, so two scalings
+ * only multiply out when they go the same way; brightening past white and
+ * then darkening again is not the same as barely brightening at all.
+ */
+static bool
+fuse_factors(double *a, const double b)
+{
+	if (((*a >= 100.0) && (b >= 100.0)) || ((*a <= 100.0) && (b <= 100.0))) {
+		*a = (*a * b) / 100.0;
+		return true;
+	} else {
+		return false;
+	}
+}
+
+
+/*
+ * Hue is a rotation, so it always adds up. GraphicsMagick only wraps it
+ * once, hence keeping the sum within half a turn either way.
+ */
+static bool
+fuse_modulations(struct modulation *a, const struct modulation *b)
+{
+	struct modulation m = *a;
+	double shift;
+
+	if (!fuse_factors(&m.brightness, b->brightness))
+		return false;
+	if (!fuse_factors(&m.saturation, b->saturation))
+		return false;
+
+	shift = (a->hue - 100.0) + (b->hue - 100.0);
+	while (shift > 100.0)
+		shift -= 200.0;
+	while (shift <= -100.0)
+		shift += 200.0;
+	m.hue = shift + 100.0;
+
+	*a = m;
+	return true;
+}
+
+
+/*
+ * Each scale truncates the size it comes out with, so two of them only
+ * make one when they go the same way and the sizes can't come out any
+ * different, whatever the image. That holds when growing by a power of
+ * two first, which is exact, or when shrinking by one last, since taking
+ * the floor before halving is the same as taking it after.
+ */
+static bool
+fuse_scales(const double a, const double b)
+{
+	if ((a > 1.0) && (b > 1.0))
+		return is_power_of_two(a);
+	if ((a < 1.0) && (b < 1.0))
+		return is_power_of_two(b);
+	return false;
+}
+
+
+static bool
+is_power_of_two(const double x)
+{
+	int e;
+
+	return frexp(x, &e) == 0.5;
+}
+
+
+static struct avnop *
+modulate_op(avnoplist *plan, const struct modulation *m)
+{
+	return avnoplist_add(plan, RASTER_MODULATE, 3, AVN_DOUBLE, m->brightness,
+		AVN_DOUBLE, m->saturation, AVN_DOUBLE, m->hue);
+}
+
+
+/*
+ * Tries to fold the given op into the top of the plan. Returns true if the
+ * op was consumed, false if it still needs to be pushed. Ops which are
+ * dropped from the plan stay in its arena until the plan is freed.
+ */
+static bool
+combine(avnoplist *plan, const struct avnop *op)
+{
+	struct avnop *top, *fused;
+	struct modulation m1, m2;
+	unsigned int n = plan->nops;
+
+	if (n == 0)
+		return false;
+
+	top = plan->ops[n-1];
+
+	switch (op->name) {
+	case RASTER_BRIGHTNESS: /* FALLTHROUGH */
+	case RASTER_HUE:
+	case RASTER_SATURATION:
+	case RASTER_MODULATE:
+		if (!as_modulation(top, &m1))
+			return false;
+		as_modulation(op, &m2);
+		if (!fuse_modulations(&m1, &m2))
+			return false;
+		return replace_top(plan, modulate_op(plan, &m1));
+
+	case RASTER_GAMMA:
+		if (top->name == RASTER_GAMMA) {
+			ARG(top, 0).arg_double *= ARG(op, 0).arg_double;
+			return true;
+		} else if (top->name == RASTER_LEVELS) {
+			ARG(top, 2).arg_double *= ARG(op, 0).arg_double;
+			return true;
+		}
+		return false;
+
+	case RASTER_LEVELS:
+		/* Gamma followed by levels only folds if levels doesn't stretch. */
+		if ((top->name == RASTER_GAMMA) && (ARG(op, 0).arg_double == 0.0) &&
+			(ARG(op, 1).arg_double == 100.0)) {
+			if ((fused = avnoplist_push(plan, op)) == NULL)
+				return false;
+			ARG(fused, 2).arg_double *= ARG(top, 0).arg_double;
+			return replace_top(plan, fused);
+		}
+		return false;
+
+	case RASTER_NEGATE: /* FALLTHROUGH */
+	case RASTER_NEGATEGRAYS:
+		if (top->name == op->name) {
+			plan->nops--;
+			return true;
+		}
+		return false;
+
+	case RASTER_HORIZONTALFLIP: /* FALLTHROUGH */
+	case RASTER_VERTICALFLIP:
+		if (top->name == op->name) {
+			plan->nops--;
+			return true;
+		}
+
+		/* Flips and flops commute, so look one past the other kind. */
+		if (is_flip(top->name) && (n >= 2) &&
+			(plan->ops[n-2]->name == op->name)) {
+				plan->ops[n-2] = top;
+				plan->nops--;
+				return true;
+		}
+		return false;
+
+	case RASTER_ROLL:
+		if (top->name == RASTER_ROLL) {
+			ARG(top, 0).arg_int += ARG(op, 0).arg_int;
+			ARG(top, 1).arg_int += ARG(op, 1).arg_int;
+			return true;
+		}
+		return false;
+
+	case RASTER_RESIZE:
+		/*
+		 * A second resize only makes the first moot if it doesn't go back
+		 * above it, and uses the same filter; blowing up what was shrunk
+		 * isn't the same as never shrinking it.
+		 */
+		if ((top->name == RASTER_RESIZE) &&
+			(ARG(op, 0).arg_uint <= ARG(top, 0).arg_uint) &&
+			(ARG(op, 1).arg_uint <= ARG(top, 1).arg_uint) &&
+			!strcmp(ARG(top, 2).arg_str, ARG(op, 2).arg_str))
+				return replace_top(plan, avnoplist_push(plan, op));
+		return false;
+
+	case RASTER_SCALE:
+		if ((top->name == RASTER_SCALE) &&
+			!strcmp(ARG(top, 1).arg_str, ARG(op, 1).arg_str) &&
+			fuse_scales(ARG(top, 0).arg_double, ARG(op, 0).arg_double)) {
+				ARG(top, 0).arg_double *= ARG(op, 0).arg_double;
+				return true;
+		}
+		return false;
+
+	default:
+		return false;
+	}
+}
+
+
+/*
+ * Replaces the top of the plan with the op that was just pushed on top of
+ * it. If the replacement couldn't be allocated, we just don't merge.
+ */
+static bool
+replace_top(avnoplist *plan, const struct avnop *op)
+{
+	if (op == NULL)
+		return false;
+
+	plan->ops[plan->nops-2] = (struct avnop *)op;
+	plan->nops--;
+	return true;
+}
+
+#undef ARG
@@ -0,0 +1,19 @@
+/*
+ * vim: noet
+ *
+ * optimize.h
+ * Christian Koch <cfkoch@sdf.lonestar.org>
+ */
+
+#ifndef AVENIDA_OPTIMIZE_H
+#define AVENIDA_OPTIMIZE_H
+
+#include <stdbool.h>
+
+#include "commands.h"
+#include "oplist.h"
+
+bool avnraster_optimize(struct avnop * const *ops, const unsigned int nops,
+	avnoplist *plan);
+
+#endif /* AVENIDA_OPTIMIZE_H */
@@ -0,0 +1,173 @@
+/*
+ * vim: noet
+ *
+ * pixelcache.c
+ * Christian Koch <cfkoch@sdf.lonestar.org>
+ *
+ * The pixel cache keeps big images out of the heap by backing them with
+ * files in a scratch directory, mapped into memory, so the kernel can page
+ * them in and out as it sees fit instead of the process getting killed.
+ *
+ * There are two sides to it. GraphicsMagick has a pixel cache of its own,
+ * which goes to mapped files on its own once the memory resource limit is
+ * reached, so we just set that limit and point its temporary files at the
+ * scratch directory. The limit covers all of GraphicsMagick's images at
+ * once, not each one, so it's more of a high-water mark than a size
+ * threshold. The buffers the native kernels work on (see pixels.c) are
+ * ours, and anything at or above the threshold gets mapped here.
+ *
+ * The scratch files are unlinked as soon as they're mapped, so they
+ * disappear however the process goes away.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <wand/magick_wand.h>
+
+#include "pixelcache.h"
+
+static struct avnpixelcachestats pixelcache = {
+	.enabled = false,
+	.threshold = AVNPIXELCACHE_DEFAULT_THRESHOLD,
+};
+
+/* GraphicsMagick's own memory limit, from before we changed it. */
+static unsigned long saved_limit = 0;
+
+/* Variants get resized on the tile threads, which allocate too. */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Turns the pixel cache on, in the given directory (or $TMPDIR, or /tmp),
+ * mapping anything of at least threshold bytes (or the default, if zero).
+ */
+bool
+avnpixelcache_enable(const char *dir, const size_t threshold)
+{
+	struct stat sb;
+
+	if (dir == NULL) {
+		if (((dir = getenv("TMPDIR")) == NULL) || (*dir == '\0'))
+			dir = "/tmp";
+	}
+
+	if ((mkdir(dir, 0700) == -1) && (errno != EEXIST))
+		return false;
+	if ((stat(dir, &sb) == -1) || !S_ISDIR(sb.st_mode))
+		return false;
+
+	if (!pixelcache.enabled)
+		saved_limit = MagickGetResourceLimit(MemoryResource);
+
+	snprintf(pixelcache.dir, PATH_MAX, "%s", dir);
+	pixelcache.threshold = (threshold > 0) ? threshold :
+		AVNPIXELCACHE_DEFAULT_THRESHOLD;
+	pixelcache.enabled = true;
+
+	setenv("MAGICK_TMPDIR", pixelcache.dir, 1);
+	MagickSetResourceLimit(MemoryResource, pixelcache.threshold);
+	return true;
+}
+
+
+void
+avnpixelcache_disable(void)
+{
+	if (!pixelcache.enabled)
+		return;
+
+	MagickSetResourceLimit(MemoryResource, saved_limit);
+	pixelcache.enabled = false;
+}
+
+
+bool
+avnpixelcache_enabled(void)
+{
+	return pixelcache.enabled;
+}
+
+
+void
+avnpixelcache_stats(struct avnpixelcachestats *stats)
+{
+	*stats = pixelcache;
+}
+
+
+/*
+ * Allocates a pixel buffer, mapped from a scratch file if it's big enough
+ * and the pixel cache is on, or from the heap otherwise. Free it with
+ * avnpixelcache_free(), passing along the same size and "mapped".
+ *
+ * If the mapping can't be made, say because the disk is full, this falls
+ * back to the heap, which is no worse than before.
+ */
+void *
+avnpixelcache_alloc(const size_t size, bool *mapped)
+{
+	char path[PATH_MAX];
+	void *p;
+	int fd;
+
+	*mapped = false;
+
+	if (!pixelcache.enabled || (size < pixelcache.threshold))
+		return malloc(size);
+
+	snprintf(path, PATH_MAX, "%s/avenida-pixels.XXXXXX", pixelcache.dir);
+
+	if ((fd = mkstemp(path)) == -1)
+		return malloc(size);
+
+	unlink(path);
+
+	if (ftruncate(fd, (off_t)size) == -1) {
+		close(fd);
+		return malloc(size);
+	}
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (p == MAP_FAILED)
+		return malloc(size);
+
+	*mapped = true;
+	pthread_mutex_lock(&lock);
+	pixelcache.mapped += size;
+	if (pixelcache.mapped > pixelcache.peak)
+		pixelcache.peak = pixelcache.mapped;
+	pthread_mutex_unlock(&lock);
+
+	return p;
+}
+
+
+void
+avnpixelcache_free(void *p, const size_t size, const bool mapped)
+{
+	if (p == NULL)
+		return;
+
+	if (!mapped) {
+		free(p);
+		return;
+	}
+
+	munmap(p, size);
+	pthread_mutex_lock(&lock);
+	pixelcache.mapped -= size;
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,32 @@
+/*
+ * vim: noet
+ *
+ * pixelcache.h
+ * Christian Koch <cfkoch@sdf.lonestar.org>
+ */
+
+#ifndef AVENIDA_PIXELCACHE_H
+#define AVENIDA_PIXELCACHE_H
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define AVNPIXELCACHE_DEFAULT_THRESHOLD ((size_t)256 * 1024 * 1024)
+
+struct avnpixelcachestats {
+	bool enabled;
+	char dir[PATH_MAX];
+	size_t threshold;
+	size_t mapped;
+	size_t peak;
+};
+
+bool avnpixelcache_enable(const char *dir, const size_t threshold);
+void avnpixelcache_disable(void);
+bool avnpixelcache_enabled(void);
+void avnpixelcache_stats(struct avnpixelcachestats *);
+void *avnpixelcache_alloc(const size_t size, bool *mapped);
+void avnpixelcache_free(void *, const size_t size, const bool mapped);
+
+#endif /* AVENIDA_PIXELCACHE_H */
@@ -0,0 +1,86 @@
+/*
+ * vim: noet
+ *
+ * pixels.c
+ * Christian Koch <cfkoch@sdf.lonestar.org>
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <wand/magick_wand.h>
+
+#include "pixelcache.h"
+#include "pixels.h"
+
+/*
+ * Copies the wand's pixels out into a newly allocated buffer, with the
+ * given number of bits per channel (8 or 16) and channels (3 or 4).
+ * GraphicsMagick does the scaling; an image that only ever had 8 bits in
+ * it loses nothing going down to 8 from a 16 bit quantum.
+ *
+ * With 4 channels, alpha is always there, even if the image has none;
+ * avnpixels_import() puts the matte flag back the way it was. With 3,
+ * alpha is left out of it altogether.
+ */
+bool
+avnpixels_export(avnpixels *px, MagickWand *wand, const unsigned int depth,
+	const unsigned int channels)
+{
+	StorageType storage;
+
+	px->width = (size_t)MagickGetImageWidth(wand);
+	px->height = (size_t)MagickGetImageHeight(wand);
+	px->channels = (channels == 3) ? 3 : 4;
+	px->depth = ((depth > 8) && (QuantumDepth > 8)) ? 16 : 8;
+	px->stride = px->width * px->channels * (px->depth / 8);
+	px->matte = MagickGetImageMatte(wand) ? true : false;
+	storage = (px->depth == 16) ? ShortPixel : CharPixel;
+
+	px->data = avnpixelcache_alloc(px->stride * px->height, &px->mapped);
+	if (px->data == NULL)
+		return false;
+
+	if (MagickGetImagePixels(wand, 0, 0, px->width, px->height,
+		(px->channels == 4) ? "RGBA" : "RGB", storage,
+		px->data) != MagickPass) {
+			avnpixels_free(px);
+			return false;
+	}
+
+	return true;
+}
+
+
+bool
+avnpixels_import(const avnpixels *px, MagickWand *wand)
+{
+	StorageType storage;
+
+	storage = (px->depth == 16) ? ShortPixel : CharPixel;
+
+	if (MagickSetImagePixels(wand, 0, 0, px->width, px->height,
+		(px->channels == 4) ? "RGBA" : "RGB", storage,
+		px->data) != MagickPass)
+			return false;
+
+	if (px->channels == 3)
+		return true;
+
+	return MagickSetImageMatte(wand, px->matte) == MagickPass ? true : false;
+}
+
+
+void
+avnpixels_free(avnpixels *px)
+{
+	avnpixelcache_free(px->data, px->stride * px->height, px->mapped);
+	px->data = NULL;
+}
+
+
+unsigned char *
+avnpixels_row(const avnpixels *px, const size_t y)
+{
+	return px->data + (y * px->stride);
+}
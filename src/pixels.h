@@ -0,0 +1,40 @@
+/*
+ * vim: noet
+ *
+ * pixels.h
+ * Christian Koch <cfkoch@sdf.lonestar.org>
+ */
+
+#ifndef AVENIDA_PIXELS_H
+#define AVENIDA_PIXELS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <wand/magick_wand.h>
+
+/*
+ * The avnpixels structure is a packed copy of an image's pixels, for the
+ * native kernels to work on. Channels are interleaved in RGB or RGBA order,
+ * with 8 or 16 bits per channel. Big copies may be "mapped" from the pixel
+ * cache instead of living on the heap.
+ */
+struct avnpixels {
+	size_t width;
+	size_t height;
+	unsigned int channels;
+	unsigned int depth;
+	size_t stride;
+	bool matte;
+	bool mapped;
+	unsigned char *data;
+};
+typedef struct avnpixels avnpixels;
+
+bool avnpixels_export(avnpixels *, MagickWand *, const unsigned int depth,
+	const unsigned int channels);
+bool avnpixels_import(const avnpixels *, MagickWand *);
+void avnpixels_free(avnpixels *);
+unsigned char *avnpixels_row(const avnpixels *, const size_t y);
+
+#endif /* AVENIDA_PIXELS_H */
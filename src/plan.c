@@ -0,0 +1,292 @@
+/*
+ * vim: noet
+ *
+ * plan.c
+ * Christian Koch <cfkoch@sdf.lonestar.org>
+ *
+ * A plan is an op list that's been checked once, up front, so that it can
+ * be put on any number of rasters without going through Lua, or the
+ * checks, for each op again. The ops are kept just as they were given;
+ * like any other history, they're only optimized when rendered. Plans are
+ * read and written as the same JSON array avnraster_history_json()
+ * produces, so whatever was done to one raster can be saved and done to
+ * others later.
+ */
+
+#include <err.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cJSON.h"
+#include "commands.h"
+#include "oplist.h"
+#include "plan.h"
+#include "raster.h"
+#include "resample.h"
+#include "stream.h"
+
+#define ARG(op, n) ((op)->args[n])
+
+static char *read_file(const char *);
+static bool valid_op(const struct avnop *);
+
+/*
+ * Fills in the plan from a JSON array of ops. The plan must be freed with
+ * avnoplist_free(), unless this returns false, in which case there's
+ * nothing to free, and bad is the index of the first op that isn't valid,
+ * or -1 if the trouble wasn't with any one op.
+ */
+bool
+avnplan_from_json(avnoplist *plan, const cJSON *json, int *bad)
+{
+	struct avnop *op;
+	int i, n;
+
+	*bad = -1;
+
+	if ((json == NULL) || (json->type != cJSON_Array))
+		return false;
+
+	avnoplist_init(plan);
+	n = cJSON_GetArraySize((cJSON*)json);
+
+	for (i = 0; i < n; i++) {
+		op = avnop_from_json(plan, cJSON_GetArrayItem((cJSON*)json, i));
+		if ((op == NULL) || !valid_op(op)) {
+			*bad = i;
+			avnoplist_free(plan);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * Same as avnplan_from_json(), from a string.
+ */
+bool
+avnplan_parse(avnoplist *plan, const char *json, int *bad)
+{
+	cJSON *ary;
+	bool ok;
+
+	*bad = -1;
+
+	if ((ary = cJSON_Parse(json)) == NULL)
+		return false;
+
+	ok = avnplan_from_json(plan, ary, bad);
+	cJSON_Delete(ary);
+
+	return ok;
+}
+
+
+/*
+ * Same as avnplan_from_json(), from the file at the given path.
+ */
+bool
+avnplan_load(avnoplist *plan, const char *path, int *bad)
+{
+	char *json;
+	bool ok;
+
+	*bad = -1;
+
+	if ((json = read_file(path)) == NULL)
+		return false;
+
+	ok = avnplan_parse(plan, json, bad);
+	free(json);
+
+	return ok;
+}
+
+
+/*
+ * The returned string is dynamically allocated and needs to be freed.
+ */
+char *
+avnplan_to_json(const avnoplist *plan)
+{
+	unsigned int i;
+	cJSON *ary;
+	char *str;
+
+	ary = cJSON_CreateArray();
+
+	for (i = 0; i < plan->nops; i++)
+		cJSON_AddItemToArray(ary, avnop_to_json(plan->ops[i]));
+
+	str = cJSON_PrintUnformatted(ary);
+	cJSON_Delete(ary);
+
+	return str;
+}
+
+
+/*
+ * Records every op in the plan on the raster, as if they had been done to
+ * it one by one. If we run out of memory partway, none of them are.
+ */
+bool
+avnraster_add_plan(avnraster *avn, const avnoplist *plan)
+{
+	const unsigned int nops = avn->history.nops;
+	unsigned int i;
+
+	for (i = 0; i < plan->nops; i++) {
+		if (avnoplist_push(&avn->history, plan->ops[i]) == NULL) {
+			avn->history.nops = nops;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * The --apply mode: does the plan in the given file to one image, and
+ * writes the result, without starting Lua at all. Either image path can
+ * be "-". Where every op can be streamed into the output, it is.
+ */
+bool
+avnplan_run(const char *path, const char *in, const char *out)
+{
+	avnoplist plan;
+	avnraster *avn;
+	int bad;
+	bool ok;
+
+	if (!avnplan_load(&plan, path, &bad)) {
+		if (bad >= 0)
+			warnx("%s: op %d isn't valid", path, bad + 1);
+		else
+			warnx("%s: not a plan", path);
+		return false;
+	}
+
+	if (((avn = avnraster_new(in)) == NULL) || !avnraster_open(avn)) {
+		warnx("couldn't open raster \"%s\"", in);
+		avnraster_free(avn);
+		avnoplist_free(&plan);
+		return false;
+	}
+
+	ok = avnraster_add_plan(avn, &plan);
+	avnoplist_free(&plan);
+
+	if (ok && !(avnraster_streamable(avn) && avnraster_stream(avn, out)))
+		ok = avnraster_render(avn, false) && avnraster_write(avn, out, NULL);
+
+	if (!ok)
+		warnx("couldn't write \"%s\"", out);
+
+	avnraster_free(avn);
+	return ok;
+}
+
+/* */
+
+/*
+ * Returns the whole file as a string, which needs to be freed.
+ */
+static char *
+read_file(const char *path)
+{
+	FILE *fp;
+	char *buf, *p;
+	size_t cap, len, n;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		return NULL;
+
+	cap = BUFSIZ;
+	len = 0;
+
+	if ((buf = malloc(cap)) == NULL) {
+		fclose(fp);
+		return NULL;
+	}
+
+	/* Always leaves room for the terminator. */
+	while ((n = fread(buf + len, 1, cap - len - 1, fp)) > 0) {
+		len += n;
+		if (len < cap - 1)
+			continue;
+		if ((p = realloc(buf, cap * 2)) == NULL) {
+			free(buf);
+			fclose(fp);
+			return NULL;
+		}
+		buf = p;
+		cap *= 2;
+	}
+
+	if (ferror(fp)) {
+		free(buf);
+		fclose(fp);
+		return NULL;
+	}
+
+	fclose(fp);
+	buf[len] = '\0';
+	return buf;
+}
+
+
+/*
+ * Whether the op's arguments are in range. These are the limits the Lua
+ * bindings put on each op, so that a plan can't do anything a script
+ * couldn't, plus a few the bindings leave to GraphicsMagick: a resize to
+ * nothing, a gamma of zero, and the percentages the optimizer gives
+ * modulate, where the hue is kept within a turn.
+ */
+static bool
+valid_op(const struct avnop *op)
+{
+	enum avnfilter filter;
+
+	switch (op->name) {
+	case RASTER_BRIGHTNESS: /* FALLTHROUGH */
+	case RASTER_HUE:
+	case RASTER_SATURATION:
+		return (ARG(op, 0).arg_double >= -100.0) &&
+			(ARG(op, 0).arg_double <= 100.0);
+	case RASTER_CHARCOAL: /* FALLTHROUGH */
+	case RASTER_EMBOSS:
+	case RASTER_GAUSSIANBLUR:
+	case RASTER_MOTIONBLUR:
+	case RASTER_OILPAINT:
+		return ARG(op, 0).arg_double >= 0.0;
+	case RASTER_GAMMA:
+		return ARG(op, 0).arg_double > 0.0;
+	case RASTER_LEVELS:
+		return (ARG(op, 0).arg_double >= 0.0) &&
+			(ARG(op, 1).arg_double > ARG(op, 0).arg_double) &&
+			(ARG(op, 1).arg_double <= 100.0) &&
+			(ARG(op, 2).arg_double > 0.0);
+	case RASTER_MODULATE:
+		return (ARG(op, 0).arg_double >= 0.0) &&
+			(ARG(op, 1).arg_double >= 0.0) &&
+			(ARG(op, 2).arg_double >= 0.0) &&
+			(ARG(op, 2).arg_double <= 200.0);
+	case RASTER_RESIZE:
+		return (ARG(op, 0).arg_uint > 0) && (ARG(op, 1).arg_uint > 0) &&
+			avnresample_filter(ARG(op, 2).arg_str, &filter);
+	case RASTER_SCALE:
+		return (ARG(op, 0).arg_double > 0.0) &&
+			avnresample_filter(ARG(op, 1).arg_str, &filter);
+	case RASTER_TINT:
+		return (ARG(op, 1).arg_double >= 0.0) &&
+			(ARG(op, 1).arg_double <= 1.0);
+	case RASTER_WAVE:
+		return (ARG(op, 0).arg_double >= 0.0) &&
+			(ARG(op, 1).arg_double >= 0.0);
+	default:
+		return true;
+	}
+}
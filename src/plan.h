@@ -0,0 +1,24 @@
+/*
+ * vim: noet
+ *
+ * plan.h
+ * Christian Koch <cfkoch@sdf.lonestar.org>
+ */
+
+#ifndef AVENIDA_PLAN_H
+#define AVENIDA_PLAN_H
+
+#include <stdbool.h>
+
+#include "cJSON.h"
+#include "oplist.h"
+#include "raster.h"
+
+bool avnplan_from_json(avnoplist *, const cJSON *, int *bad);
+bool avnplan_parse(avnoplist *, const char *json, int *bad);
+bool avnplan_load(avnoplist *, const char *path, int *bad);
+char *avnplan_to_json(const avnoplist *);
+bool avnraster_add_plan(avnraster *, const avnoplist *);
+bool avnplan_run(const char *path, const char *in, const char *out);
+
+#endif /* AVENIDA_PLAN_H */
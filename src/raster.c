@@ -5,19 +5,141 @@
  * Christian Koch <cfkoch@sdf.lonestar.org>
  */
 
+#include <ctype.h>
 #include <limits.h>
+#include <math.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include <wand/magick_wand.h>
 
 #include "cJSON.h"
 
+#include "blur.h"
+#include "cache.h"
 #include "commands.h"
+#include "kernels.h"
+#include "oplist.h"
+#include "optimize.h"
+#include "pixels.h"
+#include "plan.h"
 #include "raster.h"
+#include "resample.h"
+#include "tiles.h"
+#include "util.h"
+
+/*
+ * Below this many pixels, splitting an op across threads costs more than
+ * it saves.
+ */
+#define AVNRASTER_MIN_BANDED_PIXELS (512 * 512)
+
+/*
+ * How many bytes of pixels each thread works on at a time when running
+ * native kernels.
+ */
+#define AVNRASTER_NATIVE_CHUNK (256 * 1024)
+#define AVNRASTER_MAX_NATIVE_RUN 64
+
+static size_t snapshot_budget = AVNRASTER_SNAPSHOT_BUDGET;
+static bool profiling = false;
+
+struct nativeop {
+	const struct avnop *op;
+	avnlut *lut;
+	double modulation[3];
+};
+
+/*
+ * The tone ops that come one after another in a run are composed into a
+ * single curve before anything is done to the pixels; tone is that curve
+ * so far, always at full depth, and tone_op the first op that went into
+ * it.
+ */
+struct nativejob {
+	avnpixels *px;
+	struct nativeop *ops;
+	unsigned int nops;
+	size_t chunk;
+	avnlut *tone;
+	const struct avnop *tone_op;
+	unsigned int ntone;
+};
+
+struct histogramjob {
+	const avnpixels *px;
+	uint64_t *counts;
+	size_t size;
+	unsigned int ntasks;
+};
+
+/* Where a step of a render started, for avnraster's profile. */
+struct stopwatch {
+	double wall_ms;
+	double cpu_ms;
+	long peak_rss_kb;
+	size_t pixels;
+};
+
+struct bandjob {
+	avnraster *avn;
+	const struct avnop *op;
+	struct avnband *bands;
+	MagickWand **wands;
+};
 
 static PixelWand *pixel_wand_with_color(const char *color);
+static unsigned char *read_stdin(size_t *);
+static bool avnraster_decode_scaled(avnraster *, const size_t,
+	const size_t);
+static bool avnraster_render_to(avnraster *, const unsigned int,
+	const bool);
+static void set_image(avnraster *, MagickWand *, const bool);
+static void read_format(avnraster *);
+static void print_op(const struct avnop *);
+static void print_profile(const avnraster *);
+static void stopwatch_start(const avnraster *, struct stopwatch *);
+static void stopwatch_stop(avnraster *, const struct stopwatch *,
+	struct avnop * const *, const unsigned int);
+static void prefix_digests(const avnraster *, const unsigned int,
+	unsigned char [][AVNHASH_LEN]);
+static struct avnsnapshot *snapshot_find(avnraster *, const unsigned int,
+	unsigned char [][AVNHASH_LEN]);
+static void snapshot_save(avnraster *, const unsigned int,
+	const unsigned char [AVNHASH_LEN]);
+static bool write_stdout(avnraster *, const avnwriteopts *);
+static void output_format(const avnraster *, const char *, char *,
+	const size_t);
+static bool set_write_options(MagickWand *, const char *,
+	const avnwriteopts *);
+static bool cache_key(const avnraster *, const char *, const avnwriteopts *,
+	char *);
+static bool decode_hint(const avnraster *, struct avnop * const *,
+	const unsigned int, size_t *, size_t *);
+static bool avnraster_apply(avnraster *, const struct avnop *);
+static bool avnraster_apply_banded(avnraster *, const struct avnop *);
+static bool is_native(const struct avnop *);
+static bool is_tone(const struct avnop *);
+static bool is_blur(const struct avnop *);
+static bool avnraster_apply_blur(avnraster *, const struct avnop *);
+static bool avnraster_apply_native(avnraster *, struct avnop * const *,
+	const unsigned int);
+static unsigned int native_depth(const avnraster *, struct avnop * const *,
+	const unsigned int);
+static bool native_prepare(struct nativeop *, const struct avnop *);
+static bool native_tone(struct nativejob *, const struct avnop *);
+static bool native_histogram(struct nativejob *, const struct avnop *);
+static bool native_flush(struct nativejob *);
+static bool native_pass(struct nativejob *);
+static void native_discard(struct nativejob *);
+static bool native_chunk(void *, const unsigned int);
+static bool histogram_task(void *, const unsigned int);
+static bool render_band(void *, const unsigned int);
 
 static bool __avnraster_brightness(avnraster *avn, const double);
 static bool __avnraster_border(avnraster *, const size_t, const size_t,
@@ -34,6 +156,10 @@ static bool __avnraster_gaussianblur(avnraster*, const double);
 static bool __avnraster_horizontalflip(avnraster *);
 static bool __avnraster_hue(avnraster *, const double);
 static bool __avnraster_implode(avnraster *, const double);
+static bool __avnraster_levels(avnraster *, const double, const double,
+	const double);
+static bool __avnraster_modulate(avnraster *, const double, const double,
+	const double);
 static bool __avnraster_motionblur(avnraster *avn, const double,
 	const double);
 static bool __avnraster_negate(avnraster *);
@@ -41,13 +167,17 @@ static bool __avnraster_negategrays(avnraster *);
 static bool __avnraster_normalize(avnraster *);
 static bool __avnraster_oilpaint(avnraster *, const double);
 static bool __avnraster_radialblur(avnraster *, const double);
-static bool __avnraster_resize(avnraster *, const size_t, const size_t);
+static bool resample(avnraster *, const size_t, const size_t,
+	const char *);
+static bool __avnraster_resize(avnraster *, const size_t, const size_t,
+	const char *);
 static bool __avnraster_roll(avnraster *, const int, const int);
 static bool __avnraster_rotate(avnraster *, const double, const char *);
 static bool __avnraster_saturation(avnraster *, const double);
-static bool __avnraster_scale(avnraster *, const double);
+static bool __avnraster_scale(avnraster *, const double, const char *);
 static bool __avnraster_sharpen(avnraster *, const double);
 static bool __avnraster_swirl(avnraster *, const double);
+static bool __avnraster_tint(avnraster *, const char *, const double);
 static bool __avnraster_verticalflip(avnraster *);
 static bool __avnraster_wave(avnraster *, const double, const double);
 
@@ -62,14 +192,60 @@ avnraster_new(const char *path)
 	if ((avn = malloc(sizeof(avnraster))) == NULL)
 		return NULL;
 
-	if ((wand = NewMagickWand()) == NULL)
+	if ((wand = NewMagickWand()) == NULL) {
+		free(avn);
 		return NULL;
+	}
 
 	avn->image = wand;
+	avn->image_owned = true;
+	avn->source = NULL;
+	avn->blob = false;
+	avn->source_width = 0;
+	avn->source_height = 0;
+	avn->source_hint_width = 0;
+	avn->source_hint_height = 0;
+	avn->nsnapshots = 0;
+	avn->clock = 0;
+	avn->nrendered = 0;
+	avn->deferred = false;
+	avn->deferred_verbose = false;
+	avn->deferred_nops = 0;
+	avn->profile = NULL;
+	avn->nprofile = 0;
+	avn->profile_capacity = 0;
+	avn->resumed = 0;
 	avn->info = (avnrasterinfo){ .width = 0, .height = 0, };
 	snprintf(avn->info.path, PATH_MAX, "%s", path);
-	avn->nops = 0;
+	avnoplist_init(&avn->history);
+
+	return avn;
+}
+
+
+/*
+ * Makes an avnraster out of an image which is already in memory, rather
+ * than one on disk. The avnraster takes the wand over as its source, so it
+ * must not be used (or destroyed) by the caller afterwards. The name only
+ * shows up in avnraster_info.
+ */
+avnraster *
+avnraster_new_with_wand(const char *name, MagickWand *wand)
+{
+	avnraster *avn;
 
+	if ((avn = avnraster_new(name)) == NULL)
+		return NULL;
+
+	set_image(avn, wand, false);
+	avn->source = wand;
+	avn->blob = true;
+	avn->info.width = (size_t)MagickGetImageWidth(wand);
+	avn->info.height = (size_t)MagickGetImageHeight(wand);
+	avn->source_width = avn->info.width;
+	avn->source_height = avn->info.height;
+	snprintf(avn->info.codec, LINE_MAX, "%s", MagickGetImageFormat(wand));
+	read_format(avn);
 	return avn;
 }
 
@@ -82,23 +258,64 @@ avnraster_free(avnraster *avn)
 	if (avn == NULL)
 		return;
 
-	for (i = 0; i < avn->nops; i++)
-		avnop_free(avn->ops[i]);
+	avnoplist_free(&avn->history);
+	free(avn->profile);
 
-	DestroyMagickWand(avn->image);
+	for (i = 0; i < avn->nsnapshots; i++)
+		DestroyMagickWand(avn->snapshots[i].wand);
+
+	if (avn->image_owned)
+		DestroyMagickWand(avn->image);
+	if (avn->source != NULL)
+		DestroyMagickWand(avn->source);
 	free(avn);
 }
 
 
+/*
+ * Roughly how many bytes of pixels the raster is holding on to: the image
+ * at its current size, the decoded source if that's a wand of its own, and
+ * any snapshots besides the image.
+ */
+size_t
+avnraster_footprint(const avnraster *avn)
+{
+	const size_t pixel = 4 * ((QuantumDepth + 7) / 8);
+	size_t bytes;
+	unsigned int i;
+
+	bytes = avn->info.width * avn->info.height * pixel;
+
+	if ((avn->source != NULL) && (avn->source != avn->image))
+		bytes += avn->source_width * avn->source_height * pixel;
+
+	for (i = 0; i < avn->nsnapshots; i++) {
+		if (avn->snapshots[i].wand != avn->image)
+			bytes += avn->snapshots[i].bytes;
+	}
+
+	return bytes;
+}
+
+
 /*
  * XXX should somehow be a general method for all avn*species...
  * Does this mean avn*species is a tagged union?
+ *
+ * Records an op; the arguments are as for avnoplist_add().
  */
-inline void
-avnraster_add_op(avnraster *avn, const struct avnop *op)
+bool
+avnraster_add_op(avnraster *avn, const enum avncmdname name,
+	const unsigned int nargs, ...)
 {
-	avn->ops[avn->nops] = (struct avnop *)op;
-	(avn->nops)++;
+	struct avnop *op;
+	va_list ap;
+
+	va_start(ap, nargs);
+	op = avnoplist_vadd(&avn->history, name, nargs, ap);
+	va_end(ap);
+
+	return op != NULL;
 }
 
 
@@ -108,147 +325,1695 @@ avnraster_add_op(avnraster *avn, const struct avnop *op)
  * we don't need to call a GraphicsMagick function, we can just look up
  * inside the avnraster structure.
  *
- * XXX Actually, to be even more performant: we don't NEED to get any
- * metadata until we need it...
+ * We don't need the pixels for any of that, so we only ping the header,
+ * and leave decoding the image to avnraster_decode() once something really
+ * needs it. Some coders can't ping, in which case we just read the whole
+ * thing up front like we used to.
  */
 bool
 avnraster_open(avnraster *avn)
 {
-	if (MagickReadImage(avn->image, avn->info.path) == MagickPass) {
-		avn->info.width = (size_t)MagickGetImageWidth(avn->image);
-		avn->info.height = (size_t)MagickGetImageHeight(avn->image);
-		snprintf(avn->info.codec, LINE_MAX, "%s",
-			MagickGetImageFormat(avn->image));
-		return true;
-	} else {
+	unsigned char *data;
+	size_t len;
+	bool ok;
+
+	/* A pipe can only be read once, so there's no pinging it. */
+	if (!strcmp(avn->info.path, "-")) {
+		if ((data = read_stdin(&len)) == NULL)
+			return false;
+		ok = avnraster_open_blob(avn, data, len);
+		free(data);
+		return ok;
+	}
+
+	if (MagickPingImage(avn->image, avn->info.path) != MagickPass) {
+		if (!avnraster_decode(avn))
+			return false;
+	}
+
+	avn->info.width = (size_t)MagickGetImageWidth(avn->image);
+	avn->info.height = (size_t)MagickGetImageHeight(avn->image);
+	avn->source_width = avn->info.width;
+	avn->source_height = avn->info.height;
+	snprintf(avn->info.codec, LINE_MAX, "%s",
+		MagickGetImageFormat(avn->image));
+	read_format(avn);
+	return true;
+}
+
+
+/*
+ * Opens an image that's already in memory, e.g. a Lua string. The decoder
+ * reads straight out of data, which the caller can let go of afterwards.
+ * There's no going back to the bytes later, so unlike avnraster_open(),
+ * this decodes the whole image right away.
+ */
+bool
+avnraster_open_blob(avnraster *avn, const void *data, const size_t len)
+{
+	MagickWand *wand;
+
+	if ((wand = NewMagickWand()) == NULL)
+		return false;
+
+	if (MagickReadImageBlob(wand, data, len) != MagickPass) {
+		DestroyMagickWand(wand);
 		return false;
 	}
+
+	if (avn->source != NULL)
+		DestroyMagickWand(avn->source);
+
+	set_image(avn, wand, false);
+	avn->source = wand;
+	avn->blob = true;
+	avn->source_hint_width = 0;
+	avn->source_hint_height = 0;
+	avn->info.width = (size_t)MagickGetImageWidth(wand);
+	avn->info.height = (size_t)MagickGetImageHeight(wand);
+	avn->source_width = avn->info.width;
+	avn->source_height = avn->info.height;
+	snprintf(avn->info.codec, LINE_MAX, "%s", MagickGetImageFormat(wand));
+	read_format(avn);
+	return true;
+}
+
+
+/*
+ * Slurps all of standard input.
+ */
+static unsigned char *
+read_stdin(size_t *len)
+{
+	unsigned char *buf, *p;
+	size_t cap, n;
+
+	cap = BUFSIZ;
+	*len = 0;
+
+	if ((buf = malloc(cap)) == NULL)
+		return NULL;
+
+	while ((n = fread(buf + *len, 1, cap - *len, stdin)) > 0) {
+		*len += n;
+		if (*len < cap)
+			continue;
+		if ((p = realloc(buf, cap * 2)) == NULL) {
+			free(buf);
+			return NULL;
+		}
+		buf = p;
+		cap *= 2;
+	}
+
+	if (ferror(stdin) || (*len == 0)) {
+		free(buf);
+		return NULL;
+	}
+
+	return buf;
 }
 
 
-#define ARG(n) (avn->ops[i]->args[n])
+/*
+ * Reads the pixels in at full size, if they haven't been already. Until
+ * then, the wand only has the header in it.
+ */
+bool
+avnraster_decode(avnraster *avn)
+{
+	return avnraster_decode_scaled(avn, 0, 0);
+}
+
 
 /*
- * XXX This has the opportunity to be multithreaded with range locking
- * and everything!
+ * Same as avnraster_decode(), but tells the decoder that the image is only
+ * going to be shown at (at least) width x height. The JPEG coder uses this
+ * to pick a DCT scaling which lands at or above that size, so it never has
+ * to build the full resolution image at all. Zero means no hint.
  *
+ * Other coders read "size" as the dimensions of headerless formats, so
+ * anything that isn't a JPEG doesn't get the hint.
+ *
+ * A source that was decoded small is read again if something later needs
+ * it bigger. The source is never rendered on directly, so if nothing has
+ * been rendered yet, the image is just the source.
+ */
+static bool
+avnraster_decode_scaled(avnraster *avn, const size_t width,
+	const size_t height)
+{
+	MagickWand *wand;
+	bool hinted;
+
+	if ((avn->source != NULL) && ((avn->source_hint_width == 0) ||
+		((width > 0) && (width <= avn->source_hint_width) &&
+		(height > 0) && (height <= avn->source_hint_height))))
+			return true;
+
+	if ((wand = NewMagickWand()) == NULL)
+		return false;
+
+	hinted = (width > 0) && (height > 0) && !strcmp(avn->info.codec, "JPEG");
+	if (hinted)
+		MagickSetSize(wand, width, height);
+
+	if (MagickReadImage(wand, avn->info.path) != MagickPass) {
+		DestroyMagickWand(wand);
+		return false;
+	}
+
+	if (avn->nrendered == 0) {
+		if (avn->image_owned)
+			DestroyMagickWand(avn->image);
+		avn->image = wand;
+		avn->image_owned = false;
+	}
+
+	if (avn->source != NULL)
+		DestroyMagickWand(avn->source);
+
+	avn->source = wand;
+	avn->source_hint_width = hinted ? width : 0;
+	avn->source_hint_height = hinted ? height : 0;
+	return true;
+}
+
+
+/*
  * XXX "Verbose" should return a string instead? or it should log somewhere
  * specific? or is it just a Lua thing?
+ *
+ * With the render cache on, this only makes a note to render later; see
+ * avnraster_sync() and avnraster_write().
  */
 bool
 avnraster_render(avnraster *avn, const bool verbose)
 {
-	int i;
+	bool ok;
+
+	if (avncache_enabled()) {
+		/* Nothing's been done yet, so there's nothing to profile. */
+		avn->nprofile = 0;
+		avn->resumed = 0;
+		avn->deferred = true;
+		avn->deferred_verbose = verbose;
+		avn->deferred_nops = avn->history.nops;
+		return true;
+	}
+
+	ok = avnraster_render_to(avn, avn->history.nops, verbose);
+	print_profile(avn);
+	return ok;
+}
+
+
+/*
+ * Carries out a deferred render, if there is one.
+ */
+bool
+avnraster_sync(avnraster *avn)
+{
+	bool ok;
+
+	if (!avn->deferred)
+		return true;
+
+	avn->deferred = false;
+	ok = avnraster_render_to(avn, avn->deferred_nops, avn->deferred_verbose);
+	print_profile(avn);
+	return ok;
+}
+
+
+void
+avnraster_set_snapshot_budget(const size_t bytes)
+{
+	snapshot_budget = bytes;
+}
+
+
+size_t
+avnraster_snapshot_budget(void)
+{
+	return snapshot_budget;
+}
+
+
+/*
+ * With profiling on, every render prints avnraster_profile_json() to
+ * stderr once it's done.
+ */
+void
+avnraster_set_profiling(const bool on)
+{
+	profiling = on;
+}
+
+
+/*
+ * Renders the first nops ops. Rendering never touches the source or any
+ * snapshot: it starts from a copy of the snapshot with the longest prefix
+ * of the op list still in common, or of the source if there's none, and
+ * runs only the ops after that. The result becomes a snapshot itself, so
+ * appending an op and rendering again only costs that one op.
+ *
+ * What actually gets rendered is the optimized plan for the rest of the op
+ * list (see optimize.c), so "verbose" prints the ops as they are really
+ * performed.
+ */
+static bool
+avnraster_render_to(avnraster *avn, const unsigned int nops,
+	const bool verbose)
+{
+	struct avnsnapshot *snap;
+	avnoplist plan;
+	MagickWand *base, *wand;
+	unsigned char (*digests)[AVNHASH_LEN];
+	unsigned int k;
+	size_t hint_w = 0, hint_h = 0;
+	bool ok;
+
+	avn->nprofile = 0;
+	avn->resumed = 0;
+
+	if (nops == 0) {
+		if (avn->source != NULL)
+			set_image(avn, avn->source, false);
+		avn->info.width = avn->source_width;
+		avn->info.height = avn->source_height;
+		avn->nrendered = 0;
+		read_format(avn);
+		return true;
+	}
+
+	if ((digests = malloc((nops + 1) * AVNHASH_LEN)) == NULL)
+		return false;
+
+	prefix_digests(avn, nops, digests);
+
+	snap = snapshot_find(avn, nops, digests);
+	k = (snap != NULL) ? snap->nops : 0;
+	avn->resumed = k;
+
+	/* Nothing new since that snapshot, so it's the answer as it is. */
+	if (k == nops) {
+		set_image(avn, snap->wand, false);
+		avn->info.width = snap->width;
+		avn->info.height = snap->height;
+		avn->nrendered = nops;
+		read_format(avn);
+		free(digests);
+		return true;
+	}
+
+	if (!avnraster_optimize(avn->history.ops + k, nops - k, &plan)) {
+		free(digests);
+		return false;
+	}
+
+	if (snap != NULL) {
+		base = snap->wand;
+		avn->info.width = snap->width;
+		avn->info.height = snap->height;
+	} else {
+		avn->info.width = avn->source_width;
+		avn->info.height = avn->source_height;
+		decode_hint(avn, plan.ops, plan.nops, &hint_w, &hint_h);
+
+		if (!avnraster_decode_scaled(avn, hint_w, hint_h)) {
+			avnoplist_free(&plan);
+			free(digests);
+			return false;
+		}
+		base = avn->source;
+	}
+
+	if ((wand = CloneMagickWand(base)) == NULL) {
+		avnoplist_free(&plan);
+		free(digests);
+		return false;
+	}
+
+	set_image(avn, wand, true);
+	avn->nrendered = nops;
+
+	ok = avnraster_apply_plan(avn, plan.ops, plan.nops, verbose);
+	avnoplist_free(&plan);
+
+	/* Something that only half worked isn't worth remembering. */
+	if (ok)
+		snapshot_save(avn, nops, digests[nops]);
+
+	free(digests);
+	return ok;
+}
+
+
+/*
+ * Performs the given ops on the current image, in order, as fast as we
+ * know how, and adds each step to the profile. Runs of ops with native
+ * kernels share one trip out of the wand; everything else is banded where
+ * it can be. Keeps going after an op fails, but then returns false.
+ */
+bool
+avnraster_apply_plan(avnraster *avn, struct avnop * const *ops,
+	const unsigned int nops, const bool verbose)
+{
+	struct stopwatch sw;
+	MagickWand *wand;
+	unsigned int i, j;
+	bool ok = true;
+
+	/* The source and the snapshots are never drawn on. */
+	if (!avn->image_owned) {
+		if ((wand = CloneMagickWand(avn->image)) == NULL)
+			return false;
+		set_image(avn, wand, true);
+	}
+
+	read_format(avn);
+
+	for (i = 0; i < nops; i = j) {
+		for (j = i; (j < nops) && is_native(ops[j]); j++) {
+			if (verbose)
+				print_op(ops[j]);
+		}
+
+		if (j > i) {
+			stopwatch_start(avn, &sw);
+			if (!avnraster_apply_native(avn, ops + i, j - i))
+				ok = false;
+			stopwatch_stop(avn, &sw, ops + i, j - i);
+			continue;
+		}
 
-	for (i = 0; i < avn->nops; i++) {
 		if (verbose)
-			printf("%s\n", cJSON_PrintUnformatted(avnop_to_json(avn->ops[i])));
+			print_op(ops[i]);
+
+		stopwatch_start(avn, &sw);
+		if (is_blur(ops[i])) {
+			if (!avnraster_apply_blur(avn, ops[i]))
+				ok = false;
+		} else if (!avnraster_apply_banded(avn, ops[i])) {
+			ok = false;
+		}
+		stopwatch_stop(avn, &sw, ops + i, 1);
 
-		switch (avn->ops[i]->name) {
-		case RASTER_BORDER:
-			__avnraster_border(avn, ARG(0)->arg_double, ARG(1)->arg_double,
-				ARG(2)->arg_str);
-			break;
-		case RASTER_BRIGHTNESS:
-			__avnraster_brightness(avn, ARG(0)->arg_double);
-			break;
-		case RASTER_CHARCOAL:
-			__avnraster_charcoal(avn, ARG(0)->arg_double);
-			break;
-		case RASTER_CROP:
-			__avnraster_crop(avn, ARG(0)->arg_uint, ARG(1)->arg_uint,
-				ARG(2)->arg_uint, ARG(3)->arg_uint);
-			break;
-		case RASTER_DESPECKLE:
-			__avnraster_despeckle(avn);
-			break;
-		case RASTER_EDGE:
-			__avnraster_edge(avn, ARG(0)->arg_double);
-			break;
-		case RASTER_EMBOSS:
-			__avnraster_emboss(avn, ARG(0)->arg_double);
-			break;
-		case RASTER_EQUALIZE:
-			__avnraster_equalize(avn);
-			break;
-		case RASTER_GAMMA:
-			__avnraster_gamma(avn, ARG(0)->arg_double);
-			break;
-		case RASTER_GAUSSIANBLUR:
-			__avnraster_gaussianblur(avn, ARG(0)->arg_double);
-			break;
-		case RASTER_HORIZONTALFLIP:
-			__avnraster_horizontalflip(avn);
-			break;
-		case RASTER_HUE:
-			__avnraster_hue(avn, ARG(0)->arg_double);
-			break;
-		case RASTER_IMPLODE:
-			__avnraster_implode(avn, ARG(0)->arg_double);
-			break;
-		case RASTER_MOTIONBLUR:
-			__avnraster_motionblur(avn, ARG(0)->arg_double, ARG(1)->arg_double);
-			break;
-		case RASTER_NEGATE:
-			__avnraster_negate(avn);
-			break;
-		case RASTER_NEGATEGRAYS:
-			__avnraster_negategrays(avn);
-			break;
-		case RASTER_NORMALIZE:
-			__avnraster_normalize(avn);
-			break;
-		case RASTER_OILPAINT:
-			__avnraster_oilpaint(avn, ARG(0)->arg_double);
-			break;
-		case RASTER_RADIALBLUR:
-			__avnraster_radialblur(avn, ARG(0)->arg_double);
-			break;
-		case RASTER_RESIZE:
-			__avnraster_resize(avn, ARG(0)->arg_uint, ARG(1)->arg_uint);
-			break;
-		case RASTER_ROLL:
-			__avnraster_roll(avn, ARG(0)->arg_int, ARG(1)->arg_int);
-			break;
-		case RASTER_ROTATE:
-			__avnraster_rotate(avn, ARG(0)->arg_double, ARG(1)->arg_str);
-			break;
-		case RASTER_SATURATION:
-			__avnraster_saturation(avn, ARG(0)->arg_double);
-			break;
-		case RASTER_SCALE:
-			__avnraster_scale(avn, ARG(0)->arg_double);
-			break;
-		case RASTER_SHARPEN:
-			__avnraster_sharpen(avn, ARG(0)->arg_double);
-			break;
-		case RASTER_SWIRL:
-			__avnraster_swirl(avn, ARG(0)->arg_double);
-			break;
-		case RASTER_VERTICALFLIP:
-			__avnraster_verticalflip(avn);
+		/*
+		 * Crop, rotate and border change the size without saying so, and
+		 * later identity checks, snapshots and variants go by the info.
+		 * Rotating onto a transparent background, say, adds alpha.
+		 */
+		avn->info.width = (size_t)MagickGetImageWidth(avn->image);
+		avn->info.height = (size_t)MagickGetImageHeight(avn->image);
+		read_format(avn);
+		j = i + 1;
+	}
+
+	return ok;
+}
+
+
+static void
+print_op(const struct avnop *op)
+{
+	cJSON *json;
+	char *str;
+
+	json = avnop_to_json(op);
+	if ((str = cJSON_PrintUnformatted(json)) != NULL)
+		printf("%s\n", str);
+	free(str);
+	cJSON_Delete(json);
+}
+
+
+static void
+print_profile(const avnraster *avn)
+{
+	char *json;
+
+	if (!profiling || ((json = avnraster_profile_json(avn)) == NULL))
+		return;
+
+	fprintf(stderr, "%s\n", json);
+	free(json);
+}
+
+
+static void
+stopwatch_start(const avnraster *avn, struct stopwatch *sw)
+{
+	sw->wall_ms = avnutil_clock_ms(CLOCK_MONOTONIC);
+	sw->cpu_ms = avnutil_clock_ms(CLOCK_PROCESS_CPUTIME_ID);
+	sw->peak_rss_kb = avnutil_peak_rss_kb();
+	sw->pixels = (size_t)MagickGetImageWidth(avn->image) *
+		MagickGetImageHeight(avn->image) *
+		MagickGetNumberImages(avn->image);
+}
+
+
+/*
+ * Adds a step to the profile for the given ops. The profile is only there
+ * to be looked at, so if there's no room for it, the step is left out.
+ */
+static void
+stopwatch_stop(avnraster *avn, const struct stopwatch *sw,
+	struct avnop * const *ops, const unsigned int nops)
+{
+	struct avnprofile *prof;
+	unsigned int i, capacity;
+	size_t len;
+
+	if (avn->nprofile == avn->profile_capacity) {
+		capacity = (avn->profile_capacity > 0) ? avn->profile_capacity * 2 : 8;
+		if ((prof = realloc(avn->profile, capacity * sizeof(*prof))) == NULL)
+			return;
+		avn->profile = prof;
+		avn->profile_capacity = capacity;
+	}
+
+	prof = &avn->profile[avn->nprofile++];
+	prof->name[0] = '\0';
+
+	for (i = 0, len = 0; i < nops; i++) {
+		len += snprintf(prof->name + len, sizeof(prof->name) - len, "%s%s",
+			(i > 0) ? "+" : "", stravncmdname(ops[i]->name));
+		if (len >= sizeof(prof->name))
 			break;
-		case RASTER_WAVE:
-			__avnraster_wave(avn, ARG(0)->arg_double, ARG(1)->arg_double);
+	}
+
+	prof->nops = nops;
+	prof->wall_ms = avnutil_clock_ms(CLOCK_MONOTONIC) - sw->wall_ms;
+	prof->cpu_ms = avnutil_clock_ms(CLOCK_PROCESS_CPUTIME_ID) - sw->cpu_ms;
+	prof->pixels = sw->pixels;
+	prof->peak_rss_delta_kb = avnutil_peak_rss_kb() - sw->peak_rss_kb;
+}
+
+
+/*
+ * Keeps the depth and alpha in the info up to date with the image.
+ */
+static void
+read_format(avnraster *avn)
+{
+	avn->info.depth = (unsigned int)MagickGetImageDepth(avn->image);
+	avn->info.alpha = MagickGetImageMatte(avn->image) ? true : false;
+}
+
+
+/*
+ * Makes the given wand the current image, getting rid of the old one if
+ * nobody else has a hold of it.
+ */
+static void
+set_image(avnraster *avn, MagickWand *wand, const bool owned)
+{
+	if ((avn->image != wand) && avn->image_owned)
+		DestroyMagickWand(avn->image);
+
+	avn->image = wand;
+	avn->image_owned = owned;
+}
+
+
+/*
+ * Fills in the digest of every prefix of the op list up to nops, where
+ * digests[k] covers the first k ops. A snapshot is only any good if the
+ * ops that led to it are still the ones at the front of the list, exactly;
+ * see avnop_hash().
+ */
+static void
+prefix_digests(const avnraster *avn, const unsigned int nops,
+	unsigned char digests[][AVNHASH_LEN])
+{
+	avnhash h, prefix;
+	unsigned int i;
+
+	avnhash_init(&h);
+	prefix = h;
+	avnhash_final(&prefix, digests[0]);
+
+	for (i = 0; i < nops; i++) {
+		avnop_hash(&h, avn->history.ops[i]);
+		prefix = h;
+		avnhash_final(&prefix, digests[i+1]);
+	}
+}
+
+
+static struct avnsnapshot *
+snapshot_find(avnraster *avn, const unsigned int nops,
+	unsigned char digests[][AVNHASH_LEN])
+{
+	struct avnsnapshot *snap, *best = NULL;
+	unsigned int i;
+
+	for (i = 0; i < avn->nsnapshots; i++) {
+		snap = &avn->snapshots[i];
+
+		if ((snap->nops > nops) ||
+			(memcmp(snap->digest, digests[snap->nops], AVNHASH_LEN) != 0))
+				continue;
+
+		if ((best == NULL) || (snap->nops > best->nops))
+			best = snap;
+	}
+
+	if (best != NULL)
+		best->lastuse = ++(avn->clock);
+
+	return best;
+}
+
+
+/*
+ * Keeps the current image around as the snapshot for the first nops ops.
+ * The snapshot and the image share a wand, which is fine since rendering
+ * never draws on either. Snapshots used longest ago are dropped to stay
+ * within the budget; if the one being dropped is also the current image,
+ * the image just takes it back.
+ */
+static void
+snapshot_save(avnraster *avn, const unsigned int nops,
+	const unsigned char digest[AVNHASH_LEN])
+{
+	struct avnsnapshot *snap;
+	size_t bytes, total;
+	unsigned int i, lru;
+
+	bytes = (size_t)MagickGetImageWidth(avn->image) *
+		MagickGetImageHeight(avn->image) * MagickGetNumberImages(avn->image) *
+		4 * ((QuantumDepth + 7) / 8);
+
+	if ((bytes > snapshot_budget) || !avn->image_owned)
+		return;
+
+	for (;;) {
+		total = bytes;
+		for (i = 0; i < avn->nsnapshots; i++)
+			total += avn->snapshots[i].bytes;
+
+		if ((total <= snapshot_budget) &&
+			(avn->nsnapshots < AVNRASTER_MAX_SNAPSHOTS))
+				break;
+
+		lru = 0;
+		for (i = 1; i < avn->nsnapshots; i++) {
+			if (avn->snapshots[i].lastuse < avn->snapshots[lru].lastuse)
+				lru = i;
+		}
+
+		if (avn->snapshots[lru].wand == avn->image)
+			avn->image_owned = true;
+		else
+			DestroyMagickWand(avn->snapshots[lru].wand);
+
+		avn->snapshots[lru] = avn->snapshots[avn->nsnapshots-1];
+		avn->nsnapshots--;
+	}
+
+	snap = &avn->snapshots[avn->nsnapshots];
+	snap->wand = avn->image;
+	snap->nops = nops;
+	memcpy(snap->digest, digest, AVNHASH_LEN);
+	snap->width = avn->info.width;
+	snap->height = avn->info.height;
+	snap->bytes = bytes;
+	snap->lastuse = ++(avn->clock);
+	avn->nsnapshots++;
+	avn->image_owned = false;
+}
+
+
+/*
+ * If the plan shrinks the image before doing anything that cares how big
+ * it is, the decoder doesn't need to produce more than that. Ops which
+ * only look at one pixel at a time, and flips, come out the same whether
+ * they run before or after the shrink, so we can look past them. We still
+ * ask for twice the final size, so that the resize itself has something
+ * to filter down from; a 40MP JPEG headed for a thumbnail still decodes
+ * at an eighth or a quarter of its size.
+ *
+ * Scale works off the header's dimensions (see __avnraster_scale()), so
+ * the smaller decode doesn't change where it ends up.
+ */
+static bool
+decode_hint(const avnraster *avn, struct avnop * const *plan,
+	const unsigned int nplan, size_t *width, size_t *height)
+{
+	const struct avnop *op;
+	size_t w, h;
+	unsigned int i;
+
+	for (i = 0; i < nplan; i++) {
+		op = plan[i];
+
+		switch (op->name) {
+		case RASTER_BRIGHTNESS: /* FALLTHROUGH */
+		case RASTER_GAMMA:
+		case RASTER_HORIZONTALFLIP:
+		case RASTER_HUE:
+		case RASTER_LEVELS:
+		case RASTER_MODULATE:
+		case RASTER_NEGATE:
+		case RASTER_NEGATEGRAYS:
+		case RASTER_SATURATION:
+		case RASTER_TINT:
+		case RASTER_VERTICALFLIP:
+			continue;
+		case RASTER_RESIZE:
+			w = op->args[0].arg_uint;
+			h = op->args[1].arg_uint;
+			break;
+		case RASTER_SCALE:
+			w = avn->info.width * op->args[0].arg_double;
+			h = avn->info.height * op->args[0].arg_double;
 			break;
 		default:
-			return false; /* NOTREACHED */
+			return false;
 		}
+
+		if ((w == 0) || (h == 0) || (w > avn->info.width / 2) ||
+			(h > avn->info.height / 2))
+				return false;
+
+		*width = w * 2;
+		*height = h * 2;
+		return true;
+	}
+
+	return false;
+}
+
+
+#define ARG(n) (op->args[n])
+
+/*
+ * Performs a single op on the image right away.
+ */
+static bool
+avnraster_apply(avnraster *avn, const struct avnop *op)
+{
+	switch (op->name) {
+	case RASTER_BORDER:
+		return __avnraster_border(avn, ARG(0).arg_uint, ARG(1).arg_uint,
+			ARG(2).arg_str);
+	case RASTER_BRIGHTNESS:
+		return __avnraster_brightness(avn, ARG(0).arg_double);
+	case RASTER_CHARCOAL:
+		return __avnraster_charcoal(avn, ARG(0).arg_double);
+	case RASTER_CROP:
+		return __avnraster_crop(avn, ARG(0).arg_uint, ARG(1).arg_uint,
+			ARG(2).arg_uint, ARG(3).arg_uint);
+	case RASTER_DESPECKLE:
+		return __avnraster_despeckle(avn);
+	case RASTER_EDGE:
+		return __avnraster_edge(avn, ARG(0).arg_double);
+	case RASTER_EMBOSS:
+		return __avnraster_emboss(avn, ARG(0).arg_double);
+	case RASTER_EQUALIZE:
+		return __avnraster_equalize(avn);
+	case RASTER_GAMMA:
+		return __avnraster_gamma(avn, ARG(0).arg_double);
+	case RASTER_GAUSSIANBLUR:
+		return __avnraster_gaussianblur(avn, ARG(0).arg_double);
+	case RASTER_HORIZONTALFLIP:
+		return __avnraster_horizontalflip(avn);
+	case RASTER_HUE:
+		return __avnraster_hue(avn, ARG(0).arg_double);
+	case RASTER_IMPLODE:
+		return __avnraster_implode(avn, ARG(0).arg_double);
+	case RASTER_LEVELS:
+		return __avnraster_levels(avn, ARG(0).arg_double, ARG(1).arg_double,
+			ARG(2).arg_double);
+	case RASTER_MODULATE:
+		return __avnraster_modulate(avn, ARG(0).arg_double, ARG(1).arg_double,
+			ARG(2).arg_double);
+	case RASTER_MOTIONBLUR:
+		return __avnraster_motionblur(avn, ARG(0).arg_double, ARG(1).arg_double);
+	case RASTER_NEGATE:
+		return __avnraster_negate(avn);
+	case RASTER_NEGATEGRAYS:
+		return __avnraster_negategrays(avn);
+	case RASTER_NORMALIZE:
+		return __avnraster_normalize(avn);
+	case RASTER_OILPAINT:
+		return __avnraster_oilpaint(avn, ARG(0).arg_double);
+	case RASTER_RADIALBLUR:
+		return __avnraster_radialblur(avn, ARG(0).arg_double);
+	case RASTER_RESIZE:
+		return __avnraster_resize(avn, ARG(0).arg_uint, ARG(1).arg_uint,
+			ARG(2).arg_str);
+	case RASTER_ROLL:
+		return __avnraster_roll(avn, ARG(0).arg_int, ARG(1).arg_int);
+	case RASTER_ROTATE:
+		return __avnraster_rotate(avn, ARG(0).arg_double, ARG(1).arg_str);
+	case RASTER_SATURATION:
+		return __avnraster_saturation(avn, ARG(0).arg_double);
+	case RASTER_SCALE:
+		return __avnraster_scale(avn, ARG(0).arg_double, ARG(1).arg_str);
+	case RASTER_SHARPEN:
+		return __avnraster_sharpen(avn, ARG(0).arg_double);
+	case RASTER_SWIRL:
+		return __avnraster_swirl(avn, ARG(0).arg_double);
+	case RASTER_TINT:
+		return __avnraster_tint(avn, ARG(0).arg_str, ARG(1).arg_double);
+	case RASTER_VERTICALFLIP:
+		return __avnraster_verticalflip(avn);
+	case RASTER_WAVE:
+		return __avnraster_wave(avn, ARG(0).arg_double, ARG(1).arg_double);
+	default:
+		return false; /* NOTREACHED */
+	}
+}
+
+#undef ARG
+
+
+/*
+ * Performs a single op on the current image right away, on one thread, the
+ * way GraphicsMagick would do it by itself: no optimizer, no bands and no
+ * native kernels. The op isn't recorded, so the next render starts over
+ * from the history as if this never happened. This is mostly here for the
+ * benchmark (see bench.c), to have something to compare renders against.
+ */
+bool
+avnraster_apply_op(avnraster *avn, const struct avnop *op)
+{
+	MagickWand *wand;
+	bool ok;
+
+	if (!avnraster_decode(avn))
+		return false;
+
+	/* The source and the snapshots are never drawn on. */
+	if (!avn->image_owned) {
+		if ((wand = CloneMagickWand(avn->image)) == NULL)
+			return false;
+		set_image(avn, wand, true);
+	}
+
+	ok = avnraster_apply(avn, op);
+	avn->info.width = (size_t)MagickGetImageWidth(avn->image);
+	avn->info.height = (size_t)MagickGetImageHeight(avn->image);
+	read_format(avn);
+	return ok;
+}
+
+
+/*
+ * Ops which only look at a fixed neighbourhood around each pixel get split
+ * into horizontal bands, and each band is rendered on its own thread. Each
+ * band is cropped out of the image along with enough rows of its
+ * neighbours (the "halo") for the kernel to see what it would have seen on
+ * the whole image, and the halo is thrown away again afterwards. Since
+ * every band only ever writes its own rows back, no two threads touch the
+ * same part of the image.
+ *
+ * Anything else, or anything too small to be worth it, is rendered the
+ * usual way.
+ */
+static bool
+avnraster_apply_banded(avnraster *avn, const struct avnop *op)
+{
+	struct avnband bands[AVNTILES_MAX_THREADS];
+	MagickWand *wands[AVNTILES_MAX_THREADS];
+	struct bandjob job;
+	size_t width, height;
+	unsigned int i, nbands;
+	long halo;
+	bool ok;
+
+	width = MagickGetImageWidth(avn->image);
+	height = MagickGetImageHeight(avn->image);
+
+	if (((halo = avnraster_halo(op)) < 0) || (avntiles_nthreads() < 2) ||
+		(width * height < AVNRASTER_MIN_BANDED_PIXELS) ||
+		(MagickGetNumberImages(avn->image) != 1))
+			return avnraster_apply(avn, op);
+
+	nbands = avntiles_bands(bands, avntiles_nthreads(), height, halo);
+
+	if (nbands < 2)
+		return avnraster_apply(avn, op);
+
+	/*
+	 * Clones share the original's pixels until they're cropped, so this is
+	 * cheap, but it has to happen before any thread starts.
+	 */
+	for (i = 0; i < nbands; i++) {
+		if ((wands[i] = CloneMagickWand(avn->image)) == NULL) {
+			while (i > 0)
+				DestroyMagickWand(wands[--i]);
+			return avnraster_apply(avn, op);
+		}
+	}
+
+	job = (struct bandjob){
+		.avn = avn, .op = op, .bands = bands, .wands = wands,
+	};
+
+	ok = avntiles_run(nbands, render_band, &job);
+
+	for (i = 0; i < nbands; i++) {
+		if (ok && (MagickCompositeImage(avn->image, wands[i], CopyCompositeOp,
+			0, bands[i].y) != MagickPass))
+				ok = false;
+		DestroyMagickWand(wands[i]);
+	}
+
+	return ok;
+}
+
+
+/*
+ * Ops which have a native kernel (see kernels.c).
+ */
+static bool
+is_native(const struct avnop *op)
+{
+	switch (op->name) {
+	case RASTER_BRIGHTNESS: /* FALLTHROUGH */
+	case RASTER_HUE:
+	case RASTER_MODULATE:
+	case RASTER_NEGATEGRAYS:
+	case RASTER_SATURATION:
+		return true;
+	default:
+		return is_tone(op);
+	}
+}
+
+
+/*
+ * Native ops which map each channel's values through a curve of their
+ * own, so that any number of them in a row make one lookup table. Brightness
+ * isn't one of them: it works on HSL lightness, which mixes the channels.
+ */
+static bool
+is_tone(const struct avnop *op)
+{
+	switch (op->name) {
+	case RASTER_EQUALIZE: /* FALLTHROUGH */
+	case RASTER_GAMMA:
+	case RASTER_LEVELS:
+	case RASTER_NEGATE:
+	case RASTER_NORMALIZE:
+	case RASTER_TINT:
+		return true;
+	default:
+		return false;
+	}
+}
+
+
+/*
+ * Ops which have a native blur (see blur.c). Motion blur only does if it's
+ * along one of the axes.
+ */
+static bool
+is_blur(const struct avnop *op)
+{
+	switch (op->name) {
+	case RASTER_GAUSSIANBLUR: /* FALLTHROUGH */
+	case RASTER_SHARPEN:
+		return true;
+	case RASTER_MOTIONBLUR:
+		return avnblur_motion_supported(op->args[1].arg_double);
+	default:
+		return false;
+	}
+}
+
+
+/*
+ * A blur rounds once for each pass, so unlike the point ops, it always
+ * works at full precision. If the pixels can't be exported, GraphicsMagick
+ * does the work instead.
+ *
+ * Sharpening is an unsharp mask at the same strength as GraphicsMagick's
+ * own sharpening kernel.
+ */
+static bool
+avnraster_apply_blur(avnraster *avn, const struct avnop *op)
+{
+	avnpixels px;
+	bool ok;
+
+	if ((MagickGetNumberImages(avn->image) != 1) ||
+		!avnpixels_export(&px, avn->image, QuantumDepth,
+		avn->info.alpha ? 4 : 3))
+			return avnraster_apply_banded(avn, op);
+
+	switch (op->name) {
+	case RASTER_GAUSSIANBLUR:
+		ok = avnblur_gaussian(&px, op->args[0].arg_double);
+		break;
+	case RASTER_SHARPEN:
+		ok = avnblur_unsharp(&px, op->args[0].arg_double, 1.0);
+		break;
+	default:
+		ok = avnblur_motion(&px, op->args[0].arg_double,
+			op->args[1].arg_double);
+		break;
+	}
+
+	if (ok && !avnpixels_import(&px, avn->image))
+		ok = false;
+
+	avnpixels_free(&px);
+	return ok;
+}
+
+
+/*
+ * Renders a run of native ops: the pixels are exported once, every op's
+ * kernel runs over them, and they're imported once. The rows are handed
+ * out to the threads in chunks small enough to stay in cache while all of
+ * the ops run over them. However many tone ops there are in a row, they
+ * only cost one table lookup per channel.
+ *
+ * Equalizing and normalizing need a histogram of the pixels as they are by
+ * then. The tone curve before them doesn't have to be applied for that,
+ * but any other op does, so the ops before those take a pass of their own.
+ *
+ * If the pixels can't be exported for whatever reason, GraphicsMagick does
+ * the work instead.
+ */
+static bool
+avnraster_apply_native(avnraster *avn, struct avnop * const *ops,
+	const unsigned int nops)
+{
+	struct nativeop prepared[AVNRASTER_MAX_NATIVE_RUN];
+	struct nativejob job;
+	avnpixels px;
+	unsigned int i, n;
+	bool ok = true;
+
+	n = (nops > AVNRASTER_MAX_NATIVE_RUN) ? AVNRASTER_MAX_NATIVE_RUN : nops;
+
+	if ((MagickGetNumberImages(avn->image) != 1) ||
+		!avnpixels_export(&px, avn->image, native_depth(avn, ops, n),
+		avn->info.alpha ? 4 : 3)) {
+			for (i = 0; i < nops; i++) {
+				if (!avnraster_apply_banded(avn, ops[i]))
+					ok = false;
+			}
+			return ok;
+	}
+
+	job = (struct nativejob){ .px = &px, .ops = prepared };
+	job.chunk = AVNRASTER_NATIVE_CHUNK / px.stride;
+	if (job.chunk < 1)
+		job.chunk = 1;
+
+	for (i = 0; ok && (i < n); i++) {
+		if (is_tone(ops[i]))
+			ok = native_tone(&job, ops[i]);
+		else if ((ok = native_flush(&job)))
+			ok = native_prepare(&prepared[job.nops++], ops[i]);
+	}
+
+	if (ok)
+		ok = native_flush(&job) && native_pass(&job);
+
+	if (ok && !avnpixels_import(&px, avn->image))
+		ok = false;
+
+	native_discard(&job);
+	avnpixels_free(&px);
+
+	/* Really long runs just go around again. */
+	if (ok && (n < nops))
+		return avnraster_apply_native(avn, ops + n, nops - n);
+
+	return ok;
+}
+
+
+/*
+ * The native kernels run on 8 bits per channel, which is half the memory
+ * traffic of a 16 bit quantum, whenever that loses nothing: the image has
+ * no more than 8 bits to begin with, and no more than one step of the run
+ * rounds its result. Tone ops in a row are one step, since their curve is
+ * worked out at full depth; negating is exact at any depth.
+ */
+static unsigned int
+native_depth(const avnraster *avn, struct avnop * const *ops,
+	const unsigned int nops)
+{
+	unsigned int i, rounding;
+
+	if ((QuantumDepth <= 8) || (avn->info.depth > 8))
+		return QuantumDepth;
+
+	rounding = 0;
+	for (i = 0; i < nops; i++) {
+		if (ops[i]->name == RASTER_NEGATEGRAYS)
+			continue;
+
+		if (is_tone(ops[i])) {
+			if ((i > 0) && is_tone(ops[i - 1]))
+				continue;
+			if ((ops[i]->name == RASTER_NEGATE) &&
+				((i + 1 == nops) || !is_tone(ops[i + 1])))
+					continue;
+		}
+
+		rounding++;
+	}
+
+	return (rounding <= 1) ? 8 : 16;
+}
+
+
+/*
+ * Works out everything a native op that isn't a tone op needs ahead of
+ * time, so the threads only ever have to read it.
+ */
+static bool
+native_prepare(struct nativeop *nop, const struct avnop *op)
+{
+	nop->op = op;
+	nop->lut = NULL;
+	nop->modulation[0] = nop->modulation[1] = nop->modulation[2] = 100.0;
+
+	switch (op->name) {
+	case RASTER_BRIGHTNESS:
+		nop->modulation[0] = op->args[0].arg_double + 100.0;
+		return true;
+	case RASTER_SATURATION:
+		nop->modulation[1] = op->args[0].arg_double + 100.0;
+		return true;
+	case RASTER_HUE:
+		nop->modulation[2] = op->args[0].arg_double + 100.0;
+		return true;
+	case RASTER_MODULATE:
+		nop->modulation[0] = op->args[0].arg_double;
+		nop->modulation[1] = op->args[1].arg_double;
+		nop->modulation[2] = op->args[2].arg_double;
+		return true;
+	default:
+		return true;
+	}
+}
+
+
+/*
+ * Adds a tone op to the end of the curve being built up.
+ */
+static bool
+native_tone(struct nativejob *job, const struct avnop *op)
+{
+	PixelWand *colorw;
+	double rgb[3];
+
+	if (job->tone == NULL) {
+		job->tone = avnlut_new((QuantumDepth <= 8) ? 8 : 16);
+		if (job->tone == NULL)
+			return false;
+		job->tone_op = op;
+		job->ntone = 0;
+	}
+
+	job->ntone++;
+
+	switch (op->name) {
+	case RASTER_EQUALIZE: /* FALLTHROUGH */
+	case RASTER_NORMALIZE:
+		return native_histogram(job, op);
+	case RASTER_GAMMA:
+		avnlut_gamma(job->tone, op->args[0].arg_double);
+		return true;
+	case RASTER_LEVELS:
+		avnlut_levels(job->tone, op->args[0].arg_double,
+			op->args[1].arg_double, op->args[2].arg_double);
+		return true;
+	case RASTER_NEGATE:
+		avnlut_negate(job->tone);
+		return true;
+	default:
+		if ((colorw = pixel_wand_with_color(op->args[0].arg_str)) == NULL)
+			return false;
+		rgb[0] = PixelGetRed(colorw);
+		rgb[1] = PixelGetGreen(colorw);
+		rgb[2] = PixelGetBlue(colorw);
+		DestroyPixelWand(colorw);
+		avnlut_tint(job->tone, rgb, op->args[1].arg_double);
+		return true;
+	}
+}
+
+
+/*
+ * Equalizes or normalizes the tone curve, going by a histogram of the
+ * pixels. Each thread counts a band into a histogram of its own, and then
+ * they're added up.
+ */
+static bool
+native_histogram(struct nativejob *job, const struct avnop *op)
+{
+	struct histogramjob hjob;
+	size_t i;
+	unsigned int t;
+	bool ok;
+
+	if (!native_pass(job))
+		return false;
+
+	hjob.px = job->px;
+	hjob.size = 3 * ((size_t)1 << job->px->depth);
+	hjob.ntasks = avntiles_nthreads();
+	if (hjob.ntasks > job->px->height)
+		hjob.ntasks = job->px->height;
+	if (hjob.ntasks < 1)
+		hjob.ntasks = 1;
+
+	hjob.counts = calloc(hjob.ntasks * hjob.size, sizeof(uint64_t));
+	if (hjob.counts == NULL)
+		return false;
+
+	ok = avntiles_run(hjob.ntasks, histogram_task, &hjob);
+
+	for (t = 1; ok && (t < hjob.ntasks); t++) {
+		for (i = 0; i < hjob.size; i++)
+			hjob.counts[i] += hjob.counts[t * hjob.size + i];
+	}
+
+	if (ok) {
+		if (op->name == RASTER_EQUALIZE)
+			ok = avnlut_equalize(job->tone, hjob.counts, job->px->depth);
+		else
+			ok = avnlut_normalize(job->tone, hjob.counts, job->px->depth);
+	}
+
+	free(hjob.counts);
+	return ok;
+}
+
+
+/*
+ * Ends the tone curve, if there is one, making it the next step of the
+ * pass at the pixels' depth. A negate on its own is cheaper to do by
+ * flipping bits than by looking them up.
+ */
+static bool
+native_flush(struct nativejob *job)
+{
+	struct nativeop *nop;
+
+	if (job->tone == NULL)
+		return true;
+
+	nop = &(job->ops[job->nops]);
+	nop->op = job->tone_op;
+	nop->lut = NULL;
+	nop->modulation[0] = nop->modulation[1] = nop->modulation[2] = 100.0;
+
+	if ((job->ntone > 1) || (job->tone_op->name != RASTER_NEGATE)) {
+		if ((nop->lut = avnlut_narrow(job->tone, job->px->depth)) == NULL)
+			return false;
+	}
+
+	job->nops++;
+	avnlut_free(job->tone);
+	job->tone = NULL;
+	return true;
+}
+
+
+/*
+ * Runs every step so far over the pixels, then forgets them.
+ */
+static bool
+native_pass(struct nativejob *job)
+{
+	unsigned int i, ntasks;
+	bool ok;
+
+	if (job->nops == 0)
+		return true;
+
+	ntasks = (job->px->height + job->chunk - 1) / job->chunk;
+	ok = avntiles_run(ntasks, native_chunk, job);
+
+	for (i = 0; i < job->nops; i++)
+		avnlut_free(job->ops[i].lut);
+	job->nops = 0;
+
+	return ok;
+}
+
+
+static void
+native_discard(struct nativejob *job)
+{
+	unsigned int i;
+
+	for (i = 0; i < job->nops; i++)
+		avnlut_free(job->ops[i].lut);
+	job->nops = 0;
+
+	avnlut_free(job->tone);
+	job->tone = NULL;
+}
+
+
+/*
+ * Runs on a worker thread.
+ */
+static bool
+native_chunk(void *arg, const unsigned int task)
+{
+	struct nativejob *job = arg;
+	struct nativeop *nop;
+	size_t y, rows;
+	unsigned int i;
+
+	y = task * job->chunk;
+	rows = (y + job->chunk > job->px->height) ? job->px->height - y :
+		job->chunk;
+
+	for (i = 0; i < job->nops; i++) {
+		nop = &(job->ops[i]);
+
+		if (nop->lut != NULL) {
+			avnkernel_lut(job->px, y, rows, nop->lut);
+			continue;
+		}
+
+		switch (nop->op->name) {
+		case RASTER_NEGATE:
+			avnkernel_negate(job->px, y, rows);
+			break;
+		case RASTER_NEGATEGRAYS:
+			avnkernel_negategrays(job->px, y, rows);
+			break;
+		default:
+			avnkernel_modulate(job->px, y, rows, nop->modulation[0],
+				nop->modulation[1], nop->modulation[2]);
+			break;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * Runs on a worker thread.
+ */
+static bool
+histogram_task(void *arg, const unsigned int task)
+{
+	struct histogramjob *hjob = arg;
+	const size_t height = hjob->px->height;
+	size_t y, last;
+
+	y = height * task / hjob->ntasks;
+	last = height * (task + 1) / hjob->ntasks;
+
+	avnkernel_histogram(hjob->px, y, last - y,
+		hjob->counts + task * hjob->size);
+	return true;
+}
+
+
+/*
+ * Returns how many rows of context a band needs for the given op, or -1 if
+ * the op can't be split up at all. GraphicsMagick sizes its kernels at
+ * well under five sigmas when left to pick the radius itself. Emboss
+ * equalizes the whole image once it's convolved, so like equalize, it
+ * can't be done a band at a time.
+ */
+long
+avnraster_halo(const struct avnop *op)
+{
+	switch (op->name) {
+	case RASTER_BRIGHTNESS: /* FALLTHROUGH */
+	case RASTER_GAMMA:
+	case RASTER_HORIZONTALFLIP:
+	case RASTER_HUE:
+	case RASTER_LEVELS:
+	case RASTER_MODULATE:
+	case RASTER_NEGATE:
+	case RASTER_NEGATEGRAYS:
+	case RASTER_SATURATION:
+	case RASTER_TINT:
+		return 0;
+	case RASTER_EDGE:
+		return (long)ceil(op->args[0].arg_double) + 2;
+	case RASTER_GAUSSIANBLUR: /* FALLTHROUGH */
+	case RASTER_SHARPEN:
+		return (long)ceil(5.0 * op->args[0].arg_double) + 2;
+	default:
+		return -1;
+	}
+}
+
+
+/*
+ * Runs on a worker thread. The avnraster handed to the op is a stand-in
+ * which only knows about this band; everything else about it is zeroed.
+ */
+static bool
+render_band(void *arg, const unsigned int i)
+{
+	struct bandjob *job = arg;
+	struct avnband *b = &(job->bands[i]);
+	MagickWand *wand = job->wands[i];
+	avnraster band;
+	size_t width;
+
+	width = MagickGetImageWidth(wand);
+
+	if (MagickCropImage(wand, width, b->halo_top + b->rows + b->halo_bottom,
+		0, b->y - b->halo_top) != MagickPass)
+			return false;
+
+	memset(&band, 0, sizeof(band));
+	band.image = wand;
+	band.info = job->avn->info;
+	band.info.height = b->halo_top + b->rows + b->halo_bottom;
+	avnoplist_init(&band.history);
+
+	if (!avnraster_apply(&band, job->op))
+		return false;
+
+	if ((b->halo_top > 0) || (b->halo_bottom > 0)) {
+		if (MagickCropImage(wand, width, b->rows, 0, b->halo_top) != MagickPass)
+			return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * Leaves every option for GraphicsMagick to decide.
+ */
+void
+avnwriteopts_init(avnwriteopts *opts)
+{
+	*opts = (avnwriteopts){
+		.quality = -1, .sampling = "", .progressive = -1,
+		.png_level = -1, .png_filter = -1, .webp_method = -1,
+	};
+}
+
+
+/*
+ * Fills in one of the presets, trading encoding time against bytes:
+ * "fast", "balanced" or "small". Returns false for anything else.
+ * "Progressive" only applies to JPEGs; everything else is written without
+ * interlacing whatever the preset says.
+ */
+bool
+avnwriteopts_preset(avnwriteopts *opts, const char *name)
+{
+	if (!strcmp(name, "fast")) {
+		*opts = (avnwriteopts){
+			.quality = 80, .sampling = "4:2:0", .progressive = 0,
+			.png_level = 1, .png_filter = AVNPNG_SUB, .webp_method = 0,
+		};
+	} else if (!strcmp(name, "balanced")) {
+		*opts = (avnwriteopts){
+			.quality = 85, .sampling = "4:2:0", .progressive = 0,
+			.png_level = 6, .png_filter = AVNPNG_ADAPTIVE, .webp_method = 4,
+		};
+	} else if (!strcmp(name, "small")) {
+		*opts = (avnwriteopts){
+			.quality = 75, .sampling = "4:2:0", .progressive = 1,
+			.png_level = 9, .png_filter = AVNPNG_ADAPTIVE, .webp_method = 6,
+		};
+	} else {
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * Writes the rendered image out, with the given encoder options (or NULL
+ * for GraphicsMagick's defaults). The options are set on a copy of the
+ * image, which shares its pixels, so that they don't stick to the image
+ * for the next write.
+ */
+bool
+avnraster_write(avnraster *avn, const char *path, const avnwriteopts *opts)
+{
+	MagickWand *wand;
+	avnwriteopts defaults;
+	char key[AVNHASH_HEX_LEN];
+	char format[LINE_MAX];
+	bool cacheable, ok;
+
+	if (!strcmp(path, "-"))
+		return write_stdout(avn, opts);
+
+	if (opts == NULL) {
+		avnwriteopts_init(&defaults);
+		opts = &defaults;
+	}
+
+	/*
+	 * Only an image whose pixels are exactly the source plus its whole
+	 * history can go through the cache, i.e. one which has been (or is
+	 * about to be) rendered with nothing recorded since. Anything else is
+	 * just written out.
+	 */
+	cacheable = avncache_enabled() &&
+		(avn->history.nops ==
+		(avn->deferred ? avn->deferred_nops : avn->nrendered)) &&
+		cache_key(avn, path, opts, key);
+
+	if (cacheable && avncache_fetch(key, path))
+		return true;
+
+	if (!avnraster_sync(avn) || !avnraster_decode(avn))
+		return false;
+
+	if ((wand = CloneMagickWand(avn->image)) == NULL)
+		return false;
+
+	output_format(avn, path, format, sizeof(format));
+	ok = set_write_options(wand, format, opts) &&
+		(MagickWriteImage(wand, path) == MagickPass);
+	DestroyMagickWand(wand);
+
+	if (ok && cacheable)
+		avncache_store(key, path);
+
+	return ok;
+}
+
+
+/*
+ * Encodes the image in memory, as format, or as whatever it was read in if
+ * that's NULL. The result is the encoder's own buffer, so it goes back with
+ * avnraster_free_blob().
+ */
+unsigned char *
+avnraster_write_blob(avnraster *avn, const char *format,
+	const avnwriteopts *opts, size_t *len)
+{
+	MagickWand *wand;
+	avnwriteopts defaults;
+	unsigned char *blob;
+	char fmt[LINE_MAX];
+	int i;
+
+	if (opts == NULL) {
+		avnwriteopts_init(&defaults);
+		opts = &defaults;
+	}
+
+	snprintf(fmt, sizeof(fmt), "%s",
+		(format != NULL) ? format : avn->info.codec);
+	for (i = 0; fmt[i] != '\0'; i++)
+		fmt[i] = tolower((unsigned char)fmt[i]);
+
+	if (!avnraster_sync(avn) || !avnraster_decode(avn))
+		return NULL;
+
+	if ((wand = CloneMagickWand(avn->image)) == NULL)
+		return NULL;
+
+	blob = NULL;
+	*len = 0;
+	if (set_write_options(wand, fmt, opts) &&
+		(MagickSetImageFormat(wand, fmt) == MagickPass))
+			blob = MagickWriteImageBlob(wand, len);
+
+	DestroyMagickWand(wand);
+
+	if ((blob != NULL) && (*len == 0)) {
+		MagickRelinquishMemory(blob);
+		blob = NULL;
 	}
 
-	return true;
+	return blob;
 }
 
-#undef ARG
 
+void
+avnraster_free_blob(unsigned char *blob)
+{
+	if (blob != NULL)
+		MagickRelinquishMemory(blob);
+}
 
-bool
-avnraster_write(avnraster *avn, const char *path)
+
+/*
+ * "-" as a path writes to standard output, in the format the image was
+ * read in. This never goes through the render cache, since there's no file
+ * to copy an entry to or from.
+ */
+static bool
+write_stdout(avnraster *avn, const avnwriteopts *opts)
 {
-	if (MagickWriteImage(avn->image, path) == MagickPass)
-		return true;
+	unsigned char *blob;
+	size_t len;
+	bool ok;
+
+	if ((blob = avnraster_write_blob(avn, NULL, opts, &len)) == NULL)
+		return false;
+
+	ok = (fwrite(blob, 1, len, stdout) == len) && (fflush(stdout) == 0);
+	avnraster_free_blob(blob);
+	return ok;
+}
+
+
+/*
+ * The format the image is going to be written as, in lowercase: the
+ * path's extension, or the format it was read in if there isn't one.
+ */
+static void
+output_format(const avnraster *avn, const char *path, char *format,
+	const size_t len)
+{
+	const char *ext, *slash;
+	int i;
+
+	ext = strrchr(path, '.');
+	slash = strrchr(path, '/');
+
+	if ((ext == NULL) || ((slash != NULL) && (ext < slash)))
+		ext = avn->info.codec;
 	else
+		ext++;
+
+	snprintf(format, len, "%s", ext);
+	for (i = 0; format[i] != '\0'; i++)
+		format[i] = tolower((unsigned char)format[i]);
+}
+
+
+/*
+ * GraphicsMagick reads the PNG zlib level and filter out of the quality,
+ * as level * 10 + filter, so for PNGs the quality is made out of those.
+ * Its own default there is 75, i.e. level 7 with adaptive filtering.
+ */
+static bool
+set_write_options(MagickWand *wand, const char *format,
+	const avnwriteopts *opts)
+{
+	double factors[2];
+	char method[16];
+	int level, filter;
+
+	if (!strcmp(format, "png")) {
+		if ((opts->png_level >= 0) || (opts->png_filter >= 0)) {
+			level = (opts->png_level >= 0) ? opts->png_level : 7;
+			filter = (opts->png_filter >= 0) ? opts->png_filter :
+				AVNPNG_ADAPTIVE;
+			if (MagickSetCompressionQuality(wand, (level * 10) + filter) !=
+				MagickPass)
+					return false;
+		}
+	} else if (opts->quality >= 0) {
+		if (MagickSetCompressionQuality(wand, opts->quality) != MagickPass)
+			return false;
+	}
+
+	if (opts->sampling[0] != '\0') {
+		if (!strcmp(opts->sampling, "4:2:0")) {
+			factors[0] = 2.0;
+			factors[1] = 2.0;
+		} else if (!strcmp(opts->sampling, "4:2:2")) {
+			factors[0] = 2.0;
+			factors[1] = 1.0;
+		} else if (!strcmp(opts->sampling, "4:4:4")) {
+			factors[0] = 1.0;
+			factors[1] = 1.0;
+		} else {
+			return false;
+		}
+		if (MagickSetSamplingFactors(wand, 2, factors) != MagickPass)
+			return false;
+	}
+
+	/* Interlaced PNGs and GIFs only come out bigger, and slower. */
+	if ((opts->progressive >= 0) &&
+		(!strcmp(format, "jpeg") || !strcmp(format, "jpg"))) {
+			if (MagickSetInterlaceScheme(wand, opts->progressive ?
+				LineInterlace : NoInterlace) != MagickPass)
+					return false;
+	}
+
+	if (opts->webp_method >= 0) {
+		snprintf(method, sizeof(method), "%d", opts->webp_method);
+		if (MagickSetImageOption(wand, "webp", "method", method) !=
+			MagickPass)
+				return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * GraphicsMagick picks the encoder from the output file's extension, or
+ * failing that, keeps the format the image came in.
+ */
+static bool
+cache_key(const avnraster *avn, const char *path, const avnwriteopts *opts,
+	char *key)
+{
+	char options[LINE_MAX];
+	char format[LINE_MAX];
+	char history[AVNHASH_HEX_LEN];
+	unsigned char digest[AVNHASH_LEN];
+	avnhash h;
+	unsigned int i;
+
+	/* There's no file to hash for an image that came out of memory. */
+	if (avn->blob)
 		return false;
+
+	output_format(avn, path, format, sizeof(format));
+
+	/* Two writes only share an entry if everything about them matches. */
+	snprintf(options, LINE_MAX, "format=%s quality=%d sampling=%s "
+		"progressive=%d png-level=%d png-filter=%d webp-method=%d", format,
+		opts->quality, opts->sampling, opts->progressive, opts->png_level,
+		opts->png_filter, opts->webp_method);
+
+	/*
+	 * Not the JSON, which rounds doubles, and would give a hit for a
+	 * history that's only nearly the same.
+	 */
+	avnhash_init(&h);
+	for (i = 0; i < avn->history.nops; i++)
+		avnop_hash(&h, avn->history.ops[i]);
+	avnhash_final(&h, digest);
+	avnhash_hex(digest, history);
+
+	return avncache_key(avn->info.path, history, options, key);
 }
 
 
@@ -260,16 +2025,55 @@ avnraster_write(avnraster *avn, const char *path)
 char *
 avnraster_history_json(const avnraster *avn)
 {
-	int i;
-	cJSON *history_ary;
-	char *str;
+	return avnplan_to_json(&avn->history);
+}
 
-	history_ary = cJSON_CreateArray();
 
-	for (i = 0; i < avn->nops; i++)
-		cJSON_AddItemToArray(history_ary, avnop_to_json(avn->ops[i]));
+/*
+ * Serializes the history along with the profile of the last render. It
+ * needs to be freed.
+ *
+ * Example:
+ *
+ *     {"path":"in.jpg","history":[{"name":"gamma","args":[1.2]}],
+ *      "resumed":0,"profile":[{"name":"gamma","ops":1,"wall_ms":8.1,
+ *      "cpu_ms":30.9,"pixels":1000000,"peak_rss_delta_kb":0}]}
+ */
+char *
+avnraster_profile_json(const avnraster *avn)
+{
+	const struct avnprofile *prof;
+	cJSON *json, *ary, *step;
+	unsigned int i;
+	char *str;
+
+	json = cJSON_CreateObject();
+	cJSON_AddStringToObject(json, "path", avn->info.path);
+
+	ary = cJSON_CreateArray();
+	for (i = 0; i < avn->history.nops; i++)
+		cJSON_AddItemToArray(ary, avnop_to_json(avn->history.ops[i]));
+	cJSON_AddItemToObject(json, "history", ary);
+
+	cJSON_AddNumberToObject(json, "resumed", avn->resumed);
+
+	ary = cJSON_CreateArray();
+	for (i = 0; i < avn->nprofile; i++) {
+		prof = &avn->profile[i];
+		step = cJSON_CreateObject();
+		cJSON_AddStringToObject(step, "name", prof->name);
+		cJSON_AddNumberToObject(step, "ops", prof->nops);
+		cJSON_AddNumberToObject(step, "wall_ms", prof->wall_ms);
+		cJSON_AddNumberToObject(step, "cpu_ms", prof->cpu_ms);
+		cJSON_AddNumberToObject(step, "pixels", prof->pixels);
+		cJSON_AddNumberToObject(step, "peak_rss_delta_kb",
+			prof->peak_rss_delta_kb);
+		cJSON_AddItemToArray(ary, step);
+	}
+	cJSON_AddItemToObject(json, "profile", ary);
 
-	str = cJSON_PrintUnformatted(history_ary);
+	str = cJSON_PrintUnformatted(json);
+	cJSON_Delete(json);
 
 	return str;
 }
@@ -302,16 +2106,9 @@ bool
 avnraster_border(avnraster *avn, const size_t width, const size_t height,
 	const char *color)
 {
-	struct avnop *op;
-
-	if ((op = avnop_new(RASTER_BORDER)) == NULL)
-		return false;
-
-	avnop_add_arg(op, AVN_UINT, width);
-	avnop_add_arg(op, AVN_UINT, height);
-	avnop_add_arg(op, AVN_STRING, color);
-	avnraster_add_op(avn, op);
-	return true;
+	return avnraster_add_op(avn, RASTER_BORDER, 3,
+		AVN_UINT, (unsigned int)width, AVN_UINT, (unsigned int)height,
+		AVN_STRING, color);
 }
 
 
@@ -331,14 +2128,7 @@ __avnraster_brightness(avnraster *avn, const double value)
 bool
 avnraster_brightness(avnraster *avn, const double value)
 {
-	struct avnop *op;
-
-	if ((op = avnop_new(RASTER_BRIGHTNESS)) == NULL)
-		return false;
-
-	avnop_add_arg(op, AVN_DOUBLE, value);
-	avnraster_add_op(avn, op);
-	return true;
+	return avnraster_add_op(avn, RASTER_BRIGHTNESS, 1, AVN_DOUBLE, value);
 }
 
 
@@ -358,14 +2148,7 @@ __avnraster_charcoal(avnraster *avn, const double amt)
 bool
 avnraster_charcoal(avnraster *avn, const double amt)
 {
-	struct avnop *op;
-
-	if ((op = avnop_new(RASTER_CHARCOAL)) == NULL)
-		return false;
-
-	avnop_add_arg(op, AVN_DOUBLE, amt);
-	avnraster_add_op(avn, op);
-	return true;
+	return avnraster_add_op(avn, RASTER_CHARCOAL, 1, AVN_DOUBLE, amt);
 }
 
 
@@ -388,17 +2171,9 @@ bool
 avnraster_crop(avnraster *avn, const unsigned int x, const unsigned int y,
 	const size_t width, const size_t height)
 {
-	struct avnop *op;
-
-	if ((op = avnop_new(RASTER_CROP)) == NULL)
-		return false;
-
-	avnop_add_arg(op, AVN_UINT, x);
-	avnop_add_arg(op, AVN_UINT, y);
-	avnop_add_arg(op, AVN_UINT, width);
-	avnop_add_arg(op, AVN_UINT, height);
-	avnraster_add_op(avn, op);
-	return true;
+	return avnraster_add_op(avn, RASTER_CROP, 4,
+		AVN_UINT, x, AVN_UINT, y,
+		AVN_UINT, (unsigned int)width, AVN_UINT, (unsigned int)height);
 }
 
 
@@ -415,13 +2190,7 @@ __avnraster_despeckle(avnraster *avn)
 bool
 avnraster_despeckle(avnraster *avn)
 {
-	struct avnop *op;
-
-	if ((op = avnop_new(RASTER_DESPECKLE)) == NULL)
-		return false;
-
-	avnraster_add_op(avn, op);
-	return true;
+	return avnraster_add_op(avn, RASTER_DESPECKLE, 0);
 }
 
 
@@ -438,14 +2207,7 @@ __avnraster_edge(avnraster *avn, const double amt)
 bool
 avnraster_edge(avnraster *avn, const double amt)
 {
-	struct avnop *op;
-
-	if  ((op = avnop_new(RASTER_EDGE)) == NULL)
-		return false;
-
-	avnop_add_arg(op, AVN_DOUBLE, amt);
-	avnraster_add_op(avn, op);
-	return true;
+	return avnraster_add_op(avn, RASTER_EDGE, 1, AVN_DOUBLE, amt);
 }
 
 
@@ -465,14 +2227,7 @@ __avnraster_emboss(avnraster *avn, const double amt)
 bool
 avnraster_emboss(avnraster *avn, const double amt)
 {
-	struct avnop *op;
-
-	if ((op = avnop_new(RASTER_EMBOSS)) == NULL)
-		return false;
-
-	avnop_add_arg(op, AVN_DOUBLE, amt);
-	avnraster_add_op(avn, op);
-	return true;
+	return avnraster_add_op(avn, RASTER_EMBOSS, 1, AVN_DOUBLE, amt);
 }
 
 
@@ -489,13 +2244,7 @@ __avnraster_equalize(avnraster *avn)
 bool
 avnraster_equalize(avnraster *avn)
 {
-	struct avnop *op;
-
-	if ((op = avnop_new(RASTER_EQUALIZE)) == NULL)
-		return false;
-
-	avnraster_add_op(avn, op);
-	return true;
+	return avnraster_add_op(avn, RASTER_EQUALIZE, 0);
 }
 
 
@@ -515,14 +2264,7 @@ __avnraster_gamma(avnraster *avn, const double gamma)
 bool
 avnraster_gamma(avnraster *avn, const double gamma)
 {
-	struct avnop *op;
-
-	if ((op = avnop_new(RASTER_GAMMA)) == NULL)
-		return false;
-
-	avnop_add_arg(op, AVN_DOUBLE, gamma);
-	avnraster_add_op(avn, op);
-	return true;
+	return avnraster_add_op(avn, RASTER_GAMMA, 1, AVN_DOUBLE, gamma);
 }
 
 
@@ -542,14 +2284,7 @@ __avnraster_gaussianblur(avnraster *avn, const double amt)
 bool
 avnraster_gaussianblur(avnraster *avn, const double amt)
 {
-	struct avnop *op;
-
-	if ((op = avnop_new(RASTER_GAUSSIANBLUR)) == NULL)
-		return false;
-
-	avnop_add_arg(op, AVN_DOUBLE, amt);
-	avnraster_add_op(avn, op);
-	return true;
+	return avnraster_add_op(avn, RASTER_GAUSSIANBLUR, 1, AVN_DOUBLE, amt);
 }
 
 
@@ -566,13 +2301,7 @@ __avnraster_horizontalflip(avnraster *avn)
 bool
 avnraster_horizontalflip(avnraster *avn)
 {
-	struct avnop *op;
-
-	if ((op = avnop_new(RASTER_HORIZONTALFLIP)) == NULL)
-		return false;
-
-	avnraster_add_op(avn, op);
-	return true;
+	return avnraster_add_op(avn, RASTER_HORIZONTALFLIP, 0);
 }
 
 
@@ -592,14 +2321,7 @@ __avnraster_hue(avnraster *avn, const double value)
 bool
 avnraster_hue(avnraster *avn, const double value)
 {
-	struct avnop *op;
-
-	if ((op = avnop_new(RASTER_HUE)) == NULL)
-		return false;
-
-	avnop_add_arg(op, AVN_DOUBLE, value);
-	avnraster_add_op(avn, op);
-	return true;
+	return avnraster_add_op(avn, RASTER_HUE, 1, AVN_DOUBLE, value);
 }
 
 
@@ -616,25 +2338,48 @@ __avnraster_implode(avnraster *avn, const double radius)
 bool
 avnraster_implode(avnraster *avn, const double radius)
 {
-	struct avnop *op;
-
-	if ((op = avnop_new(RASTER_IMPLODE)) == NULL)
-		return false;
-
-	avnop_add_arg(op, AVN_DOUBLE, radius);
-	avnraster_add_op(avn, op);
-	return true;
+	return avnraster_add_op(avn, RASTER_IMPLODE, 1, AVN_DOUBLE, radius);
 }
 
 
 /*
- * XXX
+ * The black and white points are percentages. This normally runs natively
+ * (see avnlut_levels()); GraphicsMagick wants its points in quanta.
  */
+static bool
+__avnraster_levels(avnraster *avn, const double black, const double white,
+	const double gamma)
+{
+	int ret;
+
+	ret = MagickLevelImage(avn->image, (black / 100.0) * MaxRGB, gamma,
+		(white / 100.0) * MaxRGB);
+	return ret == MagickPass ? true : false;
+}
+
+
 bool
 avnraster_levels(avnraster *avn, const double black, const double white,
 	const double gamma)
 {
-	return true;
+	return avnraster_add_op(avn, RASTER_LEVELS, 3,
+		AVN_DOUBLE, black, AVN_DOUBLE, white, AVN_DOUBLE, gamma);
+}
+
+
+/*
+ * Only ever produced by the optimizer, when it folds adjacent brightness,
+ * saturation and hue ops into a single pass. The arguments are passed
+ * straight through to MagickModulateImage().
+ */
+static bool
+__avnraster_modulate(avnraster *avn, const double brightness,
+	const double saturation, const double hue)
+{
+	int ret;
+
+	ret = MagickModulateImage(avn->image, brightness, saturation, hue);
+	return ret == MagickPass ? true : false;
 }
 
 
@@ -654,15 +2399,8 @@ __avnraster_motionblur(avnraster *avn, const double amt, const double angle)
 bool
 avnraster_motionblur(avnraster *avn, const double amt, const double angle)
 {
-	struct avnop *op;
-
-	if ((op = avnop_new(RASTER_MOTIONBLUR)) == NULL)
-		return false;
-
-	avnop_add_arg(op, AVN_DOUBLE, amt);
-	avnop_add_arg(op, AVN_DOUBLE, angle);
-	avnraster_add_op(avn, op);
-	return true;
+	return avnraster_add_op(avn, RASTER_MOTIONBLUR, 2,
+		AVN_DOUBLE, amt, AVN_DOUBLE, angle);
 }
 
 
@@ -679,13 +2417,7 @@ __avnraster_negate(avnraster *avn)
 bool
 avnraster_negate(avnraster *avn)
 {
-	struct avnop *op;
-
-	if ((op = avnop_new(RASTER_NEGATE)) == NULL)
-		return false;
-
-	avnraster_add_op(avn, op);
-	return true;
+	return avnraster_add_op(avn, RASTER_NEGATE, 0);
 }
 
 
@@ -702,13 +2434,7 @@ __avnraster_negategrays(avnraster *avn)
 bool
 avnraster_negategrays(avnraster *avn)
 {
-	struct avnop *op;
-
-	if ((op = avnop_new(RASTER_NEGATEGRAYS)) == NULL)
-		return false;
-
-	avnraster_add_op(avn, op);
-	return true;
+	return avnraster_add_op(avn, RASTER_NEGATEGRAYS, 0);
 }
 
 
@@ -725,13 +2451,7 @@ __avnraster_normalize(avnraster *avn)
 bool
 avnraster_normalize(avnraster *avn)
 {
-	struct avnop *op;
-
-	if ((op = avnop_new(RASTER_NORMALIZE)) == NULL)
-		return false;
-
-	avnraster_add_op(avn, op);
-	return true;
+	return avnraster_add_op(avn, RASTER_NORMALIZE, 0);
 }
 
 
@@ -748,14 +2468,7 @@ __avnraster_oilpaint(avnraster *avn, const double radius)
 bool
 avnraster_oilpaint(avnraster *avn, const double radius)
 {
-	struct avnop *op;
-
-	if ((op = avnop_new(RASTER_OILPAINT)) == NULL)
-		return false;
-
-	avnop_add_arg(op, AVN_DOUBLE, radius);
-	avnraster_add_op(avn, op);
-	return true;
+	return avnraster_add_op(avn, RASTER_OILPAINT, 1, AVN_DOUBLE, radius);
 }
 
 
@@ -772,48 +2485,86 @@ __avnraster_radialblur(avnraster *avn, const double angle)
 bool
 avnraster_radialblur(avnraster *avn, const double angle)
 {
-	struct avnop *op;
+	return avnraster_add_op(avn, RASTER_RADIALBLUR, 1, AVN_DOUBLE, angle);
+}
+
+
+/*
+ * Resizes with the native resampler (see resample.c). It resamples at 8
+ * bits when the image has no more than that, since the only rounding is
+ * at the very end. The pixels go back into a wand that's merely been
+ * sampled down to the new size, so that everything else about the image
+ * comes along. If the pixels can't be exported, GraphicsMagick does the
+ * work instead, with the nearest filter it has.
+ */
+static bool
+resample(avnraster *avn, const size_t width, const size_t height,
+	const char *name)
+{
+	static const FilterTypes fallbacks[] = {
+		BoxFilter, TriangleFilter, CatromFilter, LanczosFilter, LanczosFilter
+	};
+	enum avnfilter filter;
+	avnpixels src, dst;
+	bool ok;
 
-	if ((op = avnop_new(RASTER_RADIALBLUR)) == NULL)
+	if (!avnresample_filter(name, &filter))
 		return false;
 
-	avnop_add_arg(op, AVN_DOUBLE, angle);
-	avnraster_add_op(avn, op);
-	return true;
+	if ((MagickGetNumberImages(avn->image) == 1) &&
+		avnpixels_export(&src, avn->image, (avn->info.depth <= 8) ? 8 : 16,
+		avn->info.alpha ? 4 : 3)) {
+			ok = avnresample(&src, &dst, width, height, filter);
+			avnpixels_free(&src);
+
+			if (ok) {
+				ok = (MagickSampleImage(avn->image, width, height) ==
+					MagickPass) && avnpixels_import(&dst, avn->image);
+				avnpixels_free(&dst);
+				return ok;
+			}
+	}
+
+	return MagickResizeImage(avn->image, width, height, fallbacks[filter],
+		1.0) == MagickPass ? true : false;
 }
 
 
 /*
  * XXX should get the "blurry" argument in there somehow.
- *
- * XXX should the user be able to choose a filter?
  */
 static bool
-__avnraster_resize(avnraster *avn, const size_t width, const size_t height)
+__avnraster_resize(avnraster *avn, const size_t width, const size_t height,
+	const char *filter)
 {
-	int a; 
-
 	if ((width == avn->info.width) && (height == avn->info.height))
 		return true;
 
-	a = MagickResizeImage(avn->image, width, height, LanczosFilter, 0);
+	if (!resample(avn, width, height, filter))
+		return false;
 
-	return a == MagickPass ? true : false;
+	avn->info.width = width;
+	avn->info.height = height;
+	return true;
 }
 
 
+/*
+ * The filter is one of "box", "triangle", "catrom", "lanczos2" or
+ * "lanczos3", or NULL for Lanczos 3.
+ */
 bool
-avnraster_resize(avnraster *avn, const size_t width, const size_t height)
+avnraster_resize(avnraster *avn, const size_t width, const size_t height,
+	const char *filter)
 {
-	struct avnop *op;
+	enum avnfilter f;
 
-	if ((op = avnop_new(RASTER_RESIZE)) == NULL)
+	if ((filter != NULL) && !avnresample_filter(filter, &f))
 		return false;
 
-	avnop_add_arg(op, AVN_UINT, width);
-	avnop_add_arg(op, AVN_UINT, height);
-	avnraster_add_op(avn, op);
-	return true;
+	return avnraster_add_op(avn, RASTER_RESIZE, 3,
+		AVN_UINT, (unsigned int)width, AVN_UINT, (unsigned int)height,
+		AVN_STRING, (filter != NULL) ? filter : "lanczos3");
 }
 
 
@@ -834,15 +2585,8 @@ __avnraster_roll(avnraster *avn, const int x_amt, const int y_amt)
 bool
 avnraster_roll(avnraster *avn, const int x_amt, const int y_amt)
 {
-	struct avnop *op;
-
-	if ((op = avnop_new(RASTER_ROLL)) == NULL)
-		return false;
-
-	avnop_add_arg(op, AVN_INT, x_amt);
-	avnop_add_arg(op, AVN_INT, y_amt);
-	avnraster_add_op(avn, op);
-	return true;
+	return avnraster_add_op(avn, RASTER_ROLL, 2,
+		AVN_INT, x_amt, AVN_INT, y_amt);
 }
 
 
@@ -868,15 +2612,8 @@ __avnraster_rotate(avnraster *avn, const double angle, const char *bgcolor)
 bool
 avnraster_rotate(avnraster *avn, const double angle, const char *bgcolor)
 {
-	struct avnop *op;
-
-	if ((op = avnop_new(RASTER_ROTATE)) == NULL)
-		return false;
-
-	avnop_add_arg(op, AVN_DOUBLE, angle);
-	avnop_add_arg(op, AVN_STRING, bgcolor);
-	avnraster_add_op(avn, op);
-	return true;
+	return avnraster_add_op(avn, RASTER_ROTATE, 2,
+		AVN_DOUBLE, angle, AVN_STRING, bgcolor);
 }
 
 
@@ -896,19 +2633,12 @@ __avnraster_saturation(avnraster *avn, const double value)
 bool
 avnraster_saturation(avnraster *avn, const double value)
 {
-	struct avnop *op;
-
-	if ((op = avnop_new(RASTER_SATURATION)) == NULL)
-		return false;
-
-	avnop_add_arg(op, AVN_DOUBLE, value);
-	avnraster_add_op(avn, op);
-	return true;
+	return avnraster_add_op(avn, RASTER_SATURATION, 1, AVN_DOUBLE, value);
 }
 
 
 static bool
-__avnraster_scale(avnraster *avn, const double factor)
+__avnraster_scale(avnraster *avn, const double factor, const char *filter)
 {
 	unsigned long new_w, new_h;
 
@@ -918,24 +2648,24 @@ __avnraster_scale(avnraster *avn, const double factor)
 	new_w = (avn->info.width *= factor);
 	new_h = (avn->info.height *= factor);
 
-	if (MagickScaleImage(avn->image, new_w, new_h) == MagickPass)
-		return true;
-	else
-		return false;
+	return resample(avn, new_w, new_h, filter);
 }
 
 
+/*
+ * Same filters as avnraster_resize(), but NULL means a box, which
+ * averages the same way GraphicsMagick's own scaling does.
+ */
 bool
-avnraster_scale(avnraster *avn, const double factor)
+avnraster_scale(avnraster *avn, const double factor, const char *filter)
 {
-	struct avnop *op;
+	enum avnfilter f;
 
-	if ((op = avnop_new(RASTER_SCALE)) == NULL)
+	if ((filter != NULL) && !avnresample_filter(filter, &f))
 		return false;
 
-	avnop_add_arg(op, AVN_DOUBLE, factor);
-	avnraster_add_op(avn, op);
-	return true;
+	return avnraster_add_op(avn, RASTER_SCALE, 2, AVN_DOUBLE, factor,
+		AVN_STRING, (filter != NULL) ? filter : "box");
 }
 
 
@@ -955,14 +2685,7 @@ __avnraster_sharpen(avnraster *avn, const double amt)
 bool
 avnraster_sharpen(avnraster *avn, const double amt)
 {
-	struct avnop *op;
-
-	if ((op = avnop_new(RASTER_SHARPEN)) == NULL)
-		return false;
-
-	avnop_add_arg(op, AVN_DOUBLE, amt);
-	avnraster_add_op(avn, op);
-	return true;
+	return avnraster_add_op(avn, RASTER_SHARPEN, 1, AVN_DOUBLE, amt);
 }
 
 
@@ -982,38 +2705,48 @@ __avnraster_swirl(avnraster *avn, const double degrees)
 bool
 avnraster_swirl(avnraster *avn, const double degrees)
 {
-	struct avnop *op;
-
-	if ((op = avnop_new(RASTER_SWIRL)) == NULL)
-		return false;
-
-	avnop_add_arg(op, AVN_DOUBLE, degrees);
-	avnraster_add_op(avn, op);
-	return true;
+	return avnraster_add_op(avn, RASTER_SWIRL, 1, AVN_DOUBLE, degrees);
 }
 
 
 /*
- * XXX doesn't work??
+ * This normally runs natively (see avnlut_tint()). MagickColorizeImage()
+ * takes its opacity as the red, green and blue of a second pixel wand,
+ * which is why handing it the color twice never did anything useful.
  */
-bool
-avnraster_tint(avnraster *avn, const char *color, const double opacity)
+static bool
+__avnraster_tint(avnraster *avn, const char *color, const double opacity)
 {
-	PixelWand *colorw;
+	PixelWand *colorw, *opacityw;
 	int ret;
 
 	if ((colorw = pixel_wand_with_color(color)) == NULL)
 		return false;
 
-	PixelSetOpacity(colorw, opacity);
-	//ret = MagickTintImage(avn->image, colorw, colorw);
-	ret = MagickColorizeImage(avn->image, colorw, colorw);
+	if ((opacityw = NewPixelWand()) == NULL) {
+		DestroyPixelWand(colorw);
+		return false;
+	}
+
+	PixelSetRed(opacityw, opacity);
+	PixelSetGreen(opacityw, opacity);
+	PixelSetBlue(opacityw, opacity);
+	ret = MagickColorizeImage(avn->image, colorw, opacityw);
 
+	DestroyPixelWand(opacityw);
 	DestroyPixelWand(colorw);
 	return ret == MagickPass ? true : false;
 }
 
 
+bool
+avnraster_tint(avnraster *avn, const char *color, const double opacity)
+{
+	return avnraster_add_op(avn, RASTER_TINT, 2,
+		AVN_STRING, color, AVN_DOUBLE, opacity);
+}
+
+
 static bool
 __avnraster_verticalflip(avnraster *avn)
 {
@@ -1027,13 +2760,7 @@ __avnraster_verticalflip(avnraster *avn)
 bool
 avnraster_verticalflip(avnraster *avn)
 {
-	struct avnop *op;
-
-	if ((op = avnop_new(RASTER_VERTICALFLIP)) == NULL)
-		return false;
-
-	avnraster_add_op(avn, op);
-	return true;
+	return avnraster_add_op(avn, RASTER_VERTICALFLIP, 0);
 }
 
 
@@ -1057,15 +2784,8 @@ bool
 avnraster_wave(avnraster *avn, const double amplitude,
 	const double wavelength)
 {
-	struct avnop *op;
-
-	if ((op = avnop_new(RASTER_WAVE)) == NULL)
-		return false;
-
-	avnop_add_arg(op, AVN_DOUBLE, amplitude);
-	avnop_add_arg(op, AVN_DOUBLE, wavelength);
-	avnraster_add_op(avn, op);
-	return true;
+	return avnraster_add_op(avn, RASTER_WAVE, 2,
+		AVN_DOUBLE, amplitude, AVN_DOUBLE, wavelength);
 }
 
 /* */
@@ -1088,8 +2808,15 @@ pixel_wand_with_color(const char *color)
 }
 
 
+/*
+ * Counting colors means looking at every pixel, so this is the one bit of
+ * info which decodes the image.
+ */
 unsigned long
-avnraster_info_ncolors(const avnraster *avn)
+avnraster_info_ncolors(avnraster *avn)
 {
+	if (!avnraster_sync(avn) || !avnraster_decode(avn))
+		return 0;
+
 	return MagickGetImageColors(avn->image);
 }
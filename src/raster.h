@@ -15,10 +15,23 @@
 
 #include "avenida.h"
 #include "commands.h"
+#include "hash.h"
+#include "oplist.h"
 
+#define AVNRASTER_MAX_SNAPSHOTS 16
+#define AVNRASTER_SNAPSHOT_BUDGET ((size_t)256 * 1024 * 1024)
+#define AVNRASTER_PROFILE_NAME_LEN 128
+
+/*
+ * "depth" is how many bits per channel the image actually has, which may
+ * well be less than GraphicsMagick's quantum; "alpha" is whether it has an
+ * alpha channel at all.
+ */
 struct avnrasterinfo {
 	size_t width;
 	size_t height;
+	unsigned int depth;
+	bool alpha;
 	char codec[LINE_MAX];
 	char path[PATH_MAX];
 };
@@ -26,23 +39,132 @@ typedef struct avnrasterinfo avnrasterinfo;
 
 
 /*
- * The avnraster structure is a delegate for a raster graphic.
+ * A rendered image kept around so that the next render can pick up from
+ * it, along with the digest of the ops that led to it.
+ */
+struct avnsnapshot {
+	MagickWand *wand;
+	unsigned int nops;
+	unsigned char digest[AVNHASH_LEN];
+	size_t width;
+	size_t height;
+	size_t bytes;
+	unsigned long lastuse;
+};
+
+
+/*
+ * Encoder options for avnraster_write(). Anything left at -1, or empty in
+ * the case of the sampling, is up to GraphicsMagick; formats just ignore
+ * the options that don't apply to them.
+ */
+struct avnwriteopts {
+	int quality;
+	char sampling[8];
+	int progressive;
+	int png_level;
+	int png_filter;
+	int webp_method;
+};
+typedef struct avnwriteopts avnwriteopts;
+
+/* The PNG filters, in the order GraphicsMagick numbers them. */
+enum avnpngfilter {
+	AVNPNG_NONE,
+	AVNPNG_SUB,
+	AVNPNG_UP,
+	AVNPNG_AVERAGE,
+	AVNPNG_PAETH,
+	AVNPNG_ADAPTIVE,
+};
+
+
+/*
+ * What one step of the last render cost. A step is usually a single op of
+ * the plan, but a run of ops with native kernels is done in one pass over
+ * the pixels and so is timed as one, with their names joined by "+". CPU
+ * time counts every thread, so it can be more than the wall time. The
+ * memory is how much the process's peak RSS went up, so it's only
+ * nonzero for a step that set a new high.
+ */
+struct avnprofile {
+	char name[AVNRASTER_PROFILE_NAME_LEN];
+	unsigned int nops;
+	double wall_ms;
+	double cpu_ms;
+	size_t pixels;
+	long peak_rss_delta_kb;
+};
+
+
+/*
+ * The avnraster structure is a delegate for a raster graphic. Opening it
+ * only reads the header; "source" holds the decoded pixels once something
+ * needs them, and is never drawn on. "image" is the result of rendering
+ * the first "nrendered" ops, and may be shared with the source or with a
+ * snapshot, in which case it isn't "image_owned".
+ *
+ * With the render cache on, rendering is put off until the result is
+ * actually needed, since it may turn out to be in the cache already;
+ * "deferred" is set in the meantime.
+ *
+ * "profile" has what each step of the last render cost, and "resumed" is
+ * how many ops it got for free from a snapshot.
+ *
+ * A raster read from memory has no file to go back to, so its source is
+ * decoded up front and kept; "blob" is set for those.
  */
 struct avnraster {
 	MagickWand *image;
+	bool image_owned;
+	MagickWand *source;
+	bool blob;
+	size_t source_width;
+	size_t source_height;
+	size_t source_hint_width;
+	size_t source_hint_height;
+	struct avnsnapshot snapshots[AVNRASTER_MAX_SNAPSHOTS];
+	unsigned int nsnapshots;
+	unsigned long clock;
+	unsigned int nrendered;
+	bool deferred;
+	bool deferred_verbose;
+	unsigned int deferred_nops;
+	struct avnprofile *profile;
+	unsigned int nprofile;
+	unsigned int profile_capacity;
+	unsigned int resumed;
 	avnrasterinfo info;
-	unsigned int nops;
-	struct avnop *ops[AVNMEDIA_MAX_OPS];
+	avnoplist history;
 };
 typedef struct avnraster avnraster;
 
 avnraster *avnraster_new(const char *path);
+avnraster *avnraster_new_with_wand(const char *name, MagickWand *);
 void avnraster_free(avnraster *);
-inline void avnraster_add_op(avnraster *, const struct avnop *);
+size_t avnraster_footprint(const avnraster *);
+bool avnraster_add_op(avnraster *, const enum avncmdname,
+	const unsigned int nargs, ...);
 bool avnraster_open(avnraster *);
+bool avnraster_open_blob(avnraster *, const void *data, const size_t len);
+bool avnraster_decode(avnraster *);
 bool avnraster_render(avnraster *, const bool verbose);
-bool avnraster_write(avnraster *, const char *path);
+bool avnraster_sync(avnraster *);
+bool avnraster_apply_op(avnraster *, const struct avnop *);
+bool avnraster_apply_plan(avnraster *, struct avnop * const *,
+	const unsigned int nops, const bool verbose);
+long avnraster_halo(const struct avnop *);
+void avnraster_set_snapshot_budget(const size_t bytes);
+size_t avnraster_snapshot_budget(void);
+void avnraster_set_profiling(const bool);
+void avnwriteopts_init(avnwriteopts *);
+bool avnwriteopts_preset(avnwriteopts *, const char *name);
+bool avnraster_write(avnraster *, const char *path, const avnwriteopts *);
+unsigned char *avnraster_write_blob(avnraster *, const char *format,
+	const avnwriteopts *, size_t *len);
+void avnraster_free_blob(unsigned char *);
 char *avnraster_history_json(const avnraster *);
+char *avnraster_profile_json(const avnraster *);
 
 bool avnraster_border(avnraster *, const size_t width, const size_t height,
 	const char *color);
@@ -69,11 +191,12 @@ bool avnraster_normalize(avnraster *);
 bool avnraster_oilpaint(avnraster *, const double radius);
 /* XXX radialblur doesn't work? */
 bool avnraster_radialblur(avnraster *, const double angle); 
-bool avnraster_resize(avnraster *, const size_t width, const size_t height);
+bool avnraster_resize(avnraster *, const size_t width, const size_t height,
+	const char *filter);
 bool avnraster_roll(avnraster *, const int x_amt, const int y_amt);
 bool avnraster_rotate(avnraster *, const double angle, const char *bgcolor);
 bool avnraster_saturation(avnraster *, const double value);
-bool avnraster_scale(avnraster *, const double factor);
+bool avnraster_scale(avnraster *, const double factor, const char *filter);
 bool avnraster_sharpen(avnraster *, const double amt);
 bool avnraster_swirl(avnraster *, const double degrees);
 bool avnraster_tint(avnraster *, const char *color, const double opacity);
@@ -81,6 +204,6 @@ bool avnraster_verticalflip(avnraster *);
 bool avnraster_wave(avnraster *, const double amplitude,
 	const double wavelength);
 
-unsigned long avnraster_info_ncolors(const avnraster *);
+unsigned long avnraster_info_ncolors(avnraster *);
 
 #endif /* AVENIDA_RASTER_H */
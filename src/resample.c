@@ -0,0 +1,405 @@
+/*
+ * vim: noet
+ *
+ * resample.c
+ * Christian Koch <cfkoch@sdf.lonestar.org>
+ *
+ * A two pass resampler: each row is resampled to the new width, and then
+ * each column of that to the new height. The weights each output sample
+ * gives to its source samples only depend on the position, so they're
+ * worked out once per axis up front, and kept in fixed point.
+ *
+ * Between the passes, the samples are kept as 32 bit integers with 16 bits
+ * of precision, so an 8 bit image keeps 8 bits of fraction and the only
+ * rounding that shows is the final one. The vertical pass works on whole
+ * rows at a time, so its inner loop is a multiply-add along contiguous
+ * memory, which the compiler vectorizes. Both passes are split up into
+ * bands of rows across the tile threads.
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pixelcache.h"
+#include "pixels.h"
+#include "resample.h"
+#include "tiles.h"
+
+#define ONE (1 << AVNRESAMPLE_WEIGHT_BITS)
+
+/*
+ * For each output sample: the first source sample it looks at, how many
+ * it looks at, and their weights, which add up to exactly ONE.
+ */
+struct taps {
+	size_t *start;
+	unsigned int *count;
+	int32_t *weights;
+	unsigned int stride;
+};
+
+struct resamplejob {
+	const avnpixels *src;
+	avnpixels *dst;
+	const struct taps *horizontal;
+	const struct taps *vertical;
+	int32_t *mid;
+	size_t mid_stride;
+};
+
+static const char *filter_names[] = {
+	"box", "triangle", "catrom", "lanczos2", "lanczos3", NULL
+};
+
+static double filter_support(const enum avnfilter);
+static double filter_weight(const enum avnfilter, const double);
+static double sinc(const double);
+static bool taps_new(struct taps *, const size_t in, const size_t out,
+	const enum avnfilter);
+static void taps_free(struct taps *);
+static bool horizontal_band(void *, const unsigned int);
+static bool vertical_band(void *, const unsigned int);
+
+bool
+avnresample_filter(const char *name, enum avnfilter *filter)
+{
+	int i;
+
+	for (i = 0; filter_names[i] != NULL; i++) {
+		if (!strcmp(name, filter_names[i])) {
+			*filter = (enum avnfilter)i;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+const char *
+avnresample_filter_name(const enum avnfilter filter)
+{
+	return filter_names[filter];
+}
+
+
+/*
+ * Resamples src into a newly allocated dst of the given size, with the
+ * same layout. The caller frees dst with avnpixels_free().
+ */
+bool
+avnresample(const avnpixels *src, avnpixels *dst, const size_t width,
+	const size_t height, const enum avnfilter filter)
+{
+	struct taps horizontal, vertical;
+	struct resamplejob job;
+	int32_t *mid;
+	size_t mid_size;
+	bool mid_mapped, ok;
+
+	if ((width == 0) || (height == 0))
+		return false;
+
+	*dst = *src;
+	dst->width = width;
+	dst->height = height;
+	dst->stride = width * src->channels * (src->depth / 8);
+
+	if (!taps_new(&horizontal, src->width, width, filter))
+		return false;
+
+	if (!taps_new(&vertical, src->height, height, filter)) {
+		taps_free(&horizontal);
+		return false;
+	}
+
+	job.mid_stride = width * src->channels;
+	mid_size = job.mid_stride * src->height * sizeof(int32_t);
+	mid = avnpixelcache_alloc(mid_size, &mid_mapped);
+	dst->data = avnpixelcache_alloc(dst->stride * height, &dst->mapped);
+
+	if ((mid == NULL) || (dst->data == NULL)) {
+		avnpixelcache_free(mid, mid_size, mid_mapped);
+		avnpixels_free(dst);
+		taps_free(&horizontal);
+		taps_free(&vertical);
+		return false;
+	}
+
+	job.src = src;
+	job.dst = dst;
+	job.horizontal = &horizontal;
+	job.vertical = &vertical;
+	job.mid = mid;
+
+	ok = avntiles_run((src->height + AVNRESAMPLE_BAND_ROWS - 1) /
+		AVNRESAMPLE_BAND_ROWS, horizontal_band, &job) &&
+		avntiles_run((height + AVNRESAMPLE_BAND_ROWS - 1) /
+		AVNRESAMPLE_BAND_ROWS, vertical_band, &job);
+
+	avnpixelcache_free(mid, mid_size, mid_mapped);
+	taps_free(&horizontal);
+	taps_free(&vertical);
+
+	if (!ok)
+		avnpixels_free(dst);
+
+	return ok;
+}
+
+/* */
+
+static double
+filter_support(const enum avnfilter filter)
+{
+	switch (filter) {
+	case AVNFILTER_BOX:
+		return 0.5;
+	case AVNFILTER_TRIANGLE:
+		return 1.0;
+	case AVNFILTER_CATROM: /* FALLTHROUGH */
+	case AVNFILTER_LANCZOS2:
+		return 2.0;
+	default:
+		return 3.0;
+	}
+}
+
+
+static double
+filter_weight(const enum avnfilter filter, const double x)
+{
+	const double ax = fabs(x);
+
+	switch (filter) {
+	case AVNFILTER_BOX:
+		return ((x >= -0.5) && (x < 0.5)) ? 1.0 : 0.0;
+	case AVNFILTER_TRIANGLE:
+		return (ax < 1.0) ? 1.0 - ax : 0.0;
+	case AVNFILTER_CATROM:
+		if (ax < 1.0)
+			return (1.5 * ax - 2.5) * ax * ax + 1.0;
+		if (ax < 2.0)
+			return ((-0.5 * ax + 2.5) * ax - 4.0) * ax + 2.0;
+		return 0.0;
+	case AVNFILTER_LANCZOS2:
+		return (ax < 2.0) ? sinc(x) * sinc(x / 2.0) : 0.0;
+	default:
+		return (ax < 3.0) ? sinc(x) * sinc(x / 3.0) : 0.0;
+	}
+}
+
+
+static double
+sinc(const double x)
+{
+	if (x == 0.0)
+		return 1.0;
+
+	return sin(M_PI * x) / (M_PI * x);
+}
+
+
+/*
+ * When shrinking, the filter is stretched out to cover every source sample
+ * that ends up in an output one. Near the edges, the weights that are left
+ * get scaled back up to one. Whatever rounding error there is goes to the
+ * biggest weight, so that a flat image stays exactly flat.
+ */
+static bool
+taps_new(struct taps *taps, const size_t in, const size_t out,
+	const enum avnfilter filter)
+{
+	double scale, stretch, support, center, total, *w;
+	long lo, hi, j;
+	unsigned int k, n, biggest;
+	int32_t sum, *weights;
+	size_t i;
+
+	scale = (double)in / out;
+	stretch = (scale > 1.0) ? scale : 1.0;
+	support = filter_support(filter) * stretch;
+
+	taps->stride = (unsigned int)ceil(2.0 * support) + 2;
+	taps->start = malloc(out * sizeof(size_t));
+	taps->count = malloc(out * sizeof(unsigned int));
+	taps->weights = malloc(out * taps->stride * sizeof(int32_t));
+	w = malloc(taps->stride * sizeof(double));
+
+	if ((taps->start == NULL) || (taps->count == NULL) ||
+		(taps->weights == NULL) || (w == NULL)) {
+			taps_free(taps);
+			free(w);
+			return false;
+	}
+
+	for (i = 0; i < out; i++) {
+		center = (i + 0.5) * scale;
+		lo = (long)floor(center - support);
+		hi = (long)ceil(center + support);
+		if (lo < 0)
+			lo = 0;
+		if (hi > (long)in)
+			hi = in;
+		if (hi - lo > (long)taps->stride)
+			hi = lo + taps->stride;
+
+		total = 0.0;
+		for (j = lo; j < hi; j++) {
+			w[j - lo] = filter_weight(filter, (j + 0.5 - center) / stretch);
+			total += w[j - lo];
+		}
+
+		/* Upsampling with a box can fall right between two samples. */
+		if (total == 0.0) {
+			lo = (long)floor(center);
+			if (lo >= (long)in)
+				lo = in - 1;
+			hi = lo + 1;
+			w[0] = total = 1.0;
+		}
+
+		n = (unsigned int)(hi - lo);
+		weights = taps->weights + i * taps->stride;
+		sum = 0;
+		biggest = 0;
+
+		for (k = 0; k < n; k++) {
+			weights[k] = (int32_t)lround(w[k] / total * ONE);
+			sum += weights[k];
+			if (weights[k] > weights[biggest])
+				biggest = k;
+		}
+
+		weights[biggest] += ONE - sum;
+		taps->start[i] = (size_t)lo;
+		taps->count[i] = n;
+	}
+
+	free(w);
+	return true;
+}
+
+
+static void
+taps_free(struct taps *taps)
+{
+	free(taps->start);
+	free(taps->count);
+	free(taps->weights);
+}
+
+
+/*
+ * Resamples a band of source rows to the new width, into the middle
+ * buffer, with 16 bits of precision whatever the depth.
+ */
+static bool
+horizontal_band(void *arg, const unsigned int task)
+{
+	struct resamplejob *job = arg;
+	const avnpixels *src = job->src;
+	const struct taps *taps = job->horizontal;
+	const unsigned int ch = src->channels;
+	const int shift = AVNRESAMPLE_WEIGHT_BITS - (16 - src->depth);
+	const int32_t half = 1 << (shift - 1);
+	const int32_t *weights;
+	const uint8_t *p8;
+	const uint16_t *p16;
+	int32_t *out, acc[4];
+	size_t x, y, last, s;
+	unsigned int c, k;
+
+	y = task * AVNRESAMPLE_BAND_ROWS;
+	last = (y + AVNRESAMPLE_BAND_ROWS > src->height) ? src->height :
+		y + AVNRESAMPLE_BAND_ROWS;
+
+	for (; y < last; y++) {
+		p8 = avnpixels_row(src, y);
+		p16 = (const uint16_t *)p8;
+		out = job->mid + y * job->mid_stride;
+
+		for (x = 0; x < job->dst->width; x++) {
+			weights = taps->weights + x * taps->stride;
+			s = taps->start[x] * ch;
+
+			for (c = 0; c < ch; c++)
+				acc[c] = 0;
+
+			if (src->depth == 8) {
+				for (k = 0; k < taps->count[x]; k++, s += ch) {
+					for (c = 0; c < ch; c++)
+						acc[c] += weights[k] * p8[s + c];
+				}
+			} else {
+				for (k = 0; k < taps->count[x]; k++, s += ch) {
+					for (c = 0; c < ch; c++)
+						acc[c] += weights[k] * p16[s + c];
+				}
+			}
+
+			for (c = 0; c < ch; c++)
+				out[x * ch + c] = (acc[c] + half) >> shift;
+		}
+	}
+
+	return true;
+}
+
+
+static bool
+vertical_band(void *arg, const unsigned int task)
+{
+	struct resamplejob *job = arg;
+	avnpixels *dst = job->dst;
+	const struct taps *taps = job->vertical;
+	const size_t n = job->mid_stride;
+	const int shift = AVNRESAMPLE_WEIGHT_BITS + (16 - dst->depth);
+	const int32_t half = 1 << (shift - 1);
+	const int32_t max = (dst->depth == 8) ? 255 : 65535;
+	const int32_t *weights, *row;
+	int32_t *acc, v, w;
+	uint8_t *p8;
+	uint16_t *p16;
+	size_t i, y, last;
+	unsigned int k;
+
+	if ((acc = malloc(n * sizeof(int32_t))) == NULL)
+		return false;
+
+	y = task * AVNRESAMPLE_BAND_ROWS;
+	last = (y + AVNRESAMPLE_BAND_ROWS > dst->height) ? dst->height :
+		y + AVNRESAMPLE_BAND_ROWS;
+
+	for (; y < last; y++) {
+		weights = taps->weights + y * taps->stride;
+
+		for (i = 0; i < n; i++)
+			acc[i] = half;
+
+		for (k = 0; k < taps->count[y]; k++) {
+			row = job->mid + (taps->start[y] + k) * n;
+			w = weights[k];
+			for (i = 0; i < n; i++)
+				acc[i] += w * row[i];
+		}
+
+		p8 = avnpixels_row(dst, y);
+		p16 = (uint16_t *)p8;
+
+		for (i = 0; i < n; i++) {
+			v = acc[i] >> shift;
+			v = (v < 0) ? 0 : ((v > max) ? max : v);
+			if (dst->depth == 8)
+				p8[i] = (uint8_t)v;
+			else
+				p16[i] = (uint16_t)v;
+		}
+	}
+
+	free(acc);
+	return true;
+}
@@ -0,0 +1,33 @@
+/*
+ * vim: noet
+ *
+ * resample.h
+ * Christian Koch <cfkoch@sdf.lonestar.org>
+ */
+
+#ifndef AVENIDA_RESAMPLE_H
+#define AVENIDA_RESAMPLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "pixels.h"
+
+/* Weights are fixed point, with this many fractional bits. */
+#define AVNRESAMPLE_WEIGHT_BITS 12
+#define AVNRESAMPLE_BAND_ROWS 16
+
+enum avnfilter {
+	AVNFILTER_BOX,
+	AVNFILTER_TRIANGLE,
+	AVNFILTER_CATROM,
+	AVNFILTER_LANCZOS2,
+	AVNFILTER_LANCZOS3,
+};
+
+bool avnresample_filter(const char *name, enum avnfilter *);
+const char *avnresample_filter_name(const enum avnfilter);
+bool avnresample(const avnpixels *src, avnpixels *dst, const size_t width,
+	const size_t height, const enum avnfilter);
+
+#endif /* AVENIDA_RESAMPLE_H */
@@ -5,14 +5,15 @@
  * Christian Koch <cfkoch@sdf.lonestar.org>
  */
 
-#include <err.h>
 #include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 #include <lua.h>
 #include <lualib.h>
 #include <lauxlib.h>
 
+#include "bytecode.h"
 #include "script.h"
 #include "avnscript-raster.h"
 #include "avnscript-vector.h"
@@ -32,6 +33,9 @@ avnscript_new(const char *path)
 
 	avn->L = L;
 	snprintf(avn->path, PATH_MAX, "%s", path);
+	avn->argc = 0;
+	avn->argv = NULL;
+	avn->error[0] = '\0';
 	return avn;
 
 cleanup:
@@ -68,16 +72,47 @@ avnscript_setup(avnscript *avn)
 
 
 /*
- * luaL_dofile() returns true on error, but avnscript_execute returns true
- * on success.
+ * The argv array isn't copied, so it has to outlive the avnscript.
+ */
+void
+avnscript_setargs(avnscript *avn, int argc, char *argv[])
+{
+	avn->argc = argc;
+	avn->argv = argv;
+}
+
+
+/*
+ * Returns true on success. On failure, the message is copied into
+ * avn->error and it's up to the caller to report it; in batch mode it
+ * belongs in the report rather than on stderr.
  */
 bool
 avnscript_execute(avnscript *avn)
 {
-	if (luaL_dofile(avn->L, avn->path)) {
-		warnx("%s", luaL_tolstring(avn->L, -1, NULL));
-		return false;
-	} else {
-		return true;
+	lua_State *L = avn->L;
+	int i;
+
+	avn->error[0] = '\0';
+
+	lua_createtable(L, avn->argc, 1);
+	lua_pushstring(L, avn->path);
+	lua_rawseti(L, -2, 0);
+	for (i = 0; i < avn->argc; i++) {
+		lua_pushstring(L, avn->argv[i]);
+		lua_rawseti(L, -2, i + 1);
 	}
+	lua_setglobal(L, "arg");
+
+	if (avnbytecode_loadfile(L, avn->path) == LUA_OK) {
+		for (i = 0; i < avn->argc; i++)
+			lua_pushstring(L, avn->argv[i]);
+		if (lua_pcall(L, avn->argc, 0, 0) == LUA_OK)
+			return true;
+	}
+
+	snprintf(avn->error, sizeof(avn->error), "%s",
+		luaL_tolstring(L, -1, NULL));
+	lua_pop(L, 2);
+	return false;
 }
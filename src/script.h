@@ -15,17 +15,23 @@
 
 /*
  * The avnscript structure represents a file with Avenida commands and a
- * means to interpret it.
+ * means to interpret it. The arguments are handed to the script both as
+ * the chunk's varargs and as the global "arg" table, like lua(1) does. If
+ * the script fails, the error message is left in "error".
  */
 struct avnscript {
 	lua_State *L;
 	char path[PATH_MAX];
+	int argc;
+	char **argv;
+	char error[LINE_MAX];
 };
 typedef struct avnscript avnscript;
 
 avnscript *avnscript_new(const char *path);
 void avnscript_free(avnscript *avn);
 void avnscript_setup(avnscript *avn);
+void avnscript_setargs(avnscript *avn, int argc, char *argv[]);
 bool avnscript_execute(avnscript *avn);
 
 #endif /* AVENIDA_SCRIPT_H */
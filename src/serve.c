@@ -0,0 +1,526 @@
+/*
+ * vim: noet
+ *
+ * serve.c
+ * Christian Koch <cfkoch@sdf.lonestar.org>
+ *
+ * Server mode keeps a pool of forked workers waiting on a Unix domain
+ * socket, so that a job runner with lots of small scripts to run doesn't
+ * pay for starting a process and an interpreter for every one of them.
+ *
+ * Each worker accepts connections off the shared socket itself, and keeps
+ * an avnscript set up and ready for the next job. Every job still gets an
+ * interpreter of its own, just like in batch mode, but the next one is set
+ * up after the reply has gone out, while the worker would be waiting
+ * anyway. The parent only replaces workers which die.
+ *
+ * A connection carries any number of jobs, one line of JSON each:
+ *
+ *     {"script": "/path/to/script.lua", "args": ["a.jpg", "b.jpg"]}
+ *
+ * and for each one, gets a line when a worker starts on it and another
+ * when it's done:
+ *
+ *     {"event": "start", "worker": 1234}
+ *     {"event": "done", "ok": true, "wall_ms": 12.5, "cpu_ms": 11.9}
+ *
+ * with the error message in "error" if the script failed. Relative paths
+ * are relative to wherever the server was started, and whatever the
+ * scripts print goes to the server's standard output.
+ *
+ * The render cache, the pixel cache, the thread count and the snapshot
+ * budget belong to the whole process, and a script can change any of
+ * them. They're put back the way the worker started after every job, so
+ * that one client's settings never carry over to the next one's jobs.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cJSON.h"
+
+#include "cache.h"
+#include "pixelcache.h"
+#include "raster.h"
+#include "script.h"
+#include "serve.h"
+#include "tiles.h"
+#include "util.h"
+
+struct server {
+	const char *path;
+	int listener;
+	pid_t pids[AVNSERVE_MAX_WORKERS];
+	unsigned int nworkers;
+};
+
+/*
+ * Everything a script can change for the whole worker.
+ */
+struct settings {
+	struct avncachestats cache;
+	struct avnpixelcachestats pixelcache;
+	unsigned int nthreads;
+	size_t snapshot_budget;
+};
+
+static volatile sig_atomic_t stopping = 0;
+
+/* What each job in this worker starts out with. */
+static struct settings defaults;
+
+static int listen_on(const char *);
+static bool spawn(struct server *, const unsigned int slot);
+static void worker(const struct server *);
+static avnscript *warm_up(void);
+static void serve_connection(const int, avnscript **);
+static bool run_job(const int, const char *, avnscript **);
+static void settings_save(struct settings *);
+static void settings_restore(const struct settings *);
+static bool send_event(const int, cJSON *);
+static bool write_full(int, const void *, size_t);
+static void on_signal(int);
+
+/*
+ * Serves until interrupted or terminated, then stops the workers and
+ * removes the socket. Returns false if the server couldn't get going.
+ */
+bool
+avnserve_run(const char *path, const unsigned int nworkers)
+{
+	struct server srv;
+	struct sigaction sa;
+	unsigned int i;
+	int status;
+	pid_t pid;
+	bool ok = true;
+
+	memset(&srv, 0, sizeof(srv));
+	srv.path = path;
+	srv.nworkers = (nworkers > AVNSERVE_MAX_WORKERS) ? AVNSERVE_MAX_WORKERS :
+		nworkers;
+
+	if ((srv.listener = listen_on(path)) == -1)
+		return false;
+
+	fflush(NULL);
+
+	for (i = 0; i < srv.nworkers; i++) {
+		if (!spawn(&srv, i)) {
+			ok = false;
+			goto cleanup;
+		}
+	}
+
+	/* No SA_RESTART, so that a signal gets us out of waitpid(). */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	warnx("serving on %s with %u workers", path, srv.nworkers);
+
+	while (!stopping) {
+		if ((pid = waitpid(-1, &status, 0)) == -1) {
+			if (errno == EINTR)
+				continue;
+			warn("waitpid");
+			ok = false;
+			break;
+		}
+
+		for (i = 0; i < srv.nworkers; i++) {
+			if (srv.pids[i] == pid)
+				break;
+		}
+
+		if (i == srv.nworkers)
+			continue;
+
+		srv.pids[i] = 0;
+		if (WIFSIGNALED(status))
+			warnx("worker %d killed by signal %d", pid, WTERMSIG(status));
+
+		if (!stopping && !spawn(&srv, i)) {
+			ok = false;
+			break;
+		}
+	}
+
+cleanup:
+	for (i = 0; i < srv.nworkers; i++) {
+		if (srv.pids[i] > 0)
+			kill(srv.pids[i], SIGTERM);
+	}
+
+	for (i = 0; i < srv.nworkers; i++) {
+		if (srv.pids[i] > 0)
+			waitpid(srv.pids[i], NULL, 0);
+	}
+
+	close(srv.listener);
+	unlink(path);
+	return ok;
+}
+
+/* */
+
+static int
+listen_on(const char *path)
+{
+	struct sockaddr_un sun;
+	struct stat sb;
+	int fd;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		warnx("socket path \"%s\" is too long", path);
+		return -1;
+	}
+
+	strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+
+	/* Left behind by a server that didn't get to clean up. */
+	if ((stat(path, &sb) == 0) && S_ISSOCK(sb.st_mode))
+		unlink(path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		warn("socket");
+		return -1;
+	}
+
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+		warn("bind %s", path);
+		close(fd);
+		return -1;
+	}
+
+	if (listen(fd, AVNSERVE_BACKLOG) == -1) {
+		warn("listen");
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+static bool
+spawn(struct server *srv, const unsigned int slot)
+{
+	pid_t pid;
+
+	switch (pid = fork()) {
+	case -1:
+		warn("fork");
+		return false;
+	case 0:
+		signal(SIGINT, SIG_DFL);
+		signal(SIGTERM, SIG_DFL);
+
+		/* A client that hangs up early shouldn't take the worker along. */
+		signal(SIGPIPE, SIG_IGN);
+
+		worker(srv);
+		fflush(NULL);
+		_exit(EXIT_SUCCESS);
+	default:
+		srv->pids[slot] = pid;
+		return true;
+	}
+}
+
+
+static void
+worker(const struct server *srv)
+{
+	avnscript *warm;
+	int fd;
+
+	warm = warm_up();
+	settings_save(&defaults);
+
+	for (;;) {
+		if ((fd = accept(srv->listener, NULL, NULL)) == -1) {
+			if ((errno == EINTR) || (errno == ECONNABORTED))
+				continue;
+			warn("accept");
+			break;
+		}
+
+		serve_connection(fd, &warm);
+		close(fd);
+	}
+
+	avnscript_free(warm);
+}
+
+
+/*
+ * An interpreter with everything loaded, that only needs a script.
+ */
+static avnscript *
+warm_up(void)
+{
+	avnscript *avn;
+
+	if ((avn = avnscript_new("")) != NULL)
+		avnscript_setup(avn);
+
+	return avn;
+}
+
+
+/*
+ * Runs every job on the connection, in order, until the client hangs up.
+ */
+static void
+serve_connection(const int fd, avnscript **warm)
+{
+	char buf[AVNSERVE_MAX_REQUEST];
+	char *line, *nl;
+	size_t len = 0;
+	ssize_t n;
+	cJSON *ev;
+
+	for (;;) {
+		if ((n = read(fd, buf + len, sizeof(buf) - 1 - len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return;
+		} else if (n == 0) {
+			return;
+		}
+
+		len += n;
+		buf[len] = '\0';
+		line = buf;
+
+		while ((nl = strchr(line, '\n')) != NULL) {
+			*nl = '\0';
+			if ((*line != '\0') && !run_job(fd, line, warm))
+				return;
+			line = nl + 1;
+		}
+
+		len -= line - buf;
+		memmove(buf, line, len);
+
+		if (len == sizeof(buf) - 1) {
+			ev = cJSON_CreateObject();
+			cJSON_AddStringToObject(ev, "event", "done");
+			cJSON_AddFalseToObject(ev, "ok");
+			cJSON_AddStringToObject(ev, "error", "request too long");
+			send_event(fd, ev);
+			return;
+		}
+	}
+}
+
+
+/*
+ * Returns false if the client can't be written to any more.
+ */
+static bool
+run_job(const int fd, const char *line, avnscript **warm)
+{
+	char *argv[AVNSERVE_MAX_ARGS];
+	cJSON *req, *script, *args, *item, *ev;
+	avnscript *avn = NULL;
+	const char *error = NULL;
+	double wall, cpu;
+	int i, argc = 0;
+	bool ok = false;
+
+	wall = avnutil_clock_ms(CLOCK_MONOTONIC);
+	cpu = avnutil_clock_ms(CLOCK_PROCESS_CPUTIME_ID);
+
+	if ((req = cJSON_Parse(line)) == NULL) {
+		error = "request isn't JSON";
+		goto reply;
+	}
+
+	script = cJSON_GetObjectItem(req, "script");
+	if ((script == NULL) || (script->type != cJSON_String)) {
+		error = "request has no \"script\"";
+		goto reply;
+	}
+
+	if ((args = cJSON_GetObjectItem(req, "args")) != NULL) {
+		if ((args->type != cJSON_Array) ||
+			(cJSON_GetArraySize(args) > AVNSERVE_MAX_ARGS)) {
+				error = "\"args\" isn't an array of at most 256 strings";
+				goto reply;
+		}
+
+		for (i = 0; i < cJSON_GetArraySize(args); i++) {
+			item = cJSON_GetArrayItem(args, i);
+			if (item->type != cJSON_String) {
+				error = "\"args\" isn't an array of at most 256 strings";
+				goto reply;
+			}
+			argv[argc++] = item->valuestring;
+		}
+	}
+
+	/* If getting the spare ready failed last time, this is another go. */
+	if ((avn = *warm) == NULL)
+		avn = warm_up();
+	*warm = NULL;
+
+	if (avn == NULL) {
+		error = "couldn't create struct avnscript";
+		goto reply;
+	}
+
+	ev = cJSON_CreateObject();
+	cJSON_AddStringToObject(ev, "event", "start");
+	cJSON_AddNumberToObject(ev, "worker", getpid());
+	if (!send_event(fd, ev)) {
+		avnscript_free(avn);
+		cJSON_Delete(req);
+		*warm = warm_up();
+		return false;
+	}
+
+	snprintf(avn->path, sizeof(avn->path), "%s", script->valuestring);
+	avnscript_setargs(avn, argc, argv);
+
+	ok = avnscript_execute(avn);
+	fflush(NULL);
+	settings_restore(&defaults);
+
+	if (!ok)
+		error = avn->error;
+
+reply:
+	ev = cJSON_CreateObject();
+	cJSON_AddStringToObject(ev, "event", "done");
+	cJSON_AddBoolToObject(ev, "ok", ok);
+	if (error != NULL)
+		cJSON_AddStringToObject(ev, "error", error);
+	cJSON_AddNumberToObject(ev, "wall_ms",
+		avnutil_clock_ms(CLOCK_MONOTONIC) - wall);
+	cJSON_AddNumberToObject(ev, "cpu_ms",
+		avnutil_clock_ms(CLOCK_PROCESS_CPUTIME_ID) - cpu);
+
+	ok = send_event(fd, ev);
+
+	avnscript_free(avn);
+	cJSON_Delete(req);
+
+	/* Get the next one ready while there's nothing else to do. */
+	if (*warm == NULL)
+		*warm = warm_up();
+
+	return ok;
+}
+
+
+static void
+settings_save(struct settings *set)
+{
+	avncache_stats(&set->cache);
+	avnpixelcache_stats(&set->pixelcache);
+	set->nthreads = avntiles_nthreads();
+	set->snapshot_budget = avnraster_snapshot_budget();
+}
+
+
+/*
+ * The caches are only switched over if the job changed them, since turning
+ * the render cache on again rescans its whole directory.
+ */
+static void
+settings_restore(const struct settings *set)
+{
+	struct avncachestats cache;
+	struct avnpixelcachestats pixelcache;
+
+	avncache_stats(&cache);
+	if (!set->cache.enabled) {
+		avncache_disable();
+	} else if (!cache.enabled || (cache.size != set->cache.size) ||
+		strcmp(cache.dir, set->cache.dir)) {
+			if (!avncache_enable(set->cache.dir, set->cache.size))
+				avncache_disable();
+	}
+
+	avnpixelcache_stats(&pixelcache);
+	if (!set->pixelcache.enabled) {
+		avnpixelcache_disable();
+	} else if (!pixelcache.enabled ||
+		(pixelcache.threshold != set->pixelcache.threshold) ||
+		strcmp(pixelcache.dir, set->pixelcache.dir)) {
+			if (!avnpixelcache_enable(set->pixelcache.dir,
+				set->pixelcache.threshold))
+					avnpixelcache_disable();
+	}
+
+	avntiles_set_nthreads(set->nthreads);
+	avnraster_set_snapshot_budget(set->snapshot_budget);
+}
+
+
+/*
+ * Sends the event as one line and frees it.
+ */
+static bool
+send_event(const int fd, cJSON *ev)
+{
+	char *str;
+	bool ok;
+
+	str = cJSON_PrintUnformatted(ev);
+	cJSON_Delete(ev);
+
+	if (str == NULL)
+		return false;
+
+	ok = write_full(fd, str, strlen(str)) && write_full(fd, "\n", 1);
+	free(str);
+	return ok;
+}
+
+
+static bool
+write_full(int fd, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = write(fd, p, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		p += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+
+static void
+on_signal(int sig)
+{
+	stopping = 1;
+}
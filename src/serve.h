@@ -0,0 +1,20 @@
+/*
+ * vim: noet
+ *
+ * serve.h
+ * Christian Koch <cfkoch@sdf.lonestar.org>
+ */
+
+#ifndef AVENIDA_SERVE_H
+#define AVENIDA_SERVE_H
+
+#include <stdbool.h>
+
+#define AVNSERVE_MAX_WORKERS 256
+#define AVNSERVE_MAX_REQUEST 65536
+#define AVNSERVE_MAX_ARGS 256
+#define AVNSERVE_BACKLOG 128
+
+bool avnserve_run(const char *path, const unsigned int nworkers);
+
+#endif /* AVENIDA_SERVE_H */
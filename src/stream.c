@@ -0,0 +1,671 @@
+/*
+ * vim: noet
+ *
+ * stream.c
+ * Christian Koch <cfkoch@sdf.lonestar.org>
+ *
+ * Streaming renders images which are too big to hold in memory. Instead of
+ * decoding the whole image into a wand, the decoder hands over one row at
+ * a time (GraphicsMagick's ReadStream()), each row is pushed through a
+ * chain of stages, and whatever comes out of the last stage goes straight
+ * into the file. Only PAM and PPM can be written like that, since they're
+ * nothing but a header and the rows one after another.
+ *
+ * That only works if every output row depends on a bounded number of input
+ * rows around it: point ops, horizontal flips, crops, borders, and the
+ * small convolutions (see avnraster_halo()). Each run of point ops and
+ * convolutions is done a strip of rows at a time, along with the same halo
+ * banding uses, by avnraster_apply_plan() on a wand holding just that
+ * window. So memory is bounded by the width times the strip and halo rows,
+ * however tall the image is.
+ *
+ * Streaming doesn't touch the raster's image, snapshots or the render
+ * cache; it renders the whole history straight from the file.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include <wand/magick_wand.h>
+
+#include "commands.h"
+#include "oplist.h"
+#include "optimize.h"
+#include "raster.h"
+#include "stream.h"
+
+enum stagekind {
+	STAGE_STRIP,
+	STAGE_CROP,
+	STAGE_BORDER,
+	STAGE_SINK,
+};
+
+enum sinkformat {
+	SINK_PAM,
+	SINK_PPM,
+};
+
+/*
+ * Rows come into a stage "width" pixels wide, "height" of them in all, and
+ * go on to the next stage "out_width" wide, "out_height" of them.
+ */
+struct stage {
+	enum stagekind kind;
+	size_t width;
+	size_t height;
+	size_t out_width;
+	size_t out_height;
+	size_t nrows;
+
+	/* STAGE_STRIP: the window holds rows first to first + nwindow. */
+	struct avnop * const *ops;
+	unsigned int nops;
+	size_t halo;
+	unsigned char *window;
+	size_t first;
+	size_t nwindow;
+	size_t done;
+
+	/* STAGE_CROP and STAGE_BORDER */
+	size_t x;
+	size_t y;
+
+	/* STAGE_STRIP, STAGE_BORDER and STAGE_SINK */
+	unsigned char *row;
+
+	/* STAGE_BORDER: a row of nothing but the border color. */
+	unsigned char *fill;
+
+	/* STAGE_SINK */
+	enum sinkformat format;
+	FILE *fp;
+	bool header;
+};
+
+struct stream {
+	struct stage *stages;
+	unsigned int nstages;
+	unsigned int capacity;
+	unsigned int depth;
+	size_t bpp;
+	StorageType storage;
+	bool matte;
+	PixelWand *black;
+	unsigned char *row;
+	size_t width;
+	size_t height;
+	size_t y;
+	bool ok;
+};
+
+/*
+ * ReadStream() has no way to pass anything along to the handler, so this
+ * is the stream being read. There's only ever one at a time.
+ */
+static struct stream *current = NULL;
+
+static bool plan_stages(struct stream *, const avnoplist *,
+	const enum sinkformat, FILE *);
+static bool setup_border(struct stream *, struct stage *, const struct avnop *);
+static void teardown(struct stream *);
+static unsigned int stream_depth(const avnraster *);
+static unsigned int source_row(const Image *, const void *, const size_t);
+static bool push(struct stream *, struct stage *, const unsigned char *);
+static bool finish(struct stream *, struct stage *);
+static bool strip_flush(struct stream *, struct stage *);
+static bool sink_header(struct stream *, struct stage *);
+static bool sink_row(struct stream *, struct stage *, const unsigned char *);
+static bool sink_format(const char *, enum sinkformat *);
+
+/*
+ * Whether avnraster_stream() can do the raster's history.
+ */
+bool
+avnraster_streamable(const avnraster *avn)
+{
+	struct stream st;
+	avnoplist plan;
+	bool ok;
+
+	/* The decoder streams out of a file, so there has to be one. */
+	if (avn->blob)
+		return false;
+
+	if (!avnraster_optimize(avn->history.ops, avn->history.nops, &plan))
+		return false;
+
+	memset(&st, 0, sizeof(st));
+	st.width = avn->source_width;
+	st.height = avn->source_height;
+	st.depth = stream_depth(avn);
+	st.bpp = 4 * (st.depth / 8);
+
+	ok = plan_stages(&st, &plan, SINK_PAM, NULL);
+
+	teardown(&st);
+	avnoplist_free(&plan);
+	return ok;
+}
+
+
+/*
+ * Renders the raster's whole history into the file at the given path,
+ * which has to end in .pam or .ppm. Returns false if that can't be done,
+ * including when the history has ops which can't be streamed, in which
+ * case nothing is written.
+ */
+bool
+avnraster_stream(avnraster *avn, const char *path)
+{
+	struct stream st;
+	enum sinkformat format;
+	avnoplist plan;
+	ImageInfo *info;
+	ExceptionInfo ex;
+	Image *image;
+	FILE *fp;
+	bool ok;
+
+	if (avn->blob || (current != NULL) || !sink_format(path, &format))
+		return false;
+
+	if (!avnraster_optimize(avn->history.ops, avn->history.nops, &plan))
+		return false;
+
+	/*
+	 * The whole history is streamed from the file, so it starts at the
+	 * source's size, whatever a render has left in the info since.
+	 */
+	memset(&st, 0, sizeof(st));
+	st.width = avn->source_width;
+	st.height = avn->source_height;
+	st.depth = stream_depth(avn);
+	st.bpp = 4 * (st.depth / 8);
+	st.storage = (st.depth == 16) ? ShortPixel : CharPixel;
+	st.ok = true;
+
+	if ((fp = fopen(path, "wb")) == NULL) {
+		avnoplist_free(&plan);
+		return false;
+	}
+
+	if (!plan_stages(&st, &plan, format, fp) ||
+		((st.row = malloc(st.width * st.bpp)) == NULL) ||
+		((st.black = NewPixelWand()) == NULL)) {
+			teardown(&st);
+			avnoplist_free(&plan);
+			fclose(fp);
+			unlink(path);
+			return false;
+	}
+
+	PixelSetColor(st.black, "black");
+
+	info = CloneImageInfo(NULL);
+	snprintf(info->filename, MaxTextExtent, "%s", avn->info.path);
+	GetExceptionInfo(&ex);
+
+	current = &st;
+	image = ReadStream(info, source_row, &ex);
+	current = NULL;
+
+	ok = (image != NULL) && st.ok && (st.y == st.height) &&
+		finish(&st, &st.stages[0]);
+
+	if (image != NULL)
+		DestroyImage(image);
+	DestroyExceptionInfo(&ex);
+	DestroyImageInfo(info);
+	teardown(&st);
+	avnoplist_free(&plan);
+
+	if (fclose(fp) != 0)
+		ok = false;
+	if (!ok)
+		unlink(path);
+
+	return ok;
+}
+
+/* */
+
+/*
+ * Turns the plan into a chain of stages, ending with the sink. Returns
+ * false if some op can't be streamed.
+ */
+static bool
+plan_stages(struct stream *st, const avnoplist *plan,
+	const enum sinkformat format, FILE *fp)
+{
+	struct stage *sg;
+	const struct avnop *op;
+	size_t width = st->width, height = st->height;
+	unsigned int i;
+	long halo;
+
+	/* At worst, every op is a stage of its own. */
+	if ((st->stages = calloc(plan->nops + 1, sizeof(struct stage))) == NULL)
+		return false;
+	st->capacity = plan->nops + 1;
+
+	for (i = 0; i < plan->nops; i++) {
+		op = plan->ops[i];
+		halo = avnraster_halo(op);
+		sg = &st->stages[st->nstages];
+
+		/* Strips take as many ops in a row as they can get. */
+		if ((halo >= 0) && (st->nstages > 0) &&
+			(st->stages[st->nstages-1].kind == STAGE_STRIP)) {
+				sg = &st->stages[st->nstages-1];
+				sg->nops++;
+				sg->halo += halo;
+				continue;
+		}
+
+		sg->width = sg->out_width = width;
+		sg->height = sg->out_height = height;
+
+		if (halo >= 0) {
+			sg->kind = STAGE_STRIP;
+			sg->ops = plan->ops + i;
+			sg->nops = 1;
+			sg->halo = halo;
+		} else if (op->name == RASTER_CROP) {
+			/* Same as GraphicsMagick: whatever part is in the image. */
+			sg->kind = STAGE_CROP;
+			sg->x = op->args[0].arg_uint;
+			sg->y = op->args[1].arg_uint;
+			if ((sg->x >= width) || (sg->y >= height))
+				return false;
+			sg->out_width = width - sg->x;
+			if (op->args[2].arg_uint < sg->out_width)
+				sg->out_width = op->args[2].arg_uint;
+			sg->out_height = height - sg->y;
+			if (op->args[3].arg_uint < sg->out_height)
+				sg->out_height = op->args[3].arg_uint;
+		} else if (op->name == RASTER_BORDER) {
+			sg->kind = STAGE_BORDER;
+			sg->x = op->args[0].arg_uint;
+			sg->y = op->args[1].arg_uint;
+			sg->out_width = width + (2 * sg->x);
+			sg->out_height = height + (2 * sg->y);
+			if (!setup_border(st, sg, op))
+				return false;
+		} else {
+			return false;
+		}
+
+		width = sg->out_width;
+		height = sg->out_height;
+		st->nstages++;
+	}
+
+	for (i = 0; i < st->nstages; i++) {
+		sg = &st->stages[i];
+		if (sg->kind != STAGE_STRIP)
+			continue;
+		sg->window = malloc((AVNSTREAM_STRIP_ROWS + (2 * sg->halo)) *
+			sg->width * st->bpp);
+		sg->row = malloc(AVNSTREAM_STRIP_ROWS * sg->width * st->bpp);
+		if ((sg->window == NULL) || (sg->row == NULL))
+			return false;
+	}
+
+	sg = &st->stages[st->nstages++];
+	sg->kind = STAGE_SINK;
+	sg->width = sg->out_width = width;
+	sg->height = sg->out_height = height;
+	sg->format = format;
+	sg->fp = fp;
+
+	/* Three or four channels, at one or two bytes each. */
+	return (sg->row = malloc(width * st->bpp)) != NULL;
+}
+
+
+/*
+ * The border's rows above and below the image are nothing but the border
+ * color, and every row of the image gets copied into the middle of one
+ * which starts out the same.
+ */
+static bool
+setup_border(struct stream *st, struct stage *sg, const struct avnop *op)
+{
+	PixelWand *colorw;
+	unsigned int max = (st->depth == 16) ? 65535 : 255;
+	unsigned int rgba[4];
+	uint16_t *p16;
+	size_t x;
+	int i;
+
+	if (((sg->row = malloc(sg->out_width * st->bpp)) == NULL) ||
+		((sg->fill = malloc(sg->out_width * st->bpp)) == NULL))
+			return false;
+
+	if ((colorw = NewPixelWand()) == NULL)
+		return false;
+
+	if (PixelSetColor(colorw, op->args[2].arg_str) != MagickPass) {
+		DestroyPixelWand(colorw);
+		return false;
+	}
+
+	rgba[0] = (unsigned int)(PixelGetRed(colorw) * max + 0.5);
+	rgba[1] = (unsigned int)(PixelGetGreen(colorw) * max + 0.5);
+	rgba[2] = (unsigned int)(PixelGetBlue(colorw) * max + 0.5);
+	rgba[3] = (unsigned int)((1.0 - PixelGetOpacity(colorw)) * max + 0.5);
+	DestroyPixelWand(colorw);
+
+	for (x = 0; x < sg->out_width; x++) {
+		for (i = 0; i < 4; i++) {
+			if (st->depth == 16) {
+				p16 = (uint16_t *)sg->fill;
+				p16[(x * 4) + i] = rgba[i];
+			} else {
+				sg->fill[(x * 4) + i] = rgba[i];
+			}
+		}
+	}
+
+	memcpy(sg->row, sg->fill, sg->out_width * st->bpp);
+	return true;
+}
+
+
+static void
+teardown(struct stream *st)
+{
+	unsigned int i;
+
+	/* Stages which never made it into the chain may have buffers too. */
+	for (i = 0; i < st->capacity; i++) {
+		free(st->stages[i].window);
+		free(st->stages[i].row);
+		free(st->stages[i].fill);
+	}
+
+	free(st->stages);
+	free(st->row);
+	if (st->black != NULL)
+		DestroyPixelWand(st->black);
+}
+
+
+/*
+ * Streams as deep as the source is, the same as a render and write would
+ * come out, rather than as deep as GraphicsMagick's quanta go.
+ */
+static unsigned int
+stream_depth(const avnraster *avn)
+{
+	return ((QuantumDepth > 8) && (avn->info.depth > 8)) ? 16 : 8;
+}
+
+
+/*
+ * Called by the decoder with each row of the image, top to bottom.
+ *
+ * XXX Assumes the coder hands rows over in order and only once, which
+ * holds for everything which can stream at all; an interlaced PNG, say,
+ * gets deinterlaced before we see it.
+ */
+static unsigned int
+source_row(const Image *image, const void *pixels, const size_t columns)
+{
+	struct stream *st = current;
+	const PixelPacket *p = pixels;
+	uint16_t *p16;
+	size_t x;
+
+	if ((st == NULL) || !st->ok)
+		return MagickFail;
+
+	if ((st->y >= st->height) || (columns != st->width)) {
+		st->ok = false;
+		return MagickFail;
+	}
+
+	if (st->y == 0)
+		st->matte = image->matte ? true : false;
+
+	for (x = 0; x < columns; x++) {
+		if (st->depth == 16) {
+			p16 = (uint16_t *)st->row + (x * 4);
+			p16[0] = ScaleQuantumToShort(p[x].red);
+			p16[1] = ScaleQuantumToShort(p[x].green);
+			p16[2] = ScaleQuantumToShort(p[x].blue);
+			p16[3] = st->matte ?
+				ScaleQuantumToShort(MaxRGB - p[x].opacity) : 65535;
+		} else {
+			st->row[(x * 4) + 0] = ScaleQuantumToChar(p[x].red);
+			st->row[(x * 4) + 1] = ScaleQuantumToChar(p[x].green);
+			st->row[(x * 4) + 2] = ScaleQuantumToChar(p[x].blue);
+			st->row[(x * 4) + 3] = st->matte ?
+				ScaleQuantumToChar(MaxRGB - p[x].opacity) : 255;
+		}
+	}
+
+	st->y++;
+	st->ok = push(st, &st->stages[0], st->row);
+	return st->ok ? MagickPass : MagickFail;
+}
+
+
+/*
+ * Hands a row to a stage, which passes on whatever rows it can.
+ */
+static bool
+push(struct stream *st, struct stage *sg, const unsigned char *row)
+{
+	size_t bpr = sg->width * st->bpp, need;
+	size_t i, y = sg->nrows++;
+
+	switch (sg->kind) {
+	case STAGE_STRIP:
+		memcpy(sg->window + (sg->nwindow * bpr), row, bpr);
+		sg->nwindow++;
+
+		/* Wait for the whole next strip and the halo under it. */
+		need = sg->done + AVNSTREAM_STRIP_ROWS + sg->halo;
+		if (need > sg->height)
+			need = sg->height;
+		if (sg->nrows < need)
+			return true;
+		return strip_flush(st, sg);
+
+	case STAGE_CROP:
+		if ((y < sg->y) || (y >= sg->y + sg->out_height))
+			return true;
+		return push(st, sg + 1, row + (sg->x * st->bpp));
+
+	case STAGE_BORDER:
+		for (i = 0; (y == 0) && (i < sg->y); i++) {
+			if (!push(st, sg + 1, sg->fill))
+				return false;
+		}
+
+		/* Only the middle gets written over, so the sides stay put. */
+		memcpy(sg->row + (sg->x * st->bpp), row, bpr);
+		if (!push(st, sg + 1, sg->row))
+			return false;
+
+		for (i = 0; (y + 1 == sg->height) && (i < sg->y); i++) {
+			if (!push(st, sg + 1, sg->fill))
+				return false;
+		}
+		return true;
+
+	case STAGE_SINK:
+		return sink_row(st, sg, row);
+
+	default:
+		return false; /* NOTREACHED */
+	}
+}
+
+
+/*
+ * Called once every row has been pushed, to let the stages finish up.
+ * Only strips have anything left over by then.
+ */
+static bool
+finish(struct stream *st, struct stage *sg)
+{
+	for (; sg->kind != STAGE_SINK; sg++) {
+		if (sg->nrows != sg->height)
+			return false;
+
+		while ((sg->kind == STAGE_STRIP) && (sg->done < sg->height)) {
+			if (!strip_flush(st, sg))
+				return false;
+		}
+	}
+
+	return fflush(sg->fp) == 0;
+}
+
+
+/*
+ * Renders the next strip of rows, passes them on, and forgets whatever
+ * rows the strip after it won't need.
+ */
+static bool
+strip_flush(struct stream *st, struct stage *sg)
+{
+	MagickWand *wand;
+	avnraster *avn;
+	size_t bpr = sg->width * st->bpp;
+	size_t rows, top, bottom, keep, i;
+	bool ok;
+
+	rows = sg->height - sg->done;
+	if (rows > AVNSTREAM_STRIP_ROWS)
+		rows = AVNSTREAM_STRIP_ROWS;
+
+	top = (sg->done > sg->halo) ? sg->done - sg->halo : 0;
+	bottom = sg->done + rows + sg->halo;
+	if (bottom > sg->height)
+		bottom = sg->height;
+
+	if ((top < sg->first) || (bottom > sg->first + sg->nwindow))
+		return false; /* NOTREACHED */
+
+	if ((wand = NewMagickWand()) == NULL)
+		return false;
+
+	if ((MagickNewImage(wand, sg->width, bottom - top, st->black) != MagickPass) ||
+		(MagickSetImageMatte(wand, st->matte) != MagickPass) ||
+		(MagickSetImagePixels(wand, 0, 0, sg->width, bottom - top, "RGBA",
+		st->storage, sg->window + ((top - sg->first) * bpr)) != MagickPass)) {
+			DestroyMagickWand(wand);
+			return false;
+	}
+
+	if ((avn = avnraster_new_with_wand("stream", wand)) == NULL) {
+		DestroyMagickWand(wand);
+		return false;
+	}
+
+	ok = avnraster_apply_plan(avn, sg->ops, sg->nops, false) &&
+		(MagickGetImageWidth(avn->image) == sg->width) &&
+		(MagickGetImagePixels(avn->image, 0, sg->done - top, sg->width, rows,
+		"RGBA", st->storage, sg->row) == MagickPass);
+
+	avnraster_free(avn);
+
+	for (i = 0; ok && (i < rows); i++)
+		ok = push(st, sg + 1, sg->row + (i * bpr));
+
+	sg->done += rows;
+
+	keep = (sg->done > sg->halo) ? sg->done - sg->halo : 0;
+	if (keep > sg->first) {
+		memmove(sg->window, sg->window + ((keep - sg->first) * bpr),
+			(sg->first + sg->nwindow - keep) * bpr);
+		sg->nwindow -= keep - sg->first;
+		sg->first = keep;
+	}
+
+	return ok;
+}
+
+
+/*
+ * The header goes out with the first row, since only then do we know
+ * whether the image has an alpha channel.
+ */
+static bool
+sink_header(struct stream *st, struct stage *sg)
+{
+	unsigned int max = (st->depth == 16) ? 65535 : 255;
+	int n;
+
+	if (sg->format == SINK_PPM) {
+		n = fprintf(sg->fp, "P6\n%zu %zu\n%u\n", sg->width, sg->height, max);
+	} else {
+		n = fprintf(sg->fp, "P7\nWIDTH %zu\nHEIGHT %zu\nDEPTH %u\n"
+			"MAXVAL %u\nTUPLTYPE %s\nENDHDR\n", sg->width, sg->height,
+			st->matte ? 4 : 3, max, st->matte ? "RGB_ALPHA" : "RGB");
+	}
+
+	sg->header = true;
+	return n > 0;
+}
+
+
+/*
+ * PPM and PAM samples are big-endian, and PPM has no alpha.
+ */
+static bool
+sink_row(struct stream *st, struct stage *sg, const unsigned char *row)
+{
+	const uint16_t *p16 = (const uint16_t *)row;
+	unsigned char *q = sg->row;
+	unsigned int channels;
+	size_t x;
+	int c;
+
+	if (!sg->header && !sink_header(st, sg))
+		return false;
+
+	channels = ((sg->format == SINK_PAM) && st->matte) ? 4 : 3;
+
+	for (x = 0; x < sg->width; x++) {
+		for (c = 0; c < channels; c++) {
+			if (st->depth == 16) {
+				*q++ = p16[(x * 4) + c] >> 8;
+				*q++ = p16[(x * 4) + c] & 0xff;
+			} else {
+				*q++ = row[(x * 4) + c];
+			}
+		}
+	}
+
+	return fwrite(sg->row, q - sg->row, 1, sg->fp) == 1;
+}
+
+
+static bool
+sink_format(const char *path, enum sinkformat *format)
+{
+	const char *ext;
+
+	if ((ext = strrchr(path, '.')) == NULL)
+		return false;
+
+	if (!strcasecmp(ext, ".pam")) {
+		*format = SINK_PAM;
+		return true;
+	} else if (!strcasecmp(ext, ".ppm")) {
+		*format = SINK_PPM;
+		return true;
+	}
+
+	return false;
+}
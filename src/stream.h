@@ -0,0 +1,24 @@
+/*
+ * vim: noet
+ *
+ * stream.h
+ * Christian Koch <cfkoch@sdf.lonestar.org>
+ */
+
+#ifndef AVENIDA_STREAM_H
+#define AVENIDA_STREAM_H
+
+#include <stdbool.h>
+
+#include "raster.h"
+
+/*
+ * How many rows a strip of the image is. Each run of ops in the chain
+ * keeps this many rows, plus its halo above and below, around at once.
+ */
+#define AVNSTREAM_STRIP_ROWS 64
+
+bool avnraster_streamable(const avnraster *);
+bool avnraster_stream(avnraster *, const char *path);
+
+#endif /* AVENIDA_STREAM_H */
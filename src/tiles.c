@@ -0,0 +1,161 @@
+/*
+ * vim: noet
+ *
+ * tiles.c
+ * Christian Koch <cfkoch@sdf.lonestar.org>
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <unistd.h>
+
+#include "tiles.h"
+
+/*
+ * Zero means "however many CPUs are online".
+ */
+static unsigned int nthreads = 0;
+
+struct tilerun {
+	pthread_mutex_t lock;
+	unsigned int next;
+	unsigned int ntasks;
+	bool ok;
+	avntiles_fn fn;
+	void *arg;
+};
+
+static void *tile_worker(void *);
+
+void
+avntiles_set_nthreads(const unsigned int n)
+{
+	nthreads = (n > AVNTILES_MAX_THREADS) ? AVNTILES_MAX_THREADS : n;
+}
+
+
+unsigned int
+avntiles_nthreads(void)
+{
+	long ncpu;
+
+	if (nthreads > 0)
+		return nthreads;
+
+	if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		return 1;
+
+	return (ncpu > AVNTILES_MAX_THREADS) ? AVNTILES_MAX_THREADS : ncpu;
+}
+
+
+/*
+ * Splits an image of the given height into at most maxbands bands of
+ * roughly equal size, each at least AVNTILES_MIN_BAND_ROWS rows tall, and
+ * with up to "halo" rows of context on either side. Returns the number of
+ * bands written.
+ */
+unsigned int
+avntiles_bands(struct avnband *bands, const unsigned int maxbands,
+	const size_t height, const size_t halo)
+{
+	unsigned int i, n;
+	size_t y, rows;
+
+	n = maxbands;
+	if (height / AVNTILES_MIN_BAND_ROWS < n)
+		n = height / AVNTILES_MIN_BAND_ROWS;
+	if (n < 1)
+		n = 1;
+
+	y = 0;
+	for (i = 0; i < n; i++) {
+		rows = (height - y) / (n - i);
+		bands[i].y = y;
+		bands[i].rows = rows;
+		bands[i].halo_top = (y < halo) ? y : halo;
+		bands[i].halo_bottom = (height - (y + rows) < halo) ?
+			height - (y + rows) : halo;
+		y += rows;
+	}
+
+	return n;
+}
+
+
+/*
+ * Runs fn(arg, task) for every task in [0, ntasks), spread across the
+ * configured number of threads. Returns true only if every task did.
+ *
+ * The threads only live for the duration of one call. Spinning them up is
+ * cheap next to a full-image pass, and it means there's nothing left
+ * running behind our back if the process forks.
+ */
+bool
+avntiles_run(const unsigned int ntasks, avntiles_fn fn, void *arg)
+{
+	pthread_t threads[AVNTILES_MAX_THREADS];
+	struct tilerun run;
+	unsigned int i, n, nstarted;
+
+	if (ntasks == 0)
+		return true;
+
+	n = avntiles_nthreads();
+	if (n > ntasks)
+		n = ntasks;
+
+	run.next = 0;
+	run.ntasks = ntasks;
+	run.ok = true;
+	run.fn = fn;
+	run.arg = arg;
+
+	pthread_mutex_init(&run.lock, NULL);
+
+	/* The calling thread works too, instead of just waiting around. */
+	for (nstarted = 0; nstarted < n - 1; nstarted++) {
+		if (pthread_create(&threads[nstarted], NULL, tile_worker, &run) != 0)
+			break;
+	}
+
+	tile_worker(&run);
+
+	for (i = 0; i < nstarted; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_mutex_destroy(&run.lock);
+	return run.ok;
+}
+
+/* */
+
+static void *
+tile_worker(void *p)
+{
+	struct tilerun *run = p;
+	unsigned int task;
+	bool ok;
+
+	for (;;) {
+		pthread_mutex_lock(&run->lock);
+		task = run->next;
+		if (task < run->ntasks)
+			(run->next)++;
+		pthread_mutex_unlock(&run->lock);
+
+		if (task >= run->ntasks)
+			break;
+
+		ok = run->fn(run->arg, task);
+
+		if (!ok) {
+			pthread_mutex_lock(&run->lock);
+			run->ok = false;
+			pthread_mutex_unlock(&run->lock);
+		}
+	}
+
+	return NULL;
+}
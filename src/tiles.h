@@ -0,0 +1,37 @@
+/*
+ * vim: noet
+ *
+ * tiles.h
+ * Christian Koch <cfkoch@sdf.lonestar.org>
+ */
+
+#ifndef AVENIDA_TILES_H
+#define AVENIDA_TILES_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define AVNTILES_MAX_THREADS 64
+#define AVNTILES_MIN_BAND_ROWS 64
+
+/*
+ * A horizontal band of an image. The halo rows are the extra rows above and
+ * below the band that a kernel needs to look at, but which belong to the
+ * neighbouring bands.
+ */
+struct avnband {
+	size_t y;
+	size_t rows;
+	size_t halo_top;
+	size_t halo_bottom;
+};
+
+typedef bool (*avntiles_fn)(void *arg, const unsigned int task);
+
+void avntiles_set_nthreads(const unsigned int);
+unsigned int avntiles_nthreads(void);
+unsigned int avntiles_bands(struct avnband *, const unsigned int maxbands,
+	const size_t height, const size_t halo);
+bool avntiles_run(const unsigned int ntasks, avntiles_fn, void *arg);
+
+#endif /* AVENIDA_TILES_H */
@@ -0,0 +1,48 @@
+/*
+ * vim: noet
+ *
+ * util.c
+ * Christian Koch <cfkoch@sdf.lonestar.org>
+ *
+ * The clocks and memory figures that the benchmark, the render profile
+ * and server mode all report.
+ */
+
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "util.h"
+
+/*
+ * The given clock in milliseconds, or 0 if it can't be read.
+ */
+double
+avnutil_clock_ms(const clockid_t clock)
+{
+	struct timespec ts;
+
+	if (clock_gettime(clock, &ts) == -1)
+		return 0.0;
+	return (ts.tv_sec * 1000.0) + (ts.tv_nsec / 1e6);
+}
+
+
+/*
+ * The process's peak resident set size so far. Linux reports ru_maxrss in
+ * kilobytes, macOS in bytes.
+ */
+long
+avnutil_peak_rss_kb(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) == -1)
+		return 0;
+
+#ifdef __APPLE__
+	return ru.ru_maxrss / 1024;
+#else
+	return ru.ru_maxrss;
+#endif
+}
@@ -0,0 +1,16 @@
+/*
+ * vim: noet
+ *
+ * util.h
+ * Christian Koch <cfkoch@sdf.lonestar.org>
+ */
+
+#ifndef AVENIDA_UTIL_H
+#define AVENIDA_UTIL_H
+
+#include <time.h>
+
+double avnutil_clock_ms(const clockid_t);
+long avnutil_peak_rss_kb(void);
+
+#endif /* AVENIDA_UTIL_H */
@@ -0,0 +1,219 @@
+/*
+ * vim: noet
+ *
+ * variants.c
+ * Christian Koch <cfkoch@sdf.lonestar.org>
+ */
+
+/*
+ * Fans one raster out into several outputs, e.g. a set of widths for a
+ * responsive page, without going back to the file for each of them.
+ *
+ * Whatever has been done to the raster so far is rendered once and shared.
+ * Each variant is then resized from the smallest image already made that
+ * is at least as big as it, rather than from the full size one, so the
+ * work shrinks along with the outputs. That makes a tree, biggest first;
+ * everything on one level of it only depends on the level above, so each
+ * level is resized and written in parallel.
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <wand/magick_wand.h>
+
+#include "raster.h"
+#include "tiles.h"
+#include "variants.h"
+
+struct fanout {
+	struct avnvariant *variants;
+	avnraster *rendered[AVNVARIANTS_MAX];
+	int parent[AVNVARIANTS_MAX];
+	unsigned int level[AVNVARIANTS_MAX];
+	unsigned int tasks[AVNVARIANTS_MAX];
+};
+
+static void target_size(const avnraster *, struct avnvariant *);
+static void plan_tree(struct fanout *, const unsigned int);
+static bool variant_task(void *, const unsigned int);
+
+/*
+ * Returns true if every variant was written; each one's "ok" says how it
+ * went on its own. On the way out, the variants' sizes are filled in with
+ * what they were actually resized to.
+ */
+bool
+avnraster_variants(avnraster *avn, struct avnvariant *variants,
+	const unsigned int nvariants)
+{
+	struct fanout fan;
+	MagickWand *base, *wand;
+	unsigned int i, lvl, maxlevel, ntasks;
+	bool ok;
+
+	if ((nvariants == 0) || (nvariants > AVNVARIANTS_MAX))
+		return false;
+
+	/* The shared prefix is whatever's been done to the raster so far. */
+	if ((avn->nrendered != avn->history.nops) &&
+		!avnraster_render(avn, false))
+			return false;
+
+	if (!avnraster_sync(avn) || !avnraster_decode(avn))
+		return false;
+
+	fan.variants = variants;
+	for (i = 0; i < nvariants; i++) {
+		variants[i].ok = false;
+		fan.rendered[i] = NULL;
+		target_size(avn, &variants[i]);
+	}
+
+	plan_tree(&fan, nvariants);
+
+	maxlevel = 0;
+	for (i = 0; i < nvariants; i++) {
+		if (fan.level[i] > maxlevel)
+			maxlevel = fan.level[i];
+	}
+
+	for (lvl = 0; lvl <= maxlevel; lvl++) {
+		ntasks = 0;
+
+		/*
+		 * Cloning only bumps a reference count, but GraphicsMagick wants
+		 * that done on one thread at a time. If the parent didn't make
+		 * it, start over from the prefix instead.
+		 */
+		for (i = 0; i < nvariants; i++) {
+			if (fan.level[i] != lvl)
+				continue;
+
+			if ((fan.parent[i] >= 0) && (fan.rendered[fan.parent[i]] != NULL))
+				base = fan.rendered[fan.parent[i]]->image;
+			else
+				base = avn->image;
+
+			if ((wand = CloneMagickWand(base)) == NULL)
+				continue;
+
+			fan.rendered[i] = avnraster_new_with_wand(variants[i].path, wand);
+			if (fan.rendered[i] == NULL) {
+				DestroyMagickWand(wand);
+				continue;
+			}
+
+			fan.tasks[ntasks++] = i;
+		}
+
+		/* Nothing further down is cut from the level above any more. */
+		for (i = 0; i < nvariants; i++) {
+			if ((lvl > 0) && (fan.level[i] == lvl - 1)) {
+				avnraster_free(fan.rendered[i]);
+				fan.rendered[i] = NULL;
+			}
+		}
+
+		avntiles_run(ntasks, variant_task, &fan);
+	}
+
+	ok = true;
+	for (i = 0; i < nvariants; i++) {
+		avnraster_free(fan.rendered[i]);
+		ok = ok && variants[i].ok;
+	}
+
+	return ok;
+}
+
+/* */
+
+static void
+target_size(const avnraster *avn, struct avnvariant *v)
+{
+	const double w = (double)avn->info.width;
+	const double h = (double)avn->info.height;
+
+	if ((v->width == 0) && (v->height == 0)) {
+		v->width = avn->info.width;
+		v->height = avn->info.height;
+	} else if (v->height == 0) {
+		v->height = (size_t)fmax(1.0, round(v->width * h / w));
+	} else if (v->width == 0) {
+		v->width = (size_t)fmax(1.0, round(v->height * w / h));
+	}
+}
+
+
+/*
+ * Each variant's parent is the smallest variant that's at least as big in
+ * both directions, or -1 for the prefix itself. Going biggest first means
+ * a parent is always settled before anything that could hang off it.
+ */
+static void
+plan_tree(struct fanout *fan, const unsigned int nvariants)
+{
+	const struct avnvariant *v = fan->variants;
+	unsigned int order[AVNVARIANTS_MAX];
+	unsigned int i, j, k, tmp;
+	int best;
+
+	for (i = 0; i < nvariants; i++)
+		order[i] = i;
+
+	for (i = 1; i < nvariants; i++) {
+		for (j = i; j > 0; j--) {
+			if (v[order[j]].width * v[order[j]].height <=
+				v[order[j-1]].width * v[order[j-1]].height)
+					break;
+			tmp = order[j];
+			order[j] = order[j-1];
+			order[j-1] = tmp;
+		}
+	}
+
+	for (i = 0; i < nvariants; i++) {
+		k = order[i];
+		best = -1;
+
+		for (j = 0; j < i; j++) {
+			if ((v[order[j]].width < v[k].width) ||
+				(v[order[j]].height < v[k].height))
+					continue;
+			if ((best < 0) || (v[order[j]].width * v[order[j]].height <
+				v[best].width * v[best].height))
+					best = order[j];
+		}
+
+		fan->parent[k] = best;
+		fan->level[k] = (best < 0) ? 0 : fan->level[best] + 1;
+	}
+}
+
+
+static bool
+variant_task(void *arg, const unsigned int task)
+{
+	struct fanout *fan = arg;
+	struct avnvariant *v;
+	avnraster *r;
+	unsigned int i;
+
+	i = fan->tasks[task];
+	v = &fan->variants[i];
+	r = fan->rendered[i];
+
+	if ((r->info.width != v->width) || (r->info.height != v->height)) {
+		if (!avnraster_resize(r, v->width, v->height, v->filter) ||
+			!avnraster_apply_op(r, r->history.ops[r->history.nops - 1])) {
+				avnraster_free(r);
+				fan->rendered[i] = NULL;
+				return false;
+		}
+	}
+
+	v->ok = avnraster_write(r, v->path, &v->opts);
+	return v->ok;
+}
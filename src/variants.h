@@ -0,0 +1,36 @@
+/*
+ * vim: noet
+ *
+ * variants.h
+ * Christian Koch <cfkoch@sdf.lonestar.org>
+ */
+
+#ifndef AVENIDA_VARIANTS_H
+#define AVENIDA_VARIANTS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "raster.h"
+
+#define AVNVARIANTS_MAX 64
+
+/*
+ * One output of avnraster_variants(): the raster resized to width x height
+ * with the given filter (NULL for the default), and written to path. If
+ * only one of the dimensions is given, the other one keeps the aspect
+ * ratio; if neither is, the size stays as it is.
+ */
+struct avnvariant {
+	size_t width;
+	size_t height;
+	const char *filter;
+	const char *path;
+	avnwriteopts opts;
+	bool ok;
+};
+
+bool avnraster_variants(avnraster *, struct avnvariant *,
+	const unsigned int nvariants);
+
+#endif /* AVENIDA_VARIANTS_H */
@@ -5,6 +5,7 @@
  * Christian Koch <cfkoch@sdf.lonestar.org>
  */
 
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdlib.h>
 
@@ -33,7 +34,7 @@ avnvector_new(const size_t width, const size_t height)
 	cairo_surface_destroy(surf);
 	avn->info.width = (size_t)width;
 	avn->info.height = (size_t)height;
-	avn->nops = 0;
+	avnoplist_init(&avn->history);
 
 	return avn;
 }
@@ -42,21 +43,31 @@ avnvector_new(const size_t width, const size_t height)
 void
 avnvector_free(avnvector *avn)
 {
-	int i;
+	if (avn == NULL)
+		return;
 
-	for (i = 0; i < avn->nops; i++)
-		avnop_free(avn->ops[i]);
+	avnoplist_free(&avn->history);
 
 	cairo_destroy(avn->vector);
 	free(avn);
 }
 
 
-inline void
-avnvector_add_op(avnvector *avn, const struct avnop *op)
+/*
+ * Records an op; the arguments are as for avnoplist_add().
+ */
+bool
+avnvector_add_op(avnvector *avn, const enum avncmdname name,
+	const unsigned int nargs, ...)
 {
-	avn->ops[avn->nops] = (struct avnop *)op;
-	(avn->nops)++;
+	struct avnop *op;
+	va_list ap;
+
+	va_start(ap, nargs);
+	op = avnoplist_vadd(&avn->history, name, nargs, ap);
+	va_end(ap);
+
+	return op != NULL;
 }
 
 
@@ -75,42 +86,43 @@ avnvector_write(avnvector *avn, const char *path)
 	return ret == CAIRO_STATUS_SUCCESS ? true : false;
 }
 
-#define ARG(n) (avn->ops[i]->args[n])
-
 void
 avnvector_render(avnvector *avn)
 {
 	int i;
 
-	for (i = 0; i < avn->nops; i++) {
-		switch (avn->ops[i]->name) {
-		case VECTOR_CLOSEPATH:
-			__avnvector_closepath(avn);
-			break;
-		case VECTOR_LINETO:
-			__avnvector_lineto(avn, ARG(0)->arg_double, ARG(1)->arg_double);
-			break;
-		case VECTOR_MOVETO:
-			__avnvector_moveto(avn, ARG(0)->arg_double, ARG(1)->arg_double);
-			break;
-		case VECTOR_OPENPATH:
-			__avnvector_openpath(avn);
-			break;
-		case VECTOR_SETCAP:
-			__avnvector_setcap(avn);
-			break;
-		case VECTOR_SETCOLOR:
-			__avnvector_setcolor(avn, ARG(0)->arg_str);
-			break;
-		case VECTOR_SETWIDTH:
-			__avnvector_setwidth(avn, ARG(0)->arg_uint);
-			break;
-		case VECTOR_STROKE:
-			__avnvector_stroke(avn);
-			break;
-		default:
-			return; /* NOTREACHED */
-		}
+	for (i = 0; i < avn->history.nops; i++)
+		avnvector_apply_op(avn, avn->history.ops[i]);
+}
+
+
+#define ARG(n) (op->args[n])
+
+/*
+ * Draws a single op on the canvas right away.
+ */
+bool
+avnvector_apply_op(avnvector *avn, const struct avnop *op)
+{
+	switch (op->name) {
+	case VECTOR_CLOSEPATH:
+		return __avnvector_closepath(avn);
+	case VECTOR_LINETO:
+		return __avnvector_lineto(avn, ARG(0).arg_double, ARG(1).arg_double);
+	case VECTOR_MOVETO:
+		return __avnvector_moveto(avn, ARG(0).arg_double, ARG(1).arg_double);
+	case VECTOR_OPENPATH:
+		return __avnvector_openpath(avn);
+	case VECTOR_SETCAP:
+		return __avnvector_setcap(avn);
+	case VECTOR_SETCOLOR:
+		return __avnvector_setcolor(avn, ARG(0).arg_str);
+	case VECTOR_SETWIDTH:
+		return __avnvector_setwidth(avn, ARG(0).arg_uint);
+	case VECTOR_STROKE:
+		return __avnvector_stroke(avn);
+	default:
+		return false; /* NOTREACHED */
 	}
 }
 
@@ -129,13 +141,7 @@ __avnvector_closepath(avnvector *avn)
 bool
 avnvector_closepath(avnvector *avn)
 {
-	struct avnop *op;
-
-	if ((op = avnop_new(VECTOR_CLOSEPATH)) == NULL)
-		return false;
-
-	avnvector_add_op(avn, op);
-	return true;
+	return avnvector_add_op(avn, VECTOR_CLOSEPATH, 0);
 }
 
 
@@ -153,15 +159,8 @@ __avnvector_lineto(avnvector *avn, const double x, const double y)
 bool
 avnvector_lineto(avnvector *avn, const double x, const double y)
 {
-	struct avnop *op;
-
-	if ((op = avnop_new(VECTOR_LINETO)) == NULL)
-		return false;
-
-	avnop_add_arg(op, AVN_DOUBLE, x);
-	avnop_add_arg(op, AVN_DOUBLE, y);
-	avnvector_add_op(avn, op);
-	return true;
+	return avnvector_add_op(avn, VECTOR_LINETO, 2,
+		AVN_DOUBLE, x, AVN_DOUBLE, y);
 }
 
 
@@ -180,15 +179,8 @@ __avnvector_moveto(avnvector *avn, const double x, const double y)
 bool
 avnvector_moveto(avnvector *avn, const double x, const double y)
 {
-	struct avnop *op;
-
-	if ((op = avnop_new(VECTOR_MOVETO)) == NULL)
-		return false;
-
-	avnop_add_arg(op, AVN_DOUBLE, x);
-	avnop_add_arg(op, AVN_DOUBLE, y);
-	avnvector_add_op(avn, op);
-	return true;
+	return avnvector_add_op(avn, VECTOR_MOVETO, 2,
+		AVN_DOUBLE, x, AVN_DOUBLE, y);
 }
 
 
@@ -203,13 +195,7 @@ __avnvector_openpath(avnvector *avn)
 bool
 avnvector_openpath(avnvector *avn)
 {
-	struct avnop *op;
-
-	if ((op = avnop_new(VECTOR_OPENPATH)) == NULL)
-		return false;
-
-	avnvector_add_op(avn, op);
-	return true;
+	return avnvector_add_op(avn, VECTOR_OPENPATH, 0);
 }
 
 
@@ -266,11 +252,5 @@ __avnvector_stroke(avnvector *avn)
 bool
 avnvector_stroke(avnvector *avn)
 {
-	struct avnop *op;
-
-	if ((op = avnop_new(VECTOR_STROKE)) == NULL)
-		return false;
-
-	avnvector_add_op(avn, op);
-	return true;
+	return avnvector_add_op(avn, VECTOR_STROKE, 0);
 }
@@ -14,6 +14,7 @@
 
 #include "avenida.h"
 #include "commands.h"
+#include "oplist.h"
 
 struct avnvectorinfo {
 	size_t width;
@@ -24,17 +25,18 @@ typedef struct avnvectorinfo avnvectorinfo;
 struct avnvector {
 	cairo_t *vector;
 	avnvectorinfo info;
-	unsigned int nops;
-	struct avnop *ops[AVNMEDIA_MAX_OPS];
+	avnoplist history;
 };
 typedef struct avnvector avnvector;
 
 avnvector *avnvector_new(const size_t width, const size_t height);
 void avnvector_free(avnvector *);
-inline void avnvector_add_op(avnvector *, const struct avnop *);
+bool avnvector_add_op(avnvector *, const enum avncmdname,
+	const unsigned int nargs, ...);
 avnvector *avnvector_open(avnvector *, const char *path);
 bool avnvector_write(avnvector *, const char *path);
 void avnvector_render(avnvector *);
+bool avnvector_apply_op(avnvector *, const struct avnop *);
 
 bool avnvector_closepath(avnvector *);
 bool avnvector_lineto(avnvector *, const double x, const double y);